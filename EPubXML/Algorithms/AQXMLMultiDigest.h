@@ -0,0 +1,54 @@
+//
+//  AQXMLMultiDigest.h
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-24.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+
+// Multi-buffer SHA-256: independent messages are hashed side by side, four at a time in
+// 128-bit vectors (SSE or NEON), so a batch of small messages costs little more than hashing
+// the largest of them. A lane which finishes its message starts on the next one in the batch.
+// There's no SHA-1 kernel, nor any use of dedicated SHA instructions.
+
+#define AQXML_SHA256_LANES          4
+
+#define AQXML_SHA256_DIGEST_LENGTH  32
+
+__BEGIN_DECLS
+
+// Writes the digest of message i to digests + (i * AQXML_SHA256_DIGEST_LENGTH).
+extern void AQXMLSHA256MultiBuffer(const uint8_t * const * messages, const size_t * lengths,
+                                   size_t count, uint8_t * digests);
+
+__END_DECLS
@@ -0,0 +1,225 @@
+//
+//  AQXMLMultiDigest.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-24.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQXMLMultiDigest.h"
+#import <string.h>
+
+// one 32-bit word from each lane; the compiler maps this onto SSE or NEON registers
+typedef uint32_t _AQXMLLanes __attribute__((vector_size(AQXML_SHA256_LANES * sizeof(uint32_t))));
+
+static const uint32_t __sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t __sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// a lane with no message left hashes this, and its result is ignored
+static const uint8_t __idle_block[64];
+
+typedef struct _AQXMLLane {
+    const uint8_t * next;           // the next whole block of the message
+    size_t          blocks;         // whole blocks left before the tail
+    size_t          tailBlocks;     // padded blocks in the tail: one or two
+    size_t          tailDone;
+    size_t          message;        // index in the batch, or SIZE_MAX when idle
+    uint8_t         tail[128];      // the partial last block, padding and length
+} _AQXMLLane;
+
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline _AQXMLLanes __splat(uint32_t x)
+{
+    _AQXMLLanes v;
+    for ( int i = 0; i < AQXML_SHA256_LANES; i++ )
+        v[i] = x;
+    return ( v );
+}
+
+static inline uint32_t __load_be32(const uint8_t * p)
+{
+    return ( ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3] );
+}
+
+static void __lane_start(_AQXMLLane * lane, _AQXMLLanes state[8], int index,
+                         const uint8_t * message, size_t length, size_t messageIndex)
+{
+    size_t remainder = length % 64;
+    
+    lane->message = messageIndex;
+    lane->next = message;
+    lane->blocks = length / 64;
+    lane->tailBlocks = (remainder < 56 ? 1 : 2);
+    lane->tailDone = 0;
+    
+    // the tail holds the last partial block, a one bit, zeroes, then the length in bits
+    memset(lane->tail, 0, sizeof(lane->tail));
+    if ( remainder != 0 )
+        memcpy(lane->tail, message + (length - remainder), remainder);
+    lane->tail[remainder] = 0x80;
+    
+    uint64_t bits = (uint64_t)length * 8;
+    uint8_t * end = lane->tail + (lane->tailBlocks * 64);
+    for ( int i = 1; i <= 8; i++, bits >>= 8 )
+        end[-i] = (uint8_t)bits;
+    
+    for ( int i = 0; i < 8; i++ )
+        state[i][index] = __sha256_iv[i];
+}
+
+static inline const uint8_t * __lane_block(const _AQXMLLane * lane)
+{
+    if ( lane->message == SIZE_MAX )
+        return ( __idle_block );
+    if ( lane->blocks != 0 )
+        return ( lane->next );
+    return ( lane->tail + (lane->tailDone * 64) );
+}
+
+// returns YES once the lane's message is complete
+static inline BOOL __lane_advance(_AQXMLLane * lane)
+{
+    if ( lane->blocks != 0 )
+    {
+        lane->next += 64;
+        lane->blocks--;
+        return ( NO );
+    }
+    
+    return ( ++lane->tailDone == lane->tailBlocks );
+}
+
+static void __sha256_compress(_AQXMLLanes state[8], const uint8_t * const blocks[AQXML_SHA256_LANES])
+{
+    _AQXMLLanes w[16];
+    for ( int t = 0; t < 16; t++ )
+    {
+        for ( int i = 0; i < AQXML_SHA256_LANES; i++ )
+            w[t][i] = __load_be32(blocks[i] + (t * 4));
+    }
+    
+    _AQXMLLanes a = state[0], b = state[1], c = state[2], d = state[3];
+    _AQXMLLanes e = state[4], f = state[5], g = state[6], h = state[7];
+    
+    for ( int t = 0; t < 64; t++ )
+    {
+        if ( t >= 16 )
+        {
+            _AQXMLLanes w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+            _AQXMLLanes s1 = ROTR(w2, 17) ^ ROTR(w2, 19) ^ (w2 >> 10);
+            _AQXMLLanes s0 = ROTR(w15, 7) ^ ROTR(w15, 18) ^ (w15 >> 3);
+            w[t & 15] += s1 + w[(t - 7) & 15] + s0;
+        }
+        
+        _AQXMLLanes t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + __splat(__sha256_k[t]) + w[t & 15];
+        _AQXMLLanes t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void AQXMLSHA256MultiBuffer(const uint8_t * const * messages, const size_t * lengths,
+                            size_t count, uint8_t * digests)
+{
+    _AQXMLLane lanes[AQXML_SHA256_LANES];
+    _AQXMLLanes state[8];
+    size_t nextMessage = 0, active = 0;
+    
+    memset(state, 0, sizeof(state));
+    for ( int i = 0; i < AQXML_SHA256_LANES; i++ )
+    {
+        if ( nextMessage < count )
+        {
+            __lane_start(&lanes[i], state, i, messages[nextMessage], lengths[nextMessage], nextMessage);
+            nextMessage++;
+            active++;
+        }
+        else
+        {
+            lanes[i].message = SIZE_MAX;
+        }
+    }
+    
+    while ( active != 0 )
+    {
+        const uint8_t * blocks[AQXML_SHA256_LANES];
+        for ( int i = 0; i < AQXML_SHA256_LANES; i++ )
+            blocks[i] = __lane_block(&lanes[i]);
+        
+        __sha256_compress(state, blocks);
+        
+        for ( int i = 0; i < AQXML_SHA256_LANES; i++ )
+        {
+            _AQXMLLane * lane = &lanes[i];
+            if ( lane->message == SIZE_MAX || __lane_advance(lane) == NO )
+                continue;
+            
+            // store this lane's digest, then move it on to the next waiting message
+            uint8_t * md = digests + (lane->message * AQXML_SHA256_DIGEST_LENGTH);
+            for ( int j = 0; j < 8; j++ )
+            {
+                uint32_t v = state[j][i];
+                md[j * 4 + 0] = (uint8_t)(v >> 24);
+                md[j * 4 + 1] = (uint8_t)(v >> 16);
+                md[j * 4 + 2] = (uint8_t)(v >> 8);
+                md[j * 4 + 3] = (uint8_t)v;
+            }
+            
+            if ( nextMessage < count )
+            {
+                __lane_start(lane, state, i, messages[nextMessage], lengths[nextMessage], nextMessage);
+                nextMessage++;
+            }
+            else
+            {
+                lane->message = SIZE_MAX;
+                active--;
+            }
+        }
+    }
+}
@@ -36,6 +36,14 @@
 
 #import <Foundation/Foundation.h>
 
+// Octet-oriented transforms can also run a piece at a time: each call passes some of the
+// input, in order, and output is pushed to the downstream stage as it's produced. -finish
+// flushes anything held back and finishes the downstream stage. Either returns NO on failure.
+@protocol AQXMLStreamingTransform <NSObject>
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length;
+- (BOOL) finish;
+@end
+
 @interface AQXMLTransform : NSObject
 {
     AQXMLTransform * _next;
@@ -53,6 +61,34 @@
 // subclassers implement this method
 - (id) main;
 
+// Streaming: output goes to the downstream stage rather than being returned. By default a
+// stage which conforms to AQXMLStreamingTransform can stream NSData or NSInputStream input;
+// canonicalization overrides these to stream the canonical form of its XML input.
+@property (nonatomic, strong) id<AQXMLStreamingTransform> downstream;
+@property (nonatomic, readonly) BOOL canStreamInput;
+@property (nonatomic, readonly) BOOL canConsumeStream;
+- (BOOL) streamInput: (id) input;
+
+@end
+
+__BEGIN_DECLS
+
+// reads the stream to its end, passing everything to the stage, which isn't finished
+extern BOOL AQXMLTransformConsumeStream(id<AQXMLStreamingTransform> stage, NSInputStream * stream);
+
+__END_DECLS
+
+// A run of adjacent streaming stages, processed as one. Its input is streamed through all
+// of them without gathering any intermediate result, and the output of the last stage is
+// the output of the run.
+@interface AQXMLFusedTransform : AQXMLTransform
+
+// returns the chain with each run of two or more streaming stages replaced by a fused one
++ (AQXMLTransform *) transformByFusingChain: (AQXMLTransform *) chain;
+
+- (id) initWithStages: (NSArray *) stages;
+@property (nonatomic, readonly) NSArray * stages;
+
 @end
 
 #pragma mark - Algorithm URIs
@@ -44,6 +44,9 @@
 
 static NSMutableDictionary * __transforms = nil;
 
+// input streams are read in pieces of this size
+#define kAQXMLTransformStreamBufferSize     (64 * 1024)
+
 NSString * const AQXMLAlgorithmSHA1 = @"http://www.w3.org/2000/09/xmldsig#sha1";
 NSString * const AQXMLAlgorithmSHA256 = @"http://www.w3.org/2001/04/xmlenc#sha256";
 NSString * const AQXMLAlgorithmSHA384 = @"http://www.w3.org/2001/04/xmldsig-more#sha384";
@@ -191,4 +194,194 @@ NSString * const AQXMLAlgorithmSHA384_ENC = @"http://www.w3.org/2001/04/xmlenc#s
     return ( nil );
 }
 
+- (BOOL) canStreamInput
+{
+    return ( self.canConsumeStream );
+}
+
+- (BOOL) canConsumeStream
+{
+    return ( [self conformsToProtocol: @protocol(AQXMLStreamingTransform)] );
+}
+
+- (BOOL) streamInput: (id) input
+{
+    if ( [self conformsToProtocol: @protocol(AQXMLStreamingTransform)] == NO )
+        return ( NO );
+    
+    id<AQXMLStreamingTransform> stage = (id<AQXMLStreamingTransform>)self;
+    __block BOOL ok = YES;
+    if ( [input isKindOfClass: [NSData class]] )
+    {
+        [input enumerateByteRangesUsingBlock: ^(const void *bytes, NSRange byteRange, BOOL *stop) {
+            ok = [stage consumeBytes: bytes length: byteRange.length];
+            *stop = !ok;
+        }];
+    }
+    else if ( [input isKindOfClass: [NSInputStream class]] )
+    {
+        ok = AQXMLTransformConsumeStream(stage, input);
+    }
+    else
+    {
+        return ( NO );
+    }
+    
+    return ( ok && [stage finish] );
+}
+
+@end
+
+BOOL AQXMLTransformConsumeStream(id<AQXMLStreamingTransform> stage, NSInputStream * stream)
+{
+    uint8_t * buf = malloc(kAQXMLTransformStreamBufferSize);
+    if ( buf == NULL )
+        return ( NO );
+    
+    BOOL opened = ([stream streamStatus] == NSStreamStatusNotOpen);
+    if ( opened )
+        [stream open];
+    
+    BOOL ok = YES;
+    NSInteger numRead = 0;
+    while ( ok && (numRead = [stream read: buf maxLength: kAQXMLTransformStreamBufferSize]) > 0 )
+        ok = [stage consumeBytes: buf length: numRead];
+    
+    if ( numRead < 0 )
+        ok = NO;
+    
+    if ( opened )
+        [stream close];
+    free(buf);
+    
+    return ( ok );
+}
+
+#pragma mark -
+
+// collects the output of a fused run
+@interface _AQXMLDataSink : NSObject <AQXMLStreamingTransform>
+@property (nonatomic, readonly) NSMutableData * data;
+@end
+
+@implementation _AQXMLDataSink
+
+- (id) init
+{
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    _data = [NSMutableData new];
+    
+    return ( self );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    [_data appendBytes: bytes length: length];
+    return ( YES );
+}
+
+- (BOOL) finish
+{
+    return ( YES );
+}
+
+@end
+
+@implementation AQXMLFusedTransform
+
++ (AQXMLTransform *) transformByFusingChain: (AQXMLTransform *) chain
+{
+    NSMutableArray * transforms = [NSMutableArray new];
+    for ( AQXMLTransform * tx = chain; tx != nil; tx = tx.next )
+        [transforms addObject: tx];
+    
+    AQXMLTransform * head = nil, * tail = nil;
+    NSUInteger i = 0, count = [transforms count];
+    while ( i < count )
+    {
+        // a run starts at a stage which can stream its input, and continues
+        // for as long as the following stages take a stream
+        AQXMLTransform * tx = transforms[i];
+        NSUInteger end = i + 1;
+        if ( tx.canStreamInput )
+        {
+            while ( end < count && [transforms[end] canConsumeStream] )
+                end++;
+        }
+        
+        if ( end - i > 1 )
+            tx = [[self alloc] initWithStages: [transforms subarrayWithRange: NSMakeRange(i, end - i)]];
+        
+        tx.next = nil;
+        if ( head == nil )
+            head = tx;
+        else
+            tail.next = tx;
+        tail = tx;
+        
+        i = end;
+    }
+    
+    return ( head );
+}
+
+- (id) initWithStages: (NSArray *) stages
+{
+    NSParameterAssert([stages count] != 0);
+    
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    _stages = [stages copy];
+    
+    // the stages feed one another, and only the run as a whole is part of a chain
+    AQXMLTransform * prev = nil;
+    for ( AQXMLTransform * stage in _stages )
+    {
+        stage.next = nil;
+        prev.downstream = (id<AQXMLStreamingTransform>)stage;
+        prev = stage;
+    }
+    
+    return ( self );
+}
+
+- (BOOL) canStreamInput
+{
+    return ( YES );
+}
+
+- (BOOL) canConsumeStream
+{
+    return ( NO );
+}
+
+- (BOOL) streamInput: (id) input
+{
+    AQXMLTransform * last = [_stages lastObject];
+    last.downstream = self.downstream;
+    BOOL result = [_stages[0] streamInput: input];
+    last.downstream = nil;
+    
+    return ( result );
+}
+
+- (id) main
+{
+    _AQXMLDataSink * sink = [_AQXMLDataSink new];
+    AQXMLTransform * last = [_stages lastObject];
+    last.downstream = sink;
+    BOOL result = [_stages[0] streamInput: self.input];
+    last.downstream = nil;
+    
+    if ( result == NO )
+        return ( nil );
+    
+    return ( sink.data );
+}
+
 @end
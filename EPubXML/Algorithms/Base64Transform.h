@@ -36,7 +36,26 @@
 
 #import "AQXMLTransform.h"
 
-@interface Base64Transform : AQXMLTransform
+@class AQXMLElement;
+
+@interface Base64Transform : AQXMLTransform <AQXMLStreamingTransform>
 + (NSString *) encode: (NSData *) data;
 + (NSData *) decode: (NSData *) encoded;
 @end
+
+// Decodes base64 text fed a piece at a time, such as runs of characters from
+// -parser:foundCharacters: or the content of an element's text nodes, passing each
+// complete group of bytes downstream. Without a downstream stage, the bytes gather in
+// decodedData. A piece may end anywhere, even in the middle of a group.
+@interface Base64Decoder : NSObject <AQXMLStreamingTransform>
+
+// reads the element's text nodes in place, rather than through strings
++ (NSData *) decodeTextOfElement: (AQXMLElement *) element;
+
+@property (nonatomic, strong) id<AQXMLStreamingTransform> downstream;
+@property (nonatomic, readonly) NSData * decodedData;     // after -finish
+
+- (BOOL) consumeCharacters: (NSString *) characters;
+- (BOOL) consumeTextOfElement: (AQXMLElement *) element;
+
+@end
@@ -36,234 +36,250 @@
 
 #import "Base64Transform.h"
 #import "AQXMLNode.h"
+#import "AQXMLElement.h"
+#import "AQXML_Private.h"
 
-/*
- *  b64.m
- *  AQToolkit
- *
- *  Created by Jim Dovey on 11-01-11.
- *  Based on b64.c by Bob Trower
- *  <http://base64.sourceforge.net/b64.c>
- *
- */
-/*********************************************************************\
- 
- MODULE NAME:    b64.c
- 
- AUTHOR:         Bob Trower 08/04/01
- 
- PROJECT:        Crypt Data Packaging
- 
- COPYRIGHT:      Copyright (c) Trantor Standard Systems Inc., 2001
- 
- NOTE:           This source code may be used as you wish, subject to
- the MIT license.  See the LICENCE section below.
- DESCRIPTION:
- This little utility implements the Base64
- Content-Transfer-Encoding standard described in
- RFC1113 (http://www.faqs.org/rfcs/rfc1113.html).
- 
- This is the coding scheme used by MIME to allow
- binary data to be transferred by SMTP mail.
- 
- Groups of 3 bytes from a binary stream are coded as
- groups of 4 bytes in a text stream.
- 
- The input stream is 'padded' with zeros to create
- an input that is an even multiple of 3.
- 
- A special character ('=') is used to denote padding so
- that the stream can be decoded back to its exact size.
- 
- Encoded output is formatted in lines which should
- be a maximum of 72 characters to conform to the
- specification.  This program defaults to 72 characters,
- but will allow more or less through the use of a
- switch.  The program enforces a minimum line size
- of 4 characters.
- 
- Example encoding:
- 
- The stream 'ABCD' is 32 bits long.  It is mapped as
- follows:
- 
- ABCD
- 
- A (65)     B (66)     C (67)     D (68)   (None) (None)
- 01000001   01000010   01000011   01000100
- 
- 16 (Q)  20 (U)  9 (J)   3 (D)    17 (R) 0 (A)  NA (=) NA (=)
- 010000  010100  001001  000011   010001 000000 000000 000000
- 
- 
- QUJDRA==
- 
- Decoding is the process in reverse.  A 'decode' lookup
- table has been created to avoid string scans.
- 
- LICENCE:        Copyright (c) 2001 Bob Trower, Trantor Standard Systems Inc.
- 
- Permission is hereby granted, free of charge, to any person
- obtaining a copy of this software and associated
- documentation files (the "Software"), to deal in the
- Software without restriction, including without limitation
- the rights to use, copy, modify, merge, publish, distribute,
- sublicense, and/or sell copies of the Software, and to
- permit persons to whom the Software is furnished to do so,
- subject to the following conditions:
- 
- The above copyright notice and this permission notice shall
- be included in all copies or substantial portions of the
- Software.
- 
- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
- KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
- WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
- PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
- OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
- OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
- OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
- SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
- 
- VERSION HISTORY:
- Bob Trower 08/04/01 -- Create Version 0.00.00B
- 
- \******************************************************************* */
-
-/*
- ** Translation Table as described in RFC1113
- */
-static const char cb64[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-/*
- ** Translation Table to decode (created by author)
- */
-static const char cd64[]="|$$$}rstuvwxyz{$$$$$$$>?@ABCDEFGHIJKLMNOPQRSTUVW$$$$$$XYZ[\\]^_`abcdefghijklmnopq";
-
-/*
- ** encodeblock
- **
- ** encode 3 8-bit binary bytes as 4 '6-bit' characters
- */
-static void encodeblock( unsigned char in[3], unsigned char out[4], int len )
+#if defined(__SSSE3__)
+# import <tmmintrin.h>
+#endif
+
+// Base64 as in RFC 4648, without line breaks. With SSSE3, 12 bytes are encoded to 16
+// characters (or 16 decoded to 12) in each step, using Wojciech Muła's vector lookups;
+// the tables handle the rest. Decoding skips whitespace, padding and anything else outside
+// the alphabet.
+
+static const uint8_t __b64_chars[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 0-63 for the alphabet, 0xff for everything else
+static const uint8_t __b64_values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+#define B64_SKIP    0xff
+
+#if defined(__SSSE3__)
+// reads 16 bytes, of which 12 are encoded into 16 characters
+static inline void b64_encode_ssse3( const uint8_t * in, uint8_t * out )
+{
+    __m128i input = _mm_loadu_si128((const __m128i *)in);
+    input = _mm_shuffle_epi8(input, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    
+    // split each 24 bits into four 6-bit indices, one per byte
+    const __m128i t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+    
+    // map each index range onto its offset into ASCII
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+    
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                          '/' - 63, 'A', 0, 0);
+    _mm_storeu_si128((__m128i *)out, _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices));
+}
+
+// decodes 16 characters into 12 bytes, writing 16; returns NO, writing nothing, if any of
+// the characters is outside the alphabet
+static inline BOOL b64_decode_ssse3( const uint8_t * in, uint8_t * out )
+{
+    const __m128i input = _mm_loadu_si128((const __m128i *)in);
+    const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(input, 4), _mm_set1_epi8(0x0f));
+    const __m128i loNibbles = _mm_and_si128(input, _mm_set1_epi8(0x0f));
+    
+    // validate: each low nibble has a mask of the high nibbles which make a valid character
+    const __m128i masks = _mm_setr_epi8((char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                        (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf0, 0x54,
+                                        0x50, 0x50, 0x50, 0x54);
+    const __m128i bits = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                       0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i valid = _mm_and_si128(_mm_shuffle_epi8(masks, loNibbles), _mm_shuffle_epi8(bits, hiNibbles));
+    if ( _mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())) != 0 )
+        return ( NO );
+    
+    // the high nibble picks the offset back to 0-63, except for '/'
+    const __m128i offsets = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i isSlash = _mm_cmpeq_epi8(input, _mm_set1_epi8('/'));
+    const __m128i shift = _mm_or_si128(_mm_andnot_si128(isSlash, _mm_shuffle_epi8(offsets, hiNibbles)),
+                                       _mm_and_si128(isSlash, _mm_set1_epi8(16)));
+    const __m128i values = _mm_add_epi8(input, shift);
+    
+    // pack four 6-bit values into each 24 bits, then gather the bytes
+    const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    const __m128i packed = _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *)out, packed);
+    return ( YES );
+}
+#endif
+
+// encodes groups of three bytes into four characters each
+static void b64_encode_groups( const uint8_t * in, size_t groups, uint8_t * out )
 {
-    out[0] = cb64[ in[0] >> 2 ];
-    out[1] = cb64[ ((in[0] & 0x03) << 4) | ((in[1] & 0xf0) >> 4) ];
-    out[2] = (unsigned char) (len > 1 ? cb64[ ((in[1] & 0x0f) << 2) | ((in[2] & 0xc0) >> 6) ] : '=');
-    out[3] = (unsigned char) (len > 2 ? cb64[ in[2] & 0x3f ] : '=');
+    size_t i = 0;
+    
+#if defined(__SSSE3__)
+    // each step reads 16 bytes, so leave a group's worth spare at the end
+    for ( ; i + 6 <= groups; i += 4 )
+        b64_encode_ssse3(in + (i * 3), out + (i * 4));
+#endif
+    
+    for ( ; i < groups; i++ )
+    {
+        const uint8_t * p = in + (i * 3);
+        uint8_t * q = out + (i * 4);
+        uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        q[0] = __b64_chars[(v >> 18) & 0x3f];
+        q[1] = __b64_chars[(v >> 12) & 0x3f];
+        q[2] = __b64_chars[(v >> 6) & 0x3f];
+        q[3] = __b64_chars[v & 0x3f];
+    }
+}
+
+// encodes the last one or two bytes, with padding
+static void b64_encode_tail( const uint8_t * in, size_t length, uint8_t out[4] )
+{
+    uint32_t v = ((uint32_t)in[0] << 16) | (length > 1 ? ((uint32_t)in[1] << 8) : 0);
+    out[0] = __b64_chars[(v >> 18) & 0x3f];
+    out[1] = __b64_chars[(v >> 12) & 0x3f];
+    out[2] = (length > 1 ? __b64_chars[(v >> 6) & 0x3f] : '=');
+    out[3] = '=';
 }
 
-/*
- ** encode
- **
- ** base64 encode a stream adding padding and line breaks as per spec.
- */
 static NSData * b64_encode( NSData * data )
 {
-    uint8_t in[3], out[4];
-    int i, len;
+    const uint8_t * bytes = (const uint8_t *)[data bytes];
+    NSUInteger length = [data length];
+    NSUInteger groups = length / 3, remainder = length % 3;
     
-    const uint8_t *bytes = (const uint8_t *)[data bytes];
-    NSUInteger bytesLen = [data length];
-    NSUInteger offset = 0;
+    NSMutableData * output = [NSMutableData dataWithLength: (groups + (remainder != 0 ? 1 : 0)) * 4];
+    uint8_t * out = (uint8_t *)[output mutableBytes];
     
-    NSMutableData * outputData = [[NSMutableData alloc] initWithCapacity: bytesLen + (bytesLen/4) + 1];
+    b64_encode_groups(bytes, groups, out);
+    if ( remainder != 0 )
+        b64_encode_tail(bytes + (groups * 3), remainder, out + (groups * 4));
     
-    while( offset < bytesLen )
+    return ( output );
+}
+
+// a partial group, carried between pieces of input
+typedef struct b64_decode_state {
+    uint32_t    quad;
+    int         count;
+} b64_decode_state;
+
+// decodes a piece of input, which may end mid-group; the output needs room for
+// ((length / 4) * 3) + 19 bytes, for the carried group and a 16-byte vector store
+static size_t b64_decode_piece( const uint8_t * bytes, size_t length, b64_decode_state * state, uint8_t * out )
+{
+    size_t outLength = 0, i = 0;
+    uint32_t quad = state->quad;
+    int count = state->count;
+    
+    while ( i < length )
     {
-        len = 0;
-        for( i = 0; i < 3; i++ )
+#if defined(__SSSE3__)
+        // whole runs of the alphabet go sixteen at a time, between groups
+        if ( count == 0 && length - i >= 16 && b64_decode_ssse3(bytes + i, out + outLength) )
         {
-            if ( offset < bytesLen )
-            {
-                in[i] = bytes[offset++];
-                len++;
-            }
-            else
-            {
-                in[i] = 0;
-            }
+            i += 16;
+            outLength += 12;
+            continue;
         }
+#endif
+        
+        uint8_t v = __b64_values[bytes[i++]];
+        if ( v == B64_SKIP )
+            continue;
         
-        if ( len != 0 )
+        quad = (quad << 6) | v;
+        if ( ++count == 4 )
         {
-            encodeblock( in, out, len );
-            [outputData appendBytes: out length: 4];
+            out[outLength++] = (uint8_t)(quad >> 16);
+            out[outLength++] = (uint8_t)(quad >> 8);
+            out[outLength++] = (uint8_t)quad;
+            quad = 0;
+            count = 0;
         }
     }
     
-    return ( [outputData copy] );
+    state->quad = quad;
+    state->count = count;
+    return ( outLength );
 }
 
-/*
- ** decodeblock
- **
- ** decode 4 '6-bit' characters into 3 8-bit binary bytes
- */
-void decodeblock( unsigned char in[4], unsigned char out[3] )
+// a trailing partial group, whose padding was skipped: writes up to two bytes
+static size_t b64_decode_tail( b64_decode_state * state, uint8_t * out )
 {
-    out[ 0 ] = (unsigned char ) (in[0] << 2 | in[1] >> 4);
-    out[ 1 ] = (unsigned char ) (in[1] << 4 | in[2] >> 2);
-    out[ 2 ] = (unsigned char ) (((in[2] << 6) & 0xc0) | in[3]);
+    size_t outLength = 0;
+    if ( state->count == 3 )
+    {
+        out[outLength++] = (uint8_t)(state->quad >> 10);
+        out[outLength++] = (uint8_t)(state->quad >> 2);
+    }
+    else if ( state->count == 2 )
+    {
+        out[outLength++] = (uint8_t)(state->quad >> 4);
+    }
+    
+    state->quad = 0;
+    state->count = 0;
+    return ( outLength );
 }
 
-/*
- ** decode
- **
- ** decode a base64 encoded stream discarding padding, line breaks and noise
- */
 static NSData * b64_decode( NSData * data )
 {
-    uint8_t in[4] = {0}, out[3] = {0}, v;
-    int i, len;
+    const uint8_t * bytes = (const uint8_t *)[data bytes];
+    NSUInteger length = [data length];
     
-    const uint8_t *bytes = (const uint8_t *)[data bytes];
-    NSUInteger bytesLen = [data length];
-    NSUInteger offset = 0;
+    NSMutableData * output = [NSMutableData dataWithLength: ((length / 4) * 3) + 19];
+    uint8_t * out = (uint8_t *)[output mutableBytes];
     
-    NSMutableData * outputData = [[NSMutableData alloc] initWithCapacity: bytesLen];
+    b64_decode_state state = { 0, 0 };
+    NSUInteger outLength = b64_decode_piece(bytes, length, &state, out);
+    outLength += b64_decode_tail(&state, out + outLength);
     
-    while ( offset < bytesLen )
+    [output setLength: outLength];
+    return ( output );
+}
+
+static id b64_input( id input )
+{
+    if ( [input isKindOfClass: [AQXMLNode class]] )
     {
-        for ( len = 0, i = 0; i < 4 && offset < bytesLen; i++ )
-        {
-            v = 0;
-            while ( offset < bytesLen && v == 0 )
-            {
-                v = bytes[offset++];
-                v = ((v < 43 || v > 122) ? 0 : cd64[ v - 43 ]);
-                
-                if ( v != 0 )
-                {
-                    v = ((v == '$') ? 0 : v - 61);
-                }
-            }
-            
-            if ( (offset < (bytesLen+1)) && (v != 0) )
-            {
-                len++;
-                if ( v != 0 )
-                {
-                    in[ i ] = (v - 1);
-                }
-            }
-            else
-            {
-                in[i] = 0;
-            }
-        }
-        
-        if ( len )
-        {
-            decodeblock( in, out );
-            [outputData appendBytes: out length: len-1];
-        }
+        NSString * str = [input evaluateXPath: @"self::text()" error: NULL];
+        return ( [str dataUsingEncoding: NSUTF8StringEncoding] );
     }
     
-    return ( [outputData copy] );
+    return ( input );
 }
 
+// output is handed downstream in pieces of this size
+#define kB64StreamOutputSize    (4 * 1024)
+
 @implementation Base64Transform
+{
+    uint8_t     _carry[3];          // a partial group held over between pieces of input
+    NSUInteger  _carryLength;
+}
 
 + (NSString *) encode: (NSData *) data
 {
@@ -281,14 +297,188 @@ static NSData * b64_decode( NSData * data )
 
 - (id) main
 {
-    id data = self.input;
-    if ( [data isKindOfClass: [AQXMLNode class]] )
+    return ( b64_encode(b64_input(self.input)) );
+}
+
+- (BOOL) streamInput: (id) input
+{
+    return ( [super streamInput: b64_input(input)] );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    const uint8_t * p = bytes;
+    uint8_t out[kB64StreamOutputSize];
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    
+    // complete any group left over from the last piece
+    while ( _carryLength != 0 && _carryLength < 3 && length != 0 )
+    {
+        _carry[_carryLength++] = *p++;
+        length--;
+    }
+    
+    if ( _carryLength == 3 )
+    {
+        b64_encode_groups(_carry, 1, out);
+        _carryLength = 0;
+        if ( [downstream consumeBytes: out length: 4] == NO )
+            return ( NO );
+    }
+    
+    while ( length >= 3 )
+    {
+        size_t groups = MIN(length / 3, sizeof(out) / 4);
+        b64_encode_groups(p, groups, out);
+        p += groups * 3;
+        length -= groups * 3;
+        
+        if ( [downstream consumeBytes: out length: groups * 4] == NO )
+            return ( NO );
+    }
+    
+    // keep the remainder until more arrives, or until we're finished
+    if ( length != 0 )
+    {
+        memcpy( _carry, p, length );
+        _carryLength = length;
+    }
+    
+    return ( YES );
+}
+
+- (BOOL) finish
+{
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    if ( _carryLength != 0 )
     {
-        NSString * str = [data evaluateXPath: @"self::text()" error: NULL];
-        data = [str dataUsingEncoding: NSUTF8StringEncoding];
+        uint8_t out[4];
+        b64_encode_tail( _carry, _carryLength, out );
+        _carryLength = 0;
+        
+        if ( [downstream consumeBytes: out length: 4] == NO )
+            return ( NO );
     }
     
-    return ( b64_encode(data) );
+    return ( [downstream finish] );
+}
+
+@end
+
+#pragma mark -
+
+// input is decoded in pieces of this many characters
+#define kB64DecodePieceSize     (4 * 1024)
+
+@implementation Base64Decoder
+{
+    b64_decode_state    _state;
+    NSMutableData *     _decoded;
+}
+
++ (NSData *) decodeTextOfElement: (AQXMLElement *) element
+{
+    Base64Decoder * decoder = [self new];
+    if ( [decoder consumeTextOfElement: element] == NO || [decoder finish] == NO )
+        return ( nil );
+    
+    return ( decoder.decodedData );
+}
+
+- (NSData *) decodedData
+{
+    return ( _decoded );
+}
+
+- (BOOL) emitBytes: (const uint8_t *) bytes length: (NSUInteger) length
+{
+    if ( length == 0 )
+        return ( YES );
+    
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    if ( downstream != nil )
+        return ( [downstream consumeBytes: bytes length: length] );
+    
+    if ( _decoded == nil )
+        _decoded = [NSMutableData new];
+    [_decoded appendBytes: bytes length: length];
+    return ( YES );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    const uint8_t * p = bytes;
+    uint8_t out[((kB64DecodePieceSize / 4) * 3) + 19];
+    
+    while ( length != 0 )
+    {
+        NSUInteger pieceLength = MIN(length, kB64DecodePieceSize);
+        size_t outLength = b64_decode_piece(p, pieceLength, &_state, out);
+        if ( [self emitBytes: out length: outLength] == NO )
+            return ( NO );
+        
+        p += pieceLength;
+        length -= pieceLength;
+    }
+    
+    return ( YES );
+}
+
+- (BOOL) consumeCharacters: (NSString *) characters
+{
+    // the alphabet is ASCII, so use the string's own bytes if it has them
+    const char * cstr = CFStringGetCStringPtr((__bridge CFStringRef)characters, kCFStringEncodingUTF8);
+    if ( cstr != NULL )
+        return ( [self consumeBytes: cstr length: strlen(cstr)] );
+    
+    uint8_t buf[kB64DecodePieceSize];
+    NSRange range = NSMakeRange(0, [characters length]);
+    while ( range.length != 0 )
+    {
+        NSUInteger used = 0;
+        if ( [characters getBytes: buf maxLength: sizeof(buf) usedLength: &used encoding: NSUTF8StringEncoding
+                          options: NSStringEncodingConversionAllowLossy range: range remainingRange: &range] == NO )
+            return ( NO );
+        if ( [self consumeBytes: buf length: used] == NO )
+            return ( NO );
+    }
+    
+    return ( YES );
+}
+
+- (BOOL) consumeTextOfElement: (AQXMLElement *) element
+{
+    if ( element == nil )
+        return ( YES );
+    
+    // straight from libxml's text nodes, with no intermediate strings
+    for ( xmlNodePtr child = element.xmlObj->children; child != NULL; child = child->next )
+    {
+        if ( child->type != XML_TEXT_NODE && child->type != XML_CDATA_SECTION_NODE )
+            continue;
+        if ( child->content == NULL )
+            continue;
+        
+        if ( [self consumeBytes: child->content length: xmlStrlen(child->content)] == NO )
+            return ( NO );
+    }
+    
+    return ( YES );
+}
+
+- (BOOL) finish
+{
+    uint8_t out[2];
+    size_t outLength = b64_decode_tail(&_state, out);
+    if ( [self emitBytes: out length: outLength] == NO )
+        return ( NO );
+    
+    if ( self.downstream != nil )
+        return ( [self.downstream finish] );
+    
+    if ( _decoded == nil )
+        _decoded = [NSMutableData new];
+    return ( YES );
 }
 
 @end
@@ -66,15 +66,45 @@
     }
     else if ( [obj isKindOfClass: [AQXMLNodeSet class]] && [obj count] != 0 )
     {
-        AQXMLNodeSet * nodeSet = obj;
-        output = [AQXMLCanonicalizer canonicalizeDocument: nodeSet[0].document usingMethod: self.method visibilityFilter: ^BOOL(AQXMLNode *node) {
-            return ( [nodeSet containsNode: node] );
-        }];
+        output = [AQXMLCanonicalizer canonicalizeNodeSet: obj usingMethod: self.method];
     }
     
     return ( output );
 }
 
+- (BOOL) canStreamInput
+{
+    return ( YES );
+}
+
+- (BOOL) streamInput: (id) input
+{
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    BOOL (^handler)(const void *, NSUInteger, NSError **) = ^BOOL(const void * bytes, NSUInteger length, NSError ** error) {
+        return ( [downstream consumeBytes: bytes length: length] );
+    };
+    
+    BOOL result = NO;
+    if ( [input isKindOfClass: [NSData class]] )
+    {
+        result = [AQXMLCanonicalizer canonicalizeData: input usingMethod: self.method visibilityFilter: nil outputHandler: handler error: NULL];
+    }
+    else if ( [input isKindOfClass: [AQXMLDocument class]] )
+    {
+        result = [AQXMLCanonicalizer canonicalizeDocument: input usingMethod: self.method visibilityFilter: nil outputHandler: handler error: NULL];
+    }
+    else if ( [input isKindOfClass: [AQXMLElement class]] )
+    {
+        result = [AQXMLCanonicalizer canonicalizeElement: input usingMethod: self.method visibilityFilter: nil outputHandler: handler error: NULL];
+    }
+    else if ( [input isKindOfClass: [AQXMLNodeSet class]] && [input count] != 0 )
+    {
+        result = [AQXMLCanonicalizer canonicalizeNodeSet: input usingMethod: self.method outputHandler: handler error: NULL];
+    }
+    
+    return ( result && [downstream finish] );
+}
+
 @end
 
 @implementation C14N_CLASS(10)
@@ -103,14 +133,13 @@
 
 @implementation C14N20Transform
 
-- (id) main
+- (AQXMLCanonicalizer *) canonicalizerForInput: (id) obj
 {
     if ( self.methodElement == nil )
         return ( nil );
     
     AQXMLCanonicalizer * canon = nil;
     
-    id obj = self.input;
     if ( [obj isKindOfClass: [NSData class]] )
     {
         canon = [[AQXMLCanonicalizer alloc] initWithData: obj];
@@ -175,6 +204,15 @@
         [canon addQNameAwareXPathElement: nameAttr.value namespaceURI: nsAttr.value];
     }
     
+    return ( canon );
+}
+
+- (id) main
+{
+    AQXMLCanonicalizer * canon = [self canonicalizerForInput: self.input];
+    if ( canon == nil )
+        return ( nil );
+    
     // run it
     NSOutputStream * stream = [NSOutputStream outputStreamToMemory];
     if ( [canon canonicalizeToStream: stream error: NULL] == NO )
@@ -183,4 +221,23 @@
     return ( [stream propertyForKey: NSStreamDataWrittenToMemoryStreamKey] );
 }
 
+- (BOOL) canStreamInput
+{
+    return ( YES );
+}
+
+- (BOOL) streamInput: (id) input
+{
+    AQXMLCanonicalizer * canon = [self canonicalizerForInput: input];
+    if ( canon == nil )
+        return ( NO );
+    
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    BOOL result = [canon canonicalizeWithOutputHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** error) {
+        return ( [downstream consumeBytes: bytes length: length] );
+    } error: NULL];
+    
+    return ( result && [downstream finish] );
+}
+
 @end
@@ -36,10 +36,29 @@
 
 #import "AQXMLTransform.h"
 
+@class AQXMLDigest;
+
+// Digests and HMACs stream: the input is digested as it arrives, and the digest value is
+// passed downstream when the stage is finished.
+@interface AQXMLDigestTransform : AQXMLTransform <AQXMLStreamingTransform>
+
+- (AQXMLDigest *) newDigest;     // subclassers implement this
+
+// The context can also be fed directly from data, a stream such as a file, or a
+// canonicalizer through the output handler, so large inputs needn't be held in memory.
+// -finalizeDigest returns the digest and resets the context to be fed again. These
+// return NO or nil if there's no context, e.g. for an HMAC without a key.
+- (BOOL) update: (NSData *) data;
+- (BOOL) updateWithStream: (NSInputStream *) stream;
+- (NSData *) finalizeDigest;
+@property (nonatomic, readonly) BOOL (^outputHandler)(const void * bytes, NSUInteger length, NSError ** error);
+
+@end
+
 #define DIGEST_CLASS(type) type##DigestTransform
-#define DIGEST_INTERFACE(type) @interface DIGEST_CLASS(type) : AQXMLTransform @end
+#define DIGEST_INTERFACE(type) @interface DIGEST_CLASS(type) : AQXMLDigestTransform @end
 
-@interface AQXMLHMACTransform : AQXMLTransform
+@interface AQXMLHMACTransform : AQXMLDigestTransform
 @property (nonatomic, strong) NSData * keyData;
 @end
 
@@ -61,3 +80,24 @@ HMAC_INTERFACE(SHA512)
 // Optional Digest Transforms
 DIGEST_INTERFACE(SHA384)
 DIGEST_INTERFACE(SHA512)
+
+// An incremental digest or HMAC, fed a piece at a time. Hand its outputHandler to
+// AQXMLCanonicalizer to digest a canonical form without holding it all in memory.
+@interface AQXMLDigest : NSObject <AQXMLStreamingTransform>
+
++ (AQXMLDigest *) digestWithAlgorithm: (NSString *) algorithmURI;                    // SHA digests
++ (AQXMLDigest *) digestWithAlgorithm: (NSString *) algorithmURI key: (NSData *) key; // HMACs
+
+- (void) updateWithBytes: (const void *) bytes length: (NSUInteger) length;
+- (void) updateWithData: (NSData *) data;
+- (BOOL) updateWithStream: (NSInputStream *) stream;
+- (NSData *) finalDigest;       // after the last update; the digest then starts afresh
+
+// The digests of a batch of independent messages, in order. SHA-256 batches are hashed
+// four messages at a time by AQXMLSHA256MultiBuffer(); other algorithms, SHA-1 included,
+// digest each message in turn. Returns nil for an unknown algorithm.
++ (NSArray *) digestsOfMessages: (NSArray *) messages withAlgorithm: (NSString *) algorithmURI;
+
+@property (nonatomic, readonly) BOOL (^outputHandler)(const void * bytes, NSUInteger length, NSError ** error);
+
+@end
@@ -0,0 +1,320 @@
+//
+//  DigestTransforms.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2012-09-18.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "DigestTransforms.h"
+#import "AQXMLMultiDigest.h"
+#import "cryptlib.h"
+#import "sha.h"
+#import "hmac.h"
+
+#define DIGEST_TRANSFORM_IMPL(type)                                                 \
+@implementation DIGEST_CLASS(type)                                                  \
+- (AQXMLDigest *) newDigest                                                         \
+{                                                                                   \
+    return ( [AQXMLDigest digestWithAlgorithm: AQXMLAlgorithm##type] );             \
+}                                                                                   \
+@end
+
+#define HMAC_TRANSFORM_IMPL(type)                                                   \
+@implementation HMAC_CLASS(type)                                                    \
+- (AQXMLDigest *) newDigest                                                         \
+{                                                                                   \
+    return ( [AQXMLDigest digestWithAlgorithm: AQXMLAlgorithmHMAC##type             \
+                                          key: self.keyData] );                     \
+}                                                                                   \
+@end
+
+@implementation AQXMLDigestTransform
+{
+    AQXMLDigest *   _digest;
+}
+
+- (AQXMLDigest *) newDigest
+{
+    return ( nil );
+}
+
+- (AQXMLDigest *) context
+{
+    if ( _digest == nil )
+        _digest = [self newDigest];
+    return ( _digest );
+}
+
+- (BOOL) update: (NSData *) data
+{
+    AQXMLDigest * context = [self context];
+    if ( context == nil )
+        return ( NO );
+    
+    [context updateWithData: data];
+    return ( YES );
+}
+
+- (BOOL) updateWithStream: (NSInputStream *) stream
+{
+    AQXMLDigest * context = [self context];
+    if ( context == nil )
+        return ( NO );
+    
+    return ( [context updateWithStream: stream] );
+}
+
+- (NSData *) finalizeDigest
+{
+    // an empty input still has a digest
+    NSData * md = [[self context] finalDigest];
+    _digest = nil;
+    return ( md );
+}
+
+- (BOOL (^)(const void *, NSUInteger, NSError **)) outputHandler
+{
+    return ( [self context].outputHandler );
+}
+
+- (id) main
+{
+    if ( [self update: self.input] == NO )
+        return ( nil );
+    return ( [self finalizeDigest] );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    AQXMLDigest * context = [self context];
+    if ( context == nil )
+        return ( NO );
+    
+    [context updateWithBytes: bytes length: length];
+    return ( YES );
+}
+
+- (BOOL) finish
+{
+    NSData * md = [self finalizeDigest];
+    if ( md == nil )
+        return ( NO );
+    
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    return ( [downstream consumeBytes: [md bytes] length: [md length]] && [downstream finish] );
+}
+
+@end
+
+@implementation AQXMLHMACTransform
+
+- (NSData *) process
+{
+    if ( self.keyData == nil )
+        return ( nil );
+    return ( [super process] );
+}
+
+@end
+
+// Required Digest Transforms
+DIGEST_TRANSFORM_IMPL(SHA1)
+DIGEST_TRANSFORM_IMPL(SHA256)
+
+// Required HMAC Transforms
+HMAC_TRANSFORM_IMPL(SHA1)
+HMAC_TRANSFORM_IMPL(SHA256)
+
+// Recommended HMAC Transforms
+HMAC_TRANSFORM_IMPL(SHA384)
+HMAC_TRANSFORM_IMPL(SHA512)
+
+// Optional Digest Transforms
+DIGEST_TRANSFORM_IMPL(SHA384)
+DIGEST_TRANSFORM_IMPL(SHA512)
+
+#pragma mark -
+
+@implementation AQXMLDigest
+{
+    CryptoPP::HashTransformation *  _hash;
+}
+
++ (AQXMLDigest *) digestWithAlgorithm: (NSString *) algorithmURI
+{
+    return ( [self digestWithAlgorithm: algorithmURI key: nil] );
+}
+
++ (AQXMLDigest *) digestWithAlgorithm: (NSString *) algorithmURI key: (NSData *) key
+{
+    CryptoPP::HashTransformation * hash = NULL;
+    
+    if ( [algorithmURI isEqualToString: AQXMLAlgorithmSHA1] )
+    {
+        hash = new CryptoPP::SHA1;
+    }
+    else if ( [algorithmURI isEqualToString: AQXMLAlgorithmSHA256] )
+    {
+        hash = new CryptoPP::SHA256;
+    }
+    else if ( [algorithmURI isEqualToString: AQXMLAlgorithmSHA384] || [algorithmURI isEqualToString: AQXMLAlgorithmSHA384_ENC] )
+    {
+        hash = new CryptoPP::SHA384;
+    }
+    else if ( [algorithmURI isEqualToString: AQXMLAlgorithmSHA512] )
+    {
+        hash = new CryptoPP::SHA512;
+    }
+    else
+    {
+        if ( key == nil )
+            return ( nil );
+        
+        const byte * keyBytes = (const byte *)[key bytes];
+        size_t keyLength = [key length];
+        
+        if ( [algorithmURI isEqualToString: AQXMLAlgorithmHMACSHA1] )
+            hash = new CryptoPP::HMAC<CryptoPP::SHA1>(keyBytes, keyLength);
+        else if ( [algorithmURI isEqualToString: AQXMLAlgorithmHMACSHA256] )
+            hash = new CryptoPP::HMAC<CryptoPP::SHA256>(keyBytes, keyLength);
+        else if ( [algorithmURI isEqualToString: AQXMLAlgorithmHMACSHA384] )
+            hash = new CryptoPP::HMAC<CryptoPP::SHA384>(keyBytes, keyLength);
+        else if ( [algorithmURI isEqualToString: AQXMLAlgorithmHMACSHA512] )
+            hash = new CryptoPP::HMAC<CryptoPP::SHA512>(keyBytes, keyLength);
+        else
+            return ( nil );     // unknown algorithm
+    }
+    
+    AQXMLDigest * digest = [[self alloc] init];
+    digest->_hash = hash;
+    return ( digest );
+}
+
++ (NSArray *) digestsOfMessages: (NSArray *) messages withAlgorithm: (NSString *) algorithmURI
+{
+    NSUInteger count = [messages count];
+    if ( count > 1 && [algorithmURI isEqualToString: AQXMLAlgorithmSHA256] )
+    {
+        const uint8_t ** bytes = (const uint8_t **)malloc(count * sizeof(const uint8_t *));
+        size_t * lengths = (size_t *)malloc(count * sizeof(size_t));
+        uint8_t * md = (uint8_t *)malloc(count * AQXML_SHA256_DIGEST_LENGTH);
+        if ( bytes == NULL || lengths == NULL || md == NULL )
+        {
+            free(bytes);
+            free(lengths);
+            free(md);
+            return ( nil );
+        }
+        
+        for ( NSUInteger i = 0; i < count; i++ )
+        {
+            NSData * data = messages[i];
+            bytes[i] = (const uint8_t *)[data bytes];
+            lengths[i] = [data length];
+        }
+        
+        AQXMLSHA256MultiBuffer(bytes, lengths, count, md);
+        
+        NSMutableArray * result = [NSMutableArray arrayWithCapacity: count];
+        for ( NSUInteger i = 0; i < count; i++ )
+            [result addObject: [NSData dataWithBytes: md + (i * AQXML_SHA256_DIGEST_LENGTH) length: AQXML_SHA256_DIGEST_LENGTH]];
+        
+        free(bytes);
+        free(lengths);
+        free(md);
+        return ( result );
+    }
+    
+    NSMutableArray * result = [NSMutableArray arrayWithCapacity: count];
+    for ( NSData * data in messages )
+    {
+        AQXMLDigest * digest = [self digestWithAlgorithm: algorithmURI];
+        if ( digest == nil )
+            return ( nil );
+        
+        [digest updateWithData: data];
+        [result addObject: [digest finalDigest]];
+    }
+    
+    return ( result );
+}
+
+- (void) dealloc
+{
+    delete _hash;
+}
+
+- (void) updateWithBytes: (const void *) bytes length: (NSUInteger) length
+{
+    _hash->Update((const byte *)bytes, length);
+}
+
+- (void) updateWithData: (NSData *) data
+{
+    [data enumerateByteRangesUsingBlock: ^(const void *bytes, NSRange byteRange, BOOL *stop) {
+        [self updateWithBytes: bytes length: byteRange.length];
+    }];
+}
+
+- (BOOL) updateWithStream: (NSInputStream *) stream
+{
+    return ( AQXMLTransformConsumeStream(self, stream) );
+}
+
+- (NSData *) finalDigest
+{
+    // this also restarts the hash, ready to be fed again
+    NSMutableData * md = [NSMutableData dataWithLength: _hash->DigestSize()];
+    _hash->Final((byte *)[md mutableBytes]);
+    return ( md );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    [self updateWithBytes: bytes length: length];
+    return ( YES );
+}
+
+- (BOOL) finish
+{
+    return ( YES );
+}
+
+- (BOOL (^)(const void *, NSUInteger, NSError **)) outputHandler
+{
+    return ( ^BOOL(const void * bytes, NSUInteger length, NSError ** error) {
+        [self updateWithBytes: bytes length: length];
+        return ( YES );
+    } );
+}
+
+@end
@@ -55,14 +55,16 @@
 @interface XSLTTransform : XMLNodeTransform
 @end
 
-// this one overrides -process to load its own input property based on its node
+// this one overrides -process to load its own input property based on its node,
+// so only a binary selection, which can stream its input, is fused with its neighbours
 @interface DSIG2SelectionTransform : XMLNodeTransform
 @end
 
 @interface XMLSelectionTransform : DSIG2SelectionTransform
 @end
 
-@interface BinarySelectionTransform : DSIG2SelectionTransform
+// streams the selected byte ranges of its octets downstream, reading files in pieces
+@interface BinarySelectionTransform : DSIG2SelectionTransform <AQXMLStreamingTransform>
 @end
 
 @interface BinaryFromXMLSelectionTransform : DSIG2SelectionTransform
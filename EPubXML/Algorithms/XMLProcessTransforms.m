@@ -301,7 +301,7 @@
         if ( [self isKindOfClass: [BinarySelectionTransform class]] )
         {
             // read a plain octet-stream
-            self.input = [NSData dataWithContentsOfURL: url];
+            self.input = [NSData dataWithContentsOfURL: url options: NSDataReadingMappedIfSafe error: NULL];
             return ( [super process] );
         }
         
@@ -326,6 +326,16 @@
     return ( [super process] );
 }
 
+- (BOOL) canStreamInput
+{
+    return ( NO );
+}
+
+- (BOOL) canConsumeStream
+{
+    return ( NO );
+}
+
 - (id) canonicalizeOutput: (id) output specNode: (AQXMLElement *) specNode
 {
     if ( [output isKindOfClass: [AQXMLNodeSet class]] == NO )
@@ -416,9 +426,7 @@
         return ( [stream propertyForKey: NSStreamDataWrittenToMemoryStreamKey] );
     }
     
-    return ( [AQXMLCanonicalizer canonicalizeDocument: doc usingMethod: method visibilityFilter: ^BOOL(AQXMLNode *node) {
-        return ( [nodeSet containsNode: node] );
-    }] );
+    return ( [AQXMLCanonicalizer canonicalizeNodeSet: nodeSet usingMethod: method] );
 }
 
 @end
@@ -481,39 +489,50 @@
 @end
 
 @implementation BinarySelectionTransform
+{
+    NSIndexSet *    _streamRanges;      // nil selects the entire stream
+    NSUInteger      _streamOffset;
+    BOOL            _streaming;
+}
 
-- (id) main
+- (NSIndexSet *) selectedRanges
 {
-    NSData * octetStream = self.input;
-    NSMutableIndexSet * ranges = [NSMutableIndexSet indexSet];
-    
     AQXMLElement * rangeElem = [self.node firstChildNamed: @"ByteRange"];
-    if ( rangeElem != nil )
+    if ( rangeElem == nil )
+        return ( nil );     // entire range
+    
+    // parse ranges in HTTP 1.1 format (a-b,c-d,e-f), where each range is inclusive
+    NSMutableIndexSet * ranges = [NSMutableIndexSet indexSet];
+    [rangeElem consolidateConsecutiveTextNodes];
+    @autoreleasepool
     {
-        // parse ranges in HTTP 1.1 format (a-b,c-d,e-f)
-        [rangeElem consolidateConsecutiveTextNodes];
-        @autoreleasepool
+        NSArray * pairs = [rangeElem.firstChild.content componentsSeparatedByString: @","];
+        for ( NSString * pairStr in pairs )
         {
-            NSArray * pairs = [rangeElem.firstChild.content componentsSeparatedByString: @","];
-            for ( NSString * pairStr in pairs )
-            {
-                NSArray * pair = [pairStr componentsSeparatedByString: @"-"];
-                if ( [pair count] != 2 )
-                    continue;
-                
-                NSRange r = NSMakeRange([pair[0] integerValue], [pair[1] integerValue]);
-                [ranges addIndexesInRange: r];
-            }
+            NSArray * pair = [pairStr componentsSeparatedByString: @"-"];
+            if ( [pair count] != 2 )
+                continue;
+            
+            NSInteger first = [pair[0] integerValue], last = [pair[1] integerValue];
+            if ( first < 0 || last < first )
+                continue;
+            
+            [ranges addIndexesInRange: NSMakeRange(first, last - first + 1)];
         }
     }
-    else
-    {
-        // entire range
-        [ranges addIndexesInRange: NSMakeRange(0, [octetStream length])];
-    }
+    
+    return ( ranges );
+}
+
+- (id) main
+{
+    NSData * octetStream = self.input;
+    NSIndexSet * ranges = [self selectedRanges];
+    if ( ranges == nil )
+        return ( octetStream );
     
     NSMutableData * output = [NSMutableData new];
-    const uint8_t *p = [output bytes];
+    const uint8_t *p = [octetStream bytes];
     [ranges enumerateRangesInRange: NSMakeRange(0, [octetStream length]) options: 0 usingBlock: ^(NSRange range, BOOL *stop) {
         [output appendBytes: p + range.location length: range.length];
     }];
@@ -521,6 +540,59 @@
     return ( output );
 }
 
+- (BOOL) canStreamInput
+{
+    return ( YES );
+}
+
+- (BOOL) streamInput: (id) input
+{
+    // as in -process, the octets come from our node's URI, and files are read a piece at a time
+    NSString * uri = [self.node attributeNamed: @"URI"].value;
+    if ( [self.node.name isEqualToString: @"Selection"] == NO || [uri length] == 0 || [uri hasPrefix: @"#"] )
+        return ( NO );
+    
+    NSURL * url = [NSURL URLWithString: uri];
+    if ( [url isFileURL] )
+        return ( [super streamInput: [NSInputStream inputStreamWithURL: url]] );
+    
+    return ( [super streamInput: [NSData dataWithContentsOfURL: url]] );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    if ( _streaming == NO )
+    {
+        _streamRanges = [self selectedRanges];
+        _streamOffset = 0;
+        _streaming = YES;
+    }
+    
+    id<AQXMLStreamingTransform> downstream = self.downstream;
+    NSRange piece = NSMakeRange(_streamOffset, length);
+    _streamOffset += length;
+    
+    if ( _streamRanges == nil )
+        return ( [downstream consumeBytes: bytes length: length] );
+    
+    // pass on the parts of this piece which fall in the selected ranges
+    const uint8_t * p = bytes;
+    __block BOOL ok = YES;
+    [_streamRanges enumerateRangesInRange: piece options: 0 usingBlock: ^(NSRange range, BOOL *stop) {
+        ok = [downstream consumeBytes: p + (range.location - piece.location) length: range.length];
+        *stop = !ok;
+    }];
+    
+    return ( ok );
+}
+
+- (BOOL) finish
+{
+    _streamRanges = nil;
+    _streaming = NO;
+    return ( [self.downstream finish] );
+}
+
 @end
 
 @implementation BinaryFromXMLSelectionTransform
@@ -547,13 +619,11 @@
         if ( elem.type != AQXMLNodeTypeElement )
             return ( nil );     // XPath MUST select only element nodes
         
-        [elem consolidateConsecutiveTextNodes];
-        data = [Base64Transform decode: [elem.firstChild.content dataUsingEncoding: NSUTF8StringEncoding]];
+        data = [Base64Decoder decodeTextOfElement: elem];
     }
     else
     {
-        [element consolidateConsecutiveTextNodes];
-        data = [Base64Transform decode: [element.firstChild.content dataUsingEncoding: NSUTF8StringEncoding]];
+        data = [Base64Decoder decodeTextOfElement: element];
     }
     
     // let's use a plain binary transform to do the work for us & keep things DRY
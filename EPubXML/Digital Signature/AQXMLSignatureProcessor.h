@@ -84,6 +84,7 @@ typedef NS_ENUM(NSUInteger, AQSignatureAlgorithm) {
                              signingKey: (SecKeyRef) signingKey;
 
 // returns a new document with digests of the supplied URLs in /Signature/Object/Manifest
+// small local files are digested in batches, several at once for SHA-256
 + (AQXMLDocument *) signatureReferencingDataAtURLs: (NSArray *) URLs
                                            version: (AQXMLSignatureVersion) version
                               usingDigestAlgorithm: (AQDigestAlgorithm) digestAlgorithm
@@ -51,7 +51,7 @@ static NSString * const AQXMLDSig11NamespaceURI = @"http://www.w3.org/2009/xmlds
 static NSString * const AQXMLDSig20NamespaceURI = @"http://www.w3.org/2010/xmldsig2#";
 static NSString * const AQXMLC14N2NamespaceURI = @"http://www.w3.org/2010/xml-c14n2";
 
-#define B64_CHILD(elem, name) [Base64Transform decode: [[elem firstChildNamed: name].stringValue dataUsingEncoding: NSUTF8StringEncoding]]
+#define B64_CHILD(elem, name) [Base64Decoder decodeTextOfElement: [elem firstChildNamed: name]]
 #define _SEC(x) ((__bridge id)x)
 
 NSString * TransformURIFromCanonicalizationMethod( AQXMLCanonicalizationMethod method )
@@ -101,6 +101,59 @@ NSString * TransformURIForDigestAlgorithm(AQDigestAlgorithm alg)
     return ( nil );
 }
 
+// resources up to this size are read into memory and digested in batches
+#define kAQXMLReferenceBatchMaxLength   (1024 * 1024)
+#define kAQXMLReferenceBatchMaxCount    64
+#define kAQXMLReferenceBatchMaxBytes    (8 * 1024 * 1024)
+
+static AQXMLCanonicalizationMethod ReferenceCanonicalizationMethod(AQXMLSignatureVersion version)
+{
+    AQXMLCanonicalizationMethod canonMethod = AQXMLCanonicalizationMethod_1_1;
+    if ( version == AQXMLSignatureVersion2_0 )
+        canonMethod = AQXMLCanonicalizationMethod_2_0;
+    return ( canonMethod | AQXMLCanonicalizationMethod_with_comments );
+}
+
+static AQXMLElement * ReferenceElementWithDigest(NSData * digest, NSArray * transformURIs, NSString * digestTransformURI)
+{
+    AQXMLElement * reference = [AQXMLElement elementWithName: @"Reference" content: nil inNamespace: nil];
+    AQXMLNamespace * dsigNS = [AQXMLNamespace namespaceWithNode: reference URI: AQXMLDSig10NamespaceURI prefix: nil];
+    reference.ns = dsigNS;
+    
+    AQXMLElement * transforms = [reference addChildNamed: @"Transforms"];
+    
+    for ( NSString * transformURI in transformURIs )
+    {
+        AQXMLElement * transform = [transforms addChildNamed: @"Transform"];
+        
+        // special-case for XML Canonicalization 2.0
+        if ( [transformURI hasSuffix: @"xml-c14n2#WithComments"] )
+        {
+            // that's not a real transform URI-- remove the fragment and add sub-elements to specify comment preservation
+            [transform addAttributeNamed: @"Algorithm" withValue: [transformURI substringToIndex: [transformURI length] - 13]];
+            
+            AQXMLNamespace * c14n2ns = [AQXMLNamespace namespaceWithNode: transform URI: AQXMLC14N2NamespaceURI prefix: @"c14n2"];
+            transform.ns = c14n2ns;
+            
+            [transform addChild: [AQXMLElement elementWithName: @"IgnoreComments"
+                                                       content: @"true"
+                                                   inNamespace: c14n2ns]];
+        }
+        else
+        {
+            [transform addAttributeNamed: @"Algorithm" withValue: transformURI];
+        }
+    }
+    
+    AQXMLElement * digestMethod = [reference addChildNamed: @"DigestMethod"];
+    [digestMethod addAttributeNamed: @"Algorithm" withValue: digestTransformURI];
+    
+    // now the digest -- which must be base64-encoded to a string value
+    (void) [reference addChildNamed: @"DigestValue" withTextContent: [Base64Transform encode: digest]];
+    
+    return ( reference );
+}
+
 static AQXMLNodeSet * NodeSetFromXPointer(AQXMLElement * origin, NSString * xpointer)
 {
     AQXMLXPath * xPath = [AQXMLXPath XPathWithString: xpointer
@@ -134,9 +187,7 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
             
             [nodeSet expandSubtree];
             [nodeSet sort];
-            NSData * data = [AQXMLCanonicalizer canonicalizeDocument: nodeSet[0].document usingMethod: AQXMLCanonicalizationMethod_1_0|AQXMLCanonicalizationMethod_with_comments visibilityFilter: ^BOOL(AQXMLNode *node) {
-                return ( [nodeSet containsNode: node] );
-            }];
+            NSData * data = [AQXMLCanonicalizer canonicalizeNodeSet: nodeSet usingMethod: AQXMLCanonicalizationMethod_1_0|AQXMLCanonicalizationMethod_with_comments];
             
             if ( [data length] == 0 )
                 return ( nil );
@@ -173,9 +224,7 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
                 return ( nil );
             
             // use the canonicalizer
-            NSData * data = [AQXMLCanonicalizer canonicalizeDocument: nodes[0].document usingMethod: AQXMLCanonicalizationMethod_1_0 visibilityFilter: ^BOOL(AQXMLNode *node) {
-                return ( [nodes containsNode: node] );
-            }];
+            NSData * data = [AQXMLCanonicalizer canonicalizeNodeSet: nodes usingMethod: AQXMLCanonicalizationMethod_1_0];
             
             doc = [AQXMLDocument documentWithXMLData: data error: NULL];
             return ( doc.rootElement.copy );
@@ -247,14 +296,90 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
     if ( [proc setSignatureAlgorithm: signatureAlgorithm withKey: signingKey] == NO )
         return ( nil );
     
+    NSString * digestTransformURI = TransformURIForDigestAlgorithm(digestAlgorithm);
+    AQXMLCanonicalizationMethod canonMethod = ReferenceCanonicalizationMethod(version);
+    
+    // small resources are digested together, several at a time; the references keep their order
+    NSMutableArray * references = [NSMutableArray arrayWithCapacity: [URLs count]];
+    NSMutableIndexSet * batchIndices = [NSMutableIndexSet indexSet];
+    NSMutableArray * batchOctets = [NSMutableArray new];
+    NSMutableArray * batchTransforms = [NSMutableArray new];
+    __block NSUInteger batchBytes = 0;
+    
+    BOOL (^digestBatch)(void) = ^BOOL{
+        if ( [batchOctets count] == 0 )
+            return ( YES );
+        
+        NSArray * digests = [AQXMLDigest digestsOfMessages: batchOctets withAlgorithm: digestTransformURI];
+        if ( digests == nil )
+            return ( NO );
+        
+        __block NSUInteger i = 0;
+        [batchIndices enumerateIndexesUsingBlock: ^(NSUInteger idx, BOOL *stop) {
+            references[idx] = ReferenceElementWithDigest(digests[i], batchTransforms[i], digestTransformURI);
+            i++;
+        }];
+        
+        [batchIndices removeAllIndexes];
+        [batchOctets removeAllObjects];
+        [batchTransforms removeAllObjects];
+        batchBytes = 0;
+        return ( YES );
+    };
+    
     for ( NSURL * url in URLs )
     {
-        AQXMLElement * reference = [self referenceElementWithURL: url
-                                                         version: version
-                                                    digestMethod: digestAlgorithm];
-        if ( reference == nil )
+        NSNumber * size = nil;
+        if ( [url getResourceValue: &size forKey: NSURLFileSizeKey error: NULL] == NO || size == nil ||
+             [size unsignedLongLongValue] > kAQXMLReferenceBatchMaxLength )
+        {
+            // large or remote, so it's canonicalized straight into its own digest
+            AQXMLElement * reference = [self referenceElementWithURL: url
+                                                             version: version
+                                                        digestMethod: digestAlgorithm];
+            if ( reference == nil )
+                return ( nil );
+            
+            [references addObject: reference];
+            continue;
+        }
+        
+        NSData * data = [[NSData alloc] initWithContentsOfURL: url options: 0 error: NULL];
+        if ( data == nil )
             return ( nil );
         
+        // is it an XML document? If so, the canonical form is what gets digested
+        NSMutableData * canonical = [NSMutableData new];
+        if ( [AQXMLCanonicalizer canonicalizeData: data usingMethod: canonMethod visibilityFilter: nil outputHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** error) {
+                [canonical appendBytes: bytes length: length];
+                return ( YES );
+            } error: NULL] )
+        {
+            data = canonical;
+            [batchTransforms addObject: @[TransformURIFromCanonicalizationMethod(canonMethod)]];
+        }
+        else
+        {
+            [batchTransforms addObject: @[]];
+        }
+        
+        [batchIndices addIndex: [references count]];
+        [references addObject: [NSNull null]];
+        [batchOctets addObject: data];
+        batchBytes += [data length];
+        
+        if ( [batchOctets count] == kAQXMLReferenceBatchMaxCount || batchBytes >= kAQXMLReferenceBatchMaxBytes )
+        {
+            if ( digestBatch() == NO )
+                return ( nil );
+        }
+    }
+    
+    if ( digestBatch() == NO )
+        return ( nil );
+    
+    for ( AQXMLElement * reference in references )
+    {
         [proc appendManifestReference: reference];
     }
     
@@ -265,72 +390,32 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
                                    version: (AQXMLSignatureVersion) version
                               digestMethod: (AQDigestAlgorithm) digestAlgorithm
 {
-    NSData * data = [[NSData alloc] initWithContentsOfURL: url];
+    NSData * data = [[NSData alloc] initWithContentsOfURL: url options: NSDataReadingMappedIfSafe error: NULL];
     if ( data == nil )
         return ( nil );
     
-    NSMutableArray * transformURIs = [NSMutableArray new];
+    NSString * digestTransformURI = TransformURIForDigestAlgorithm(digestAlgorithm);
+    AQXMLDigest * digester = [AQXMLDigest digestWithAlgorithm: digestTransformURI];
+    if ( digester == nil )
+        return ( nil );
     
-    // is it an XML document? If so, this canonicaiization will work:
-    AQXMLCanonicalizationMethod canonMethod = AQXMLCanonicalizationMethod_1_1;
-    if ( version == AQXMLSignatureVersion2_0 )
-        canonMethod = AQXMLCanonicalizationMethod_2_0;
-    canonMethod |= AQXMLCanonicalizationMethod_with_comments;
+    NSMutableArray * transformURIs = [NSMutableArray new];
     
-    NSData * canonicalized = [AQXMLCanonicalizer canonicalizeData: data usingMethod: canonMethod visibilityFilter: nil];
-    if ( canonicalized != nil )
+    // is it an XML document? If so, this canonicalization will work, feeding the digest as it goes:
+    AQXMLCanonicalizationMethod canonMethod = ReferenceCanonicalizationMethod(version);
+    if ( [AQXMLCanonicalizer canonicalizeData: data usingMethod: canonMethod visibilityFilter: nil outputHandler: digester.outputHandler error: NULL] )
     {
-        data = canonicalized;
         [transformURIs addObject: TransformURIFromCanonicalizationMethod(canonMethod)];
     }
-    
-    // digest it !
-    NSString * digestTransformURI = TransformURIForDigestAlgorithm(digestAlgorithm);
-    AQXMLTransform * tx = [AQXMLTransform transformForURI: digestTransformURI];
-    if ( tx == nil )
-        return ( nil );
-    
-    tx.input = data;
-    NSData * digest = [tx process];
-    if ( digest == nil )
-        return ( nil );
-    
-    AQXMLElement * reference = [AQXMLElement elementWithName: @"Reference" content: nil inNamespace: nil];
-    AQXMLNamespace * dsigNS = [AQXMLNamespace namespaceWithNode: reference URI: AQXMLDSig10NamespaceURI prefix: nil];
-    reference.ns = dsigNS;
-    
-    AQXMLElement * transforms = [reference addChildNamed: @"Transforms"];
-    
-    for ( NSString * transformURI in transformURIs )
+    else
     {
-        AQXMLElement * transform = [transforms addChildNamed: @"Transform"];
-        
-        // special-case for XML Canonicalization 2.0
-        if ( [transformURI hasSuffix: @"xml-c14n2#WithComments"] )
-        {
-            // that's not a real transform URI-- remove the fragment and add sub-elements to specify comment preservation
-            [transform addAttributeNamed: @"Algorithm" withValue: [transformURI substringToIndex: [transformURI length] - 13]];
-            
-            AQXMLNamespace * c14n2ns = [AQXMLNamespace namespaceWithNode: transform URI: AQXMLC14N2NamespaceURI prefix: @"c14n2"];
-            transform.ns = c14n2ns;
-            
-            [transform addChild: [AQXMLElement elementWithName: @"IgnoreComments"
-                                                       content: @"true"
-                                                   inNamespace: c14n2ns]];
-        }
-        else
-        {
-            [transform addAttributeNamed: @"Algorithm" withValue: transformURI];
-        }
+        // not XML -- some output may already have been digested, so start again on the raw bytes
+        digester = [AQXMLDigest digestWithAlgorithm: digestTransformURI];
+        [digester updateWithData: data];
     }
     
-    AQXMLElement * digestMethod = [reference addChildNamed: @"DigestMethod"];
-    [digestMethod addAttributeNamed: @"Algorithm" withValue: digestTransformURI];
-    
-    // now the digest -- which must be base64-encoded to a string value
-    (void) [reference addChildNamed: @"DigestValue" withTextContent: [Base64Transform encode: digest]];
-    
-    return ( reference );
+    // digest it !
+    return ( ReferenceElementWithDigest([digester finalDigest], transformURIs, digestTransformURI) );
 }
 
 #pragma mark -
@@ -346,29 +431,36 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
     return ( self );
 }
 
-- (NSData *) ensureDigestable: (id) object
+// canonical forms are written straight into the digest, never held in memory
+- (BOOL) digestObject: (id) object
+          usingMethod: (AQXMLCanonicalizationMethod) canonMethod
+           intoDigest: (AQXMLDigest *) digest
 {
-    AQXMLCanonicalizationMethod defaultCanonMethod = (self.version == AQXMLSignatureVersion2_0 ? AQXMLCanonicalizationMethod_2_0 : AQXMLCanonicalizationMethod_1_0 );
     if ( [object isKindOfClass: [NSData class]] )
     {
-        return ( object );
+        [digest updateWithData: object];
+        return ( YES );
+    }
+    else if ( [object isKindOfClass: [NSInputStream class]] )
+    {
+        return ( [digest updateWithStream: object] );
+    }
+    else if ( [object isKindOfClass: [AQXMLDocument class]] )
+    {
+        return ( [AQXMLCanonicalizer canonicalizeDocument: object usingMethod: canonMethod visibilityFilter: nil outputHandler: digest.outputHandler error: NULL] );
     }
     else if ( [object isKindOfClass: [AQXMLElement class]] )
     {
-        return ( [AQXMLCanonicalizer canonicalizeElement: object usingMethod: defaultCanonMethod visibilityFilter: nil] );
+        return ( [AQXMLCanonicalizer canonicalizeElement: object usingMethod: canonMethod visibilityFilter: nil outputHandler: digest.outputHandler error: NULL] );
     }
     else if ( [object isKindOfClass: [AQXMLNodeSet class]] )
     {
-        if ( [object count] == 0 )
-            return ( [NSData data] );       // empty data
-        
-        [AQXMLCanonicalizer canonicalizeDocument: [object nodeAtIndex: 0].document usingMethod: defaultCanonMethod visibilityFilter: ^BOOL(AQXMLNode *node) {
-            return ( [object containsNode: node] );
-        }];
+        // empty data is actually permitted by the standard
+        return ( [AQXMLCanonicalizer canonicalizeNodeSet: object usingMethod: canonMethod outputHandler: digest.outputHandler error: NULL] );
     }
     
     // otherwise, the object is invalid
-    return ( nil );
+    return ( NO );
 }
 
 - (BOOL) validateReferenceElement: (AQXMLElement *) reference
@@ -400,8 +492,11 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
         NSRange r = [uri rangeOfString: @"#"];
         if ( r.location == NSNotFound )
         {
-            // it's a plain item somewhere -- just load data
-            referencedObject = [NSData dataWithContentsOfURL: target];
+            // it's a plain item somewhere -- files are read a piece at a time if they can be
+            if ( [target isFileURL] )
+                referencedObject = [NSInputStream inputStreamWithURL: target];
+            else
+                referencedObject = [NSData dataWithContentsOfURL: target];
         }
         else if ( r.location == 0 )
         {
@@ -424,75 +519,83 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
         if ( referencedObject == nil )
             return ( NO );
         
-        // build a Transform list
-        AQXMLTransform * tx = [self buildTransformFromList: [[reference firstChildNamed: @"Transforms"] childrenNamed: @"Transform"]];
-        if ( tx == nil )
+        // build a Transform list, which may be empty
+        NSArray * transformElements = [[reference firstChildNamed: @"Transforms"] childrenNamed: @"Transform"];
+        AQXMLTransform * tx = [self buildTransformFromList: transformElements];
+        if ( tx == nil && [transformElements count] != 0 )
             return ( NO );
         
-        NSData * dataToDigest = nil;
-        if ( tx != nil )
+        // now get the digest algorithm & expected output
+        AQXMLElement * digestMethod = [reference firstChildNamed: @"DigestMethod"];
+        if ( digestMethod == nil )
+            return ( NO );
+        
+        AQXMLDigest * digest = [AQXMLDigest digestWithAlgorithm: [digestMethod attributeNamed: @"Algorithm"].value];
+        if ( digest == nil )
+            return ( NO );      // unknown digest algorithm
+        
+        AQXMLElement * digestValue = [reference firstChildNamed: @"DigestValue"];
+        if ( digestValue == nil )
+            return ( NO );
+        
+        // a trailing transform which can stream, such as a canonicalization or a fused run
+        // starting with one, is streamed directly into the digest below
+        AQXMLCanonicalizationMethod canonMethod = (self.version == AQXMLSignatureVersion2_0 ? AQXMLCanonicalizationMethod_2_0 : AQXMLCanonicalizationMethod_1_0);
+        AQXMLTransform * lastTx = tx, * prevTx = nil, * streamTx = nil;
+        while ( lastTx.next != nil )
         {
-            tx.input = referencedObject;
-            dataToDigest = [self ensureDigestable: [tx process]];
+            prevTx = lastTx;
+            lastTx = lastTx.next;
         }
-        else
+        
+        if ( lastTx.canStreamInput )
         {
-            dataToDigest = [self ensureDigestable: referencedObject];
+            streamTx = lastTx;
+            if ( prevTx != nil )
+                prevTx.next = nil;
+            else
+                tx = nil;
         }
         
-        if ( [dataToDigest isKindOfClass: [NSData class]] )
+        // only octet stages can read a stream themselves, so anything else gets the whole file
+        if ( [referencedObject isKindOfClass: [NSInputStream class]] && (tx != nil || (streamTx != nil && streamTx.canConsumeStream == NO)) )
         {
-            if ( [dataToDigest isKindOfClass: [AQXMLElement class]] )
-            {
-                dataToDigest = [AQXMLCanonicalizer canonicalizeElement: (AQXMLElement *)dataToDigest
-                                                         usingMethod: AQXMLCanonicalizationMethod_1_0
-                                                    visibilityFilter: nil];
-            }
-            else if ( [dataToDigest isKindOfClass: [AQXMLNodeSet class]] )
-            {
-                AQXMLNodeSet * nodes = (AQXMLNodeSet *)dataToDigest;
-                if ( [nodes count] != 0 )
-                {
-                    dataToDigest = [AQXMLCanonicalizer canonicalizeDocument: nodes[0].document usingMethod: AQXMLCanonicalizationMethod_1_0 visibilityFilter: ^BOOL(AQXMLNode *node) {
-                        return ( [nodes containsNode: node] );
-                    }];
-                }
-                else
-                {
-                    // empty data is actually permitted by the standard
-                    dataToDigest = [NSData data];
-                }
-            }
-            else
-            {
-                // flag this for follow-up -- might need more processing
-                NSLog(@"Transformed data from URI %@ is of non-data class %@",
-                      uri, NSStringFromClass([referencedObject class]));
+            referencedObject = [NSData dataWithContentsOfURL: target options: NSDataReadingMappedIfSafe error: NULL];
+            if ( referencedObject == nil )
                 return ( NO );
-            }
         }
         
-        // now get the digest transformation & expected output
-        AQXMLElement * digestMethod = [referencedObject firstChildNamed: @"DigestMethod"];
-        if ( digestMethod == nil )
-            return ( NO );
-        
-        AQXMLTransform * digestTransform = [AQXMLTransform transformForURI: [digestMethod attributeNamed: @"Algorithm"].value];
-        if ( digestTransform == nil )
-            return ( NO );      // unknown transform algorithm
+        id objectToDigest = referencedObject;
+        if ( tx != nil )
+        {
+            tx.input = referencedObject;
+            objectToDigest = [tx process];
+        }
         
-        // set the transform's input
-        digestTransform.input = dataToDigest;
+        BOOL digested = NO;
+        if ( streamTx != nil )
+        {
+            streamTx.downstream = digest;
+            digested = [streamTx streamInput: objectToDigest];
+            streamTx.downstream = nil;
+        }
+        else
+        {
+            digested = [self digestObject: objectToDigest usingMethod: canonMethod intoDigest: digest];
+        }
         
-        AQXMLElement * digestValue = [referencedObject firstChildNamed: @"DigestValue"];
-        if ( digestValue == nil )
+        if ( digested == NO )
+        {
+            // flag this for follow-up -- might need more processing
+            NSLog(@"Unable to digest transformed data from URI %@ (class %@)",
+                  uri, NSStringFromClass([objectToDigest class]));
             return ( NO );
+        }
         
-        NSData * expectedDigest = [Base64Transform decode: [digestValue.stringValue dataUsingEncoding: NSUTF8StringEncoding]];
+        NSData * expectedDigest = [Base64Decoder decodeTextOfElement: digestValue];
         
-        // run the digest operation and compare results
-        NSData * digested = [digestTransform process];
-        return ( [digested isEqualToData: expectedDigest] );
+        // compare results
+        return ( [[digest finalDigest] isEqualToData: expectedDigest] );
     }
 }
 
@@ -517,7 +620,8 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
         }
     }
     
-    return ( tx );
+    // adjacent streaming stages pass their data along without gathering it at each step
+    return ( [AQXMLFusedTransform transformByFusingChain: tx] );
 }
 
 - (SecKeyRef) keyWithName: (NSString *) name
@@ -693,7 +797,7 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
     if ( dsaKeyValue == nil && rsaKeyValue == nil && ecKeyValue == nil )
     {
         // key is stored as a base-64 string
-        NSData * keyData = [Base64Transform decode: [keyValue.stringValue dataUsingEncoding: NSUTF8StringEncoding]];
+        NSData * keyData = [Base64Decoder decodeTextOfElement: keyValue];
         if ( keyData == nil )
             return ( NULL );
         
@@ -825,7 +929,7 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
                 for ( AQXMLElement * certElement in [element childrenNamed: @"X509Certificate"] )
                 {
                     // contains base64 DER-encoded data
-                    NSData * certData = [Base64Transform decode: [certElement.stringValue dataUsingEncoding: NSUTF8StringEncoding]];
+                    NSData * certData = [Base64Decoder decodeTextOfElement: certElement];
                     SecCertificateRef cert = SecCertificateCreateWithData(kCFAllocatorDefault, (__bridge CFDataRef)certData);
                     if ( cert == NULL )
                         continue;
@@ -844,7 +948,7 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
             }
             else if ( [name isEqualToString: @"DEREncodedKeyData"] )
             {
-                NSData * data = [Base64Transform decode: [element.stringValue dataUsingEncoding: NSUTF8StringEncoding]];
+                NSData * data = [Base64Decoder decodeTextOfElement: element];
                 if ( data != nil )
                 {
                     SecKeyRef key = ImportKeyData(data, @[(__bridge id)kSecAttrCanVerify]);
@@ -937,8 +1041,7 @@ static AQXMLElement * ElementAtURI(NSString * uri, AQXMLTransform * transform)
         if ( signatureTransform == nil )
             return ( NO );
         
-        NSString * base64Signature = [signatureElement firstChildNamed: @"SignatureValue"].stringValue;
-        NSData * expectedSignature = [Base64Transform decode: [base64Signature dataUsingEncoding: NSUTF8StringEncoding]];
+        NSData * expectedSignature = [Base64Decoder decodeTextOfElement: [signatureElement firstChildNamed: @"SignatureValue"]];
         
         // load the key
         AQXMLElement * keyInfo = [signatureElement firstChildNamed: @"KeyInfo"];
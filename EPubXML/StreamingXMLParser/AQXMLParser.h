@@ -39,7 +39,26 @@
 #import <Foundation/Foundation.h>
 
 @class _AQXMLParserInternal;
-@protocol AQXMLParserDelegate, AQXMLParserProgressDelegate;
+@protocol AQXMLParserDelegate, AQXMLParserProgressDelegate, AQXMLParserTokenDelegate, AQXMLParserInputFilter;
+
+// names interned in the parser's libxml dictionary: equal names have equal pointers
+// tokens remain valid for the lifetime of the parser which produced them
+typedef const char * AQXMLNameToken;
+
+// bytes borrowed from the parser: only valid for the duration of the callback
+typedef struct AQXMLByteSlice
+{
+    const char *    bytes;
+    NSUInteger      length;
+} AQXMLByteSlice;
+
+typedef struct AQXMLTokenAttribute
+{
+    AQXMLNameToken  localName;
+    AQXMLNameToken  prefix;         // NULL if unprefixed
+    AQXMLNameToken  namespaceURI;   // NULL if in no namespace
+    AQXMLByteSlice  value;
+} AQXMLTokenAttribute;
 
 extern NSString * const AQXMLParserParsingRunLoopMode;
 
@@ -62,9 +81,28 @@ extern NSString * const AQXMLParserBrokenPipeNotification;
 
 - (id) initWithData: (NSData *) data;   // creates a stream from the data
 
+// local files are memory-mapped; in pull mode the mapping is fed to libxml in place
+- (id) initWithContentsOfURL: (NSURL *) url;
+
+// reads directly from a file descriptor; only usable with -parseSynchronously
+// the descriptor is not closed by the parser
+- (id) initWithFileDescriptor: (int) fd;
+
+// either delegate may be changed mid-parse; events from the next callback go to the new one
 @property (NS_NONATOMIC_IOSONLY weak) id<AQXMLParserDelegate> delegate;
 @property (NS_NONATOMIC_IOSONLY weak) id<AQXMLParserProgressDelegate> progressDelegate;
 
+// receives the same events as the delegate, but as interned names & borrowed bytes
+// NSString-based delegate methods are still sent to the delegate if it implements them
+@property (NS_NONATOMIC_IOSONLY weak) id<AQXMLParserTokenDelegate> tokenDelegate;
+
+// rewrites raw input before it reaches libxml; nil (the default) passes input straight through
+// see AQXMLParserInputFilter.h
+@property (NS_NONATOMIC_IOSONLY strong) id<AQXMLParserInputFilter> inputFilter;
+
+// returns the token the parser will report for the given name
+- (AQXMLNameToken) tokenForName: (NSString *) name;
+
 @property (NS_NONATOMIC_IOSONLY assign) BOOL shouldProcessNamespaces;
 @property (NS_NONATOMIC_IOSONLY assign) BOOL shouldReportNamespacePrefixes;
 @property (NS_NONATOMIC_IOSONLY assign) BOOL shouldResolveExternalEntities;
@@ -73,6 +111,24 @@ extern NSString * const AQXMLParserBrokenPipeNotification;
 - (BOOL) parse;
 - (void) abortParsing;
 
+// pull-mode parsing: reads from the stream or file descriptor in chunkSize
+// blocks on the calling thread, without scheduling on any runloop
+// data passed to -initWithData: is pushed directly from its own bytes
+// a parser consumes its input once: calling this again after it finishes returns NO,
+// with parserError set
+- (BOOL) parseSynchronously;
+
+// pull-mode parsing one chunk at a time, for callers that schedule the work themselves.
+// Returns YES while input remains; once it returns NO the parse is over, and parserError
+// is set if it failed. -parseSynchronously is a loop over this.
+- (BOOL) parseNextChunk;
+
+// size of each read in pull mode, clamped to 64 KB - 1 MB (default 256 KB)
+@property (NS_NONATOMIC_IOSONLY assign) NSUInteger chunkSize;
+
+// input throughput of the last pull-mode parse
+@property (NS_NONATOMIC_IOSONLY readonly) double bytesPerSecond;
+
 // asynchronous parsing on the given runloop/mode
 // completionSelector should match the following structure:
 // - (void) xmlParser: (AQXMLParser *) parser completedOK: (BOOL) parsedOK context: (void *) context;
@@ -102,6 +158,22 @@ extern NSString * const AQXMLParserBrokenPipeNotification;
 @property (nonatomic, readonly) HTTPMessage * finalResponse;
 @end
 
+// A lower-overhead alternative to AQXMLParserDelegate: no objects are created per event.
+// Element & attribute names arrive as AQXMLNameTokens, so can be compared by pointer
+// against tokens obtained up front from -tokenForName:. Namespace URIs are reported
+// only when shouldProcessNamespaces is set. HTML mode reports names with no prefix or URI.
+@protocol AQXMLParserTokenDelegate <NSObject>
+@optional
+- (void) parser: (AQXMLParser *) parser didStartElement: (AQXMLNameToken) localName
+         prefix: (AQXMLNameToken) prefix namespaceURI: (AQXMLNameToken) namespaceURI
+     attributes: (const AQXMLTokenAttribute *) attributes count: (NSUInteger) count;
+- (void) parser: (AQXMLParser *) parser didEndElement: (AQXMLNameToken) localName
+         prefix: (AQXMLNameToken) prefix namespaceURI: (AQXMLNameToken) namespaceURI;
+- (void) parser: (AQXMLParser *) parser foundCharacterBytes: (AQXMLByteSlice) characters;
+- (void) parser: (AQXMLParser *) parser foundIgnorableWhitespaceBytes: (AQXMLByteSlice) whitespace;
+- (void) parser: (AQXMLParser *) parser foundCDATABytes: (AQXMLByteSlice) CDATABlock;
+@end
+
 // parser reports progress as a value between 0.0 and 1.0
 @protocol AQXMLParserProgressDelegate <NSObject>
 - (void) parser: (AQXMLParser *) parser updateProgress: (float) progress;
@@ -40,6 +40,7 @@
 
 #import "AQXMLParser.h"
 #import "AQXMLParserInternal.h"
+#import "AQXMLParserInputFilter.h"
 
 //#import "NSStream+HTTPMessage.h"
 
@@ -53,6 +54,10 @@
 #import <libxml/encoding.h>
 #import <libxml/entities.h>
 
+#import <unistd.h>
+#import <errno.h>
+#import <sys/stat.h>
+
 #if TARGET_OS_IPHONE
 # import <CFNetwork/CFNetwork.h>
 #else
@@ -70,6 +75,11 @@ NSString * const AQXMLParserParsingRunLoopMode = @"AQXMLParserParsingRunLoopMode
 
 NSString * const AQXMLParserBrokenPipeNotification = @"AQXMLParserBrokenPipeNotification";
 
+// pull-mode read sizes
+#define AQXMLParserMinimumChunkSize     (64 * 1024)
+#define AQXMLParserMaximumChunkSize     (1024 * 1024)
+#define AQXMLParserDefaultChunkSize     (256 * 1024)
+
 enum
 {
 	AQXMLParserShouldProcessNamespaces	= 1<<0,
@@ -81,6 +91,40 @@ enum
 	
 };
 
+// delegate capabilities, snapshotted when a delegate is set
+enum
+{
+    AQXMLDelegateStartDocument              = 1<<0,
+    AQXMLDelegateEndDocument                = 1<<1,
+    AQXMLDelegateNotationDecl               = 1<<2,
+    AQXMLDelegateUnparsedEntityDecl         = 1<<3,
+    AQXMLDelegateAttributeDecl              = 1<<4,
+    AQXMLDelegateElementDecl                = 1<<5,
+    AQXMLDelegateInternalEntityDecl         = 1<<6,
+    AQXMLDelegateExternalEntityDecl         = 1<<7,
+    AQXMLDelegateStartElement               = 1<<8,
+    AQXMLDelegateEndElement                 = 1<<9,
+    AQXMLDelegateStartMappingPrefix         = 1<<10,
+    AQXMLDelegateEndMappingPrefix           = 1<<11,
+    AQXMLDelegateCharacters                 = 1<<12,
+    AQXMLDelegateIgnorableWhitespace        = 1<<13,
+    AQXMLDelegateProcessingInstruction      = 1<<14,
+    AQXMLDelegateComment                    = 1<<15,
+    AQXMLDelegateCDATA                      = 1<<16,
+    AQXMLDelegateResolveExternalEntity      = 1<<17,
+    AQXMLDelegateParseError                 = 1<<18,
+    
+    AQXMLTokenDelegateStartElement          = 1<<24,
+    AQXMLTokenDelegateEndElement            = 1<<25,
+    AQXMLTokenDelegateCharacters            = 1<<26,
+    AQXMLTokenDelegateIgnorableWhitespace   = 1<<27,
+    AQXMLTokenDelegateCDATA                 = 1<<28,
+    
+    AQXMLDelegateAnyElement                 = AQXMLDelegateStartElement | AQXMLDelegateEndElement |
+                                              AQXMLDelegateStartMappingPrefix | AQXMLDelegateEndMappingPrefix |
+                                              AQXMLTokenDelegateStartElement | AQXMLTokenDelegateEndElement
+};
+
 @interface AQXMLParser (Internal)
 - (void) _setParserError: (int) err;
 - (xmlParserCtxtPtr) _xmlParserContext;
@@ -94,6 +138,16 @@ enum
 - (void) _setStreamComplete: (BOOL) parsedOK;
 - (void) _setupExpectedLength;
 - (BOOL) _parseAborted;
+- (void) _finishParsing;
+- (NSInteger) _readPullBytes: (const uint8_t **) bytes buffer: (uint8_t *) buf maxLength: (NSUInteger) maxLength;
+- (void) _flushDebugOutput;
+- (void) _adoptNameDictionary;
+- (AQXMLTokenAttribute *) _tokenAttributeBuffer: (NSUInteger) count;
+- (void) _updateDelegateFlags;
+- (void) _pushInputBytes: (const void *) bytes length: (NSUInteger) length;
+- (void) _flushInputFilter;
+- (BOOL) _beginPullParse;
+- (void) _endPullParseWithReadResult: (NSInteger) len;
 @end
 
 #pragma mark -
@@ -134,6 +188,10 @@ static inline NSString * AttributeTypeString( int type )
 #define CTX(x) ((xmlParserCtxtPtr)(x))
 #define PARSER(p) ((__bridge AQXMLParser *)(p->sax->_private))
 
+// cheap per-event checks, in place of -respondsToSelector: & property accessors
+#define DELEGATE_WANTS(parser, flags)   (([parser _info]->delegateFlags & (flags)) != 0)
+#define PARSER_OPTION(parser, flag)     (([parser _info]->parserFlags & (flag)) == (flag))
+
 static int __isStandalone( void * ctx )
 {
 	xmlParserCtxtPtr p = CTX(ctx);
@@ -176,19 +234,24 @@ static void __characters( void * ctx, const xmlChar * ch, int len )
 {
     xmlParserCtxtPtr p = CTX(ctx);
     
-	AQXMLParser * parser = PARSER(p);
-    p = [parser _xmlParserContext];
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
+	_AQXMLParserInternal * info = [parser _info];
 	
-	if ( (uintptr_t)(p->_private) == 1 )
+	// text libxml emits for an entity __getEntity has already resolved
+	if ( info->skipEntityCharacters )
 	{
-		p->_private = 0;
+		info->skipEntityCharacters = NO;
 		return;
 	}
 	
 	RETURN_ON_ABORT();
 	
+	id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+	if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateCharacters) )
+		[tokenDelegate parser: parser foundCharacterBytes: (AQXMLByteSlice){ (const char *)ch, len }];
+	
 	id<AQXMLParserDelegate> delegate = parser.delegate;
-	if ( [delegate respondsToSelector: @selector(parser:foundCharacters:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateCharacters) == NO )
 		return;
 	
 	NSString * str = [[NSString allocWithZone: nil] initWithBytes: ch
@@ -212,7 +275,7 @@ static void __entityDecl( void * ctx, const xmlChar * name, int type, const xmlC
 						  const xmlChar * systemId, xmlChar * content )
 {
 	xmlParserCtxtPtr p = CTX(ctx);
-    AQXMLParser * parser = PARSER(p);
+    __unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	
 	RETURN_ON_ABORT();
@@ -224,12 +287,12 @@ static void __entityDecl( void * ctx, const xmlChar * name, int type, const xmlC
 	
 	if ( [contentStr length] != 0 )
 	{
-		if ( [delegate respondsToSelector: @selector(parser:foundInternalEntityDeclarationWithName:value:)] )
+		if ( DELEGATE_WANTS(parser, AQXMLDelegateInternalEntityDecl) )
 			[delegate parser: parser foundInternalEntityDeclarationWithName: nameStr value: contentStr];
 	}
-	else if ( [parser shouldResolveExternalEntities] )
+	else if ( PARSER_OPTION(parser, AQXMLParserShouldResolveExternals) )
 	{
-		if ( [delegate respondsToSelector: @selector(parser:foundExternalEntityDeclarationWithName:publicID:systemID:)] )
+		if ( DELEGATE_WANTS(parser, AQXMLDelegateExternalEntityDecl) )
 		{
 			NSString * publicIDStr = NSStringFromXmlChar(publicId);
 			NSString * systemIDStr = NSStringFromXmlChar(systemId);
@@ -244,11 +307,11 @@ static void __attributeDecl( void * ctx, const xmlChar * elem, const xmlChar * f
 							 const xmlChar * defaultValue, xmlEnumerationPtr tree )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundAttributeDeclarationWithName:forElement:type:defaultValue:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateAttributeDecl) == NO )
 		return;
 	
 	NSString * elemStr = NSStringFromXmlChar(elem);
@@ -262,11 +325,11 @@ static void __attributeDecl( void * ctx, const xmlChar * elem, const xmlChar * f
 static void __elementDecl( void * ctx, const xmlChar * name, int type, xmlElementContentPtr content )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundElementDeclarationWithName:model:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateElementDecl) == NO )
 		return;
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -276,11 +339,11 @@ static void __elementDecl( void * ctx, const xmlChar * name, int type, xmlElemen
 static void __notationDecl( void * ctx, const xmlChar * name, const xmlChar * publicId, const xmlChar * systemId )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundNotationDeclarationWithName:publicID:systemID:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateNotationDecl) == NO )
 		return;
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -295,13 +358,13 @@ static void __unparsedEntityDecl( void * ctx, const xmlChar * name, const xmlCha
 								  const xmlChar * systemId, const xmlChar * notationName )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
 	xmlSAX2UnparsedEntityDecl( p, name, publicId, systemId, notationName );
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundUnparsedEntityDeclarationWithName:publicID:systemID:notationName:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateUnparsedEntityDecl) == NO )
 		return;
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -316,7 +379,7 @@ static void __unparsedEntityDecl( void * ctx, const xmlChar * name, const xmlCha
 static void __startDocument( void * ctx )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
@@ -329,7 +392,7 @@ static void __startDocument( void * ctx )
 	
 	xmlSAX2StartDocument( p );
 	
-	if ( [delegate respondsToSelector: @selector(parserDidStartDocument:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateStartDocument) == NO )
 		return;
 	
 	[delegate parserDidStartDocument: parser];
@@ -338,11 +401,11 @@ static void __startDocument( void * ctx )
 static void __endDocument( void * ctx )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parserDidEndDocument:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateEndDocument) == NO )
 		return;
 	
 	[delegate parserDidEndDocument: parser];
@@ -351,25 +414,36 @@ static void __endDocument( void * ctx )
 static void __endElementNS( void * ctx, const xmlChar * localname, const xmlChar * prefix, const xmlChar * URI )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	NSString * prefixStr = nil;
-	
-	if ( [parser shouldProcessNamespaces] )
-		prefixStr = NSStringFromXmlChar(prefix);
-	
-	NSString * localnameStr = NSStringFromXmlChar(localname);
+	BOOL processNS = PARSER_OPTION(parser, AQXMLParserShouldProcessNamespaces);
 	
-	NSString * completeStr = localnameStr;
-	if ( [prefixStr length] != 0 )
-		completeStr = [[NSString alloc] initWithFormat: @"%@:%@", prefixStr, localnameStr];
-	
-	NSString * uriStr = NSStringFromXmlChar(URI);
+	id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+	if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateEndElement) )
+	{
+		// SAX2 hands us names straight from the parser's dictionary
+		[tokenDelegate parser: parser didEndElement: (AQXMLNameToken)localname
+					   prefix: (AQXMLNameToken)prefix
+				 namespaceURI: (AQXMLNameToken)(processNS ? URI : NULL)];
+	}
 	
-	if ( [delegate respondsToSelector: @selector(parser:didEndElement:namespaceURI:qualifiedName:)] )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateEndElement) )
 	{
+		NSString * prefixStr = nil;
+		
+		if ( processNS )
+			prefixStr = NSStringFromXmlChar(prefix);
+		
+		NSString * localnameStr = NSStringFromXmlChar(localname);
+		
+		NSString * completeStr = localnameStr;
+		if ( [prefixStr length] != 0 )
+			completeStr = [[NSString alloc] initWithFormat: @"%@:%@", prefixStr, localnameStr];
+		
+		NSString * uriStr = NSStringFromXmlChar(URI);
+		
 		if ( prefixStr != nil )
 		{
 			if ( (completeStr == nil) && (uriStr == nil) )
@@ -391,11 +465,11 @@ static void __endElementNS( void * ctx, const xmlChar * localname, const xmlChar
 static void __processingInstruction( void * ctx, const xmlChar * target, const xmlChar * data )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundProcessingInstructionWithTarget:data:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateProcessingInstruction) == NO )
 		return;
 	
 	NSString * targetStr = NSStringFromXmlChar(target);
@@ -407,11 +481,15 @@ static void __processingInstruction( void * ctx, const xmlChar * target, const x
 static void __cdataBlock( void * ctx, const xmlChar * value, int len )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundCDATA:)] == NO )
+	id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+	if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateCDATA) )
+		[tokenDelegate parser: parser foundCDATABytes: (AQXMLByteSlice){ (const char *)value, len }];
+	
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateCDATA) == NO )
 		return;
 	
 	NSData * data = [[NSData allocWithZone: nil] initWithBytes: value length: len];
@@ -421,11 +499,11 @@ static void __cdataBlock( void * ctx, const xmlChar * value, int len )
 static void __comment( void * ctx, const xmlChar * value )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundComment:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateComment) == NO )
 		return;
 	
 	NSString * commentStr = NSStringFromXmlChar(value);
@@ -442,11 +520,11 @@ static void __errorCallback( void * ctx, const char * msg, ... )
         return;
     
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:parseErrorOccurred:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateParseError) == NO )
 		return;
 	
 	[delegate parser: parser parseErrorOccurred: [NSError errorWithDomain: NSXMLParserErrorDomain
@@ -460,12 +538,12 @@ static void __structuredErrorFunc( void * ctx, xmlErrorPtr errorData )
         return;
     
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	_AQXMLParserInternal * info = [parser _info];
 	RETURN_ON_ABORT();
 	
-	if ( [delegate respondsToSelector: @selector(parser:parseErrorOccurred:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateParseError) == NO )
 		return;
 	
 	int code = (info->delegateAborted ? 0x200 : errorData->code);
@@ -482,9 +560,12 @@ static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
 	if ( entity != NULL )
 		return ( entity );
     
-    p->_private = (void *)1;
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
+	_AQXMLParserInternal * info = [parser _info];
+	
+    info->skipEntityCharacters = YES;
 	entity = xmlSAX2GetEntity( p, name );
-    p->_private = (void *)0;
+    info->skipEntityCharacters = NO;
     
 	if ( entity != NULL )
 	{
@@ -494,7 +575,8 @@ static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
             case XML_PARSER_PI:
             case XML_PARSER_DTD:
             {
-                p->_private = (void *)1;
+                // only __characters clears this, so don't leave it set if that isn't installed
+                info->skipEntityCharacters = (p->sax->characters != NULL);
                 break;
             }
             default:
@@ -505,11 +587,10 @@ static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
     
     if ( p->userData == p )
         return ( NULL );
-	AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = parser.delegate;
 	RETURN_VAL_ON_ABORT(NULL);
 	
-	if ( [delegate respondsToSelector: @selector(parser:resolveExternalEntityName:systemID:)] == NO )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateResolveExternalEntity) == NO )
 		return ( NULL );
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -535,12 +616,42 @@ static void __startElementNS( void * ctx, const xmlChar *localname, const xmlCha
 							 int nb_attributes, int nb_defaulted, const xmlChar **attributes)
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = [parser delegate];
 	RETURN_ON_ABORT();
 	
-	BOOL processNS = [parser shouldProcessNamespaces];
-	BOOL reportNS = [parser shouldReportNamespacePrefixes];
+	BOOL processNS = PARSER_OPTION(parser, AQXMLParserShouldProcessNamespaces);
+	BOOL reportNS = PARSER_OPTION(parser, AQXMLParserShouldReportPrefixes);
+	
+	id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+	if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateStartElement) )
+	{
+		// names & URIs are already interned in the parser's dictionary by SAX2
+		AQXMLTokenAttribute * tokenAttrs = [parser _tokenAttributeBuffer: nb_attributes];
+		NSUInteger count = 0;
+		for ( int i = 0; i < (nb_attributes * 5); i += 5 )
+		{
+			if ( attributes[i] == NULL )
+				continue;
+			
+			AQXMLTokenAttribute * attr = &tokenAttrs[count++];
+			attr->localName = (AQXMLNameToken)attributes[i];
+			attr->prefix = (AQXMLNameToken)attributes[i+1];
+			attr->namespaceURI = (AQXMLNameToken)(processNS ? attributes[i+2] : NULL);
+			attr->value.bytes = (const char *)attributes[i+3];
+			attr->value.length = (attributes[i+3] == NULL ? 0 : attributes[i+4] - attributes[i+3]);
+		}
+		
+		[tokenDelegate parser: parser didStartElement: (AQXMLNameToken)localname
+					   prefix: (AQXMLNameToken)prefix
+				 namespaceURI: (AQXMLNameToken)(processNS ? URI : NULL)
+				   attributes: tokenAttrs
+						count: count];
+	}
+	
+	// nothing further to do if nobody wants the NSString versions
+	if ( reportNS == NO && DELEGATE_WANTS(parser, AQXMLDelegateStartElement) == NO )
+		return;
 	
 	NSString * prefixStr = NSStringFromXmlChar(prefix);
 	NSString * localnameStr = NSStringFromXmlChar(localname);
@@ -616,7 +727,7 @@ static void __startElementNS( void * ctx, const xmlChar *localname, const xmlCha
 		[attrDict setObject: attrValue forKey: attrQualified];
 	}
 	
-	if ( [delegate respondsToSelector: @selector(parser:didStartElement:namespaceURI:qualifiedName:attributes:)] )
+	if ( DELEGATE_WANTS(parser, AQXMLDelegateStartElement) )
 	{
 		[delegate parser: parser
 		 didStartElement: localnameStr
@@ -629,11 +740,39 @@ static void __startElementNS( void * ctx, const xmlChar *localname, const xmlCha
 static void __startElement( void * ctx, const xmlChar * name, const xmlChar ** attrs )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = [parser delegate];
 	RETURN_ON_ABORT();
     
-    if ( [delegate respondsToSelector: @selector(parser:didStartElement:namespaceURI:qualifiedName:attributes:)] == NO )
+    id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+    if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateStartElement) )
+    {
+        NSUInteger nattrs = 0;
+        if ( attrs != NULL )
+        {
+            while ( attrs[nattrs * 2] != NULL )
+                nattrs++;
+        }
+        
+        AQXMLTokenAttribute * tokenAttrs = [parser _tokenAttributeBuffer: nattrs];
+        for ( NSUInteger i = 0; i < nattrs; i++ )
+        {
+            const xmlChar * value = attrs[i * 2 + 1];
+            tokenAttrs[i].localName = (AQXMLNameToken)xmlDictLookup( p->dict, attrs[i * 2], -1 );
+            tokenAttrs[i].prefix = NULL;
+            tokenAttrs[i].namespaceURI = NULL;
+            tokenAttrs[i].value.bytes = (const char *)value;
+            tokenAttrs[i].value.length = (value == NULL ? 0 : strlen((const char *)value));
+        }
+        
+        [tokenDelegate parser: parser didStartElement: (AQXMLNameToken)xmlDictLookup( p->dict, name, -1 )
+                       prefix: NULL
+                 namespaceURI: NULL
+                   attributes: tokenAttrs
+                        count: nattrs];
+    }
+    
+    if ( DELEGATE_WANTS(parser, AQXMLDelegateStartElement) == NO )
         return;
     
     NSString * nameStr = NSStringFromXmlChar(name);
@@ -664,11 +803,19 @@ static void __startElement( void * ctx, const xmlChar * name, const xmlChar ** a
 static void __endElement( void * ctx, const xmlChar * name )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = [parser delegate];
 	RETURN_ON_ABORT();
     
-    if ( [delegate respondsToSelector: @selector(parser:didEndElement:namespaceURI:qualifiedName:)] == NO )
+    id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+    if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateEndElement) )
+    {
+        [tokenDelegate parser: parser didEndElement: (AQXMLNameToken)xmlDictLookup( p->dict, name, -1 )
+                       prefix: NULL
+                 namespaceURI: NULL];
+    }
+    
+    if ( DELEGATE_WANTS(parser, AQXMLDelegateEndElement) == NO )
         return;
     
     NSString * nameStr = NSStringFromXmlChar(name);
@@ -680,11 +827,15 @@ static void __endElement( void * ctx, const xmlChar * name )
 static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 {
     xmlParserCtxtPtr p = CTX(ctx);
-	AQXMLParser * parser = PARSER(p);
+	__unsafe_unretained AQXMLParser * parser = PARSER(p);
 	id<AQXMLParserDelegate> delegate = [parser delegate];
 	RETURN_ON_ABORT();
     
-    if ( [delegate respondsToSelector: @selector(parser:foundIgnorableWhitespace:)] == NO )
+    id<AQXMLParserTokenDelegate> tokenDelegate = parser.tokenDelegate;
+    if ( DELEGATE_WANTS(parser, AQXMLTokenDelegateIgnorableWhitespace) )
+        [tokenDelegate parser: parser foundIgnorableWhitespaceBytes: (AQXMLByteSlice){ (const char *)ch, len }];
+    
+    if ( DELEGATE_WANTS(parser, AQXMLDelegateIgnorableWhitespace) == NO )
 		return;
 	
 	NSString * str = [[NSString allocWithZone: nil] initWithBytes: ch
@@ -697,7 +848,6 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 
 @implementation AQXMLParser
 
-@synthesize delegate=_delegate;
 @synthesize progressDelegate=_progressDelegate;
 
 - (id) initWithStream: (NSInputStream *) stream
@@ -714,6 +864,9 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 #endif
 	_internal->parserContext = NULL;
 	_internal->error = nil;
+	_internal->fileDescriptor = -1;
+	_internal->chunkSize = AQXMLParserDefaultChunkSize;
+	_internal->nameDict = xmlDictCreate();
 	
 	_stream = stream;
     if ( _internal->expectedDataLength != 0.0 )
@@ -735,12 +888,45 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 		return ( nil );
 	
     _internal->expectedDataLength = (float) [data length];
+    _internal->inputData = data;
+    return ( self );
+}
+
+- (id) initWithContentsOfURL: (NSURL *) url
+{
+    if ( [url isFileURL] == NO )
+        return ( [self initWithStream: [NSInputStream inputStreamWithURL: url]] );
+    
+    NSData * data = [[NSData alloc] initWithContentsOfURL: url options: NSDataReadingMappedIfSafe error: NULL];
+    if ( data == nil )
+        return ( nil );
+    
+    return ( [self initWithData: data] );
+}
+
+- (id) initWithFileDescriptor: (int) fd
+{
+    if ( fd < 0 )
+        return ( nil );
+    
+    self = [self initWithStream: nil];
+    if ( self == nil )
+        return ( nil );
+    
+    _internal->fileDescriptor = fd;
+    
+    struct stat st;
+    if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) )
+        _internal->expectedDataLength = (float) st.st_size;
+    
     return ( self );
 }
 
 - (void) dealloc
 {
 	NSZoneFree( nil, _internal->saxHandler );
+	free( _internal->tokenAttributes );
+	free( _internal->pullBuffer );
 	
 	if ( _internal->parserContext != NULL )
 	{
@@ -756,6 +942,9 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
             xmlFreeParserCtxt( _internal->parserContext );
         }
 	}
+	
+	if ( _internal->nameDict != NULL )
+		xmlDictFree( _internal->nameDict );
 }
 
 - (void) finalize
@@ -775,9 +964,54 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
         }
 	}
 	
+	if ( _internal->nameDict != NULL )
+		xmlDictFree( _internal->nameDict );
+	
 	[super finalize];
 }
 
+- (id<AQXMLParserDelegate>) delegate
+{
+	return ( _delegate );
+}
+
+- (void) setDelegate: (id<AQXMLParserDelegate>) delegate
+{
+	_delegate = delegate;
+	[self _updateDelegateFlags];
+}
+
+- (id<AQXMLParserTokenDelegate>) tokenDelegate
+{
+	return ( _internal->tokenDelegate );
+}
+
+- (void) setTokenDelegate: (id<AQXMLParserTokenDelegate>) tokenDelegate
+{
+	_internal->tokenDelegate = tokenDelegate;
+	[self _updateDelegateFlags];
+}
+
+- (id<AQXMLParserInputFilter>) inputFilter
+{
+	return ( _internal->inputFilter );
+}
+
+- (void) setInputFilter: (id<AQXMLParserInputFilter>) inputFilter
+{
+	_internal->inputFilter = inputFilter;
+	if ( inputFilter != nil && _internal->filterBuffer == nil )
+		_internal->filterBuffer = [[NSMutableData alloc] init];
+}
+
+- (AQXMLNameToken) tokenForName: (NSString *) name
+{
+	if ( name == nil )
+		return ( NULL );
+	
+	return ( (AQXMLNameToken)xmlDictLookup( _internal->nameDict, (const xmlChar *)[name UTF8String], -1 ) );
+}
+
 - (BOOL) debugLogInput
 {
 	return ( _internal->debugOutputStream != nil );
@@ -898,22 +1132,70 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
                        forMode: AQXMLParserParsingRunLoopMode];
 	[_stream close];
 	
-	if ( _internal->debugOutputStream != nil && [_internal->debugOutputStream streamStatus] != NSStreamStatusClosed )
-	{
-		NSData * data = [_internal->debugOutputStream propertyForKey: NSStreamDataWrittenToMemoryStreamKey];
-		if ( [_delegate respondsToSelector: @selector(writeReceivedData:)] )
-			[_delegate performSelector: @selector(writeReceivedData:) withObject: data];
-		
-		NSString * str = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
-		// DO NOT COMMENT OUT THIS LINE!!!!!!!!
-		// NO, REALLY--- STOP DOING IT!!!!!
-		NSLog( @"Response:\n%@", str );
-		[_internal->debugOutputStream close];
-	}
+	[self _flushDebugOutput];
 	
 	return ( _internal->error == nil );
 }
 
+- (BOOL) parseSynchronously
+{
+    if ( [self _beginPullParse] == NO )
+        return ( NO );
+    
+    while ( [self parseNextChunk] )
+        ;
+    
+    if ( _internal->delegateAborted )
+        return ( NO );
+    
+    return ( _internal->error == nil );
+}
+
+- (BOOL) parseNextChunk
+{
+    if ( _internal->pullStarted == NO && [self _beginPullParse] == NO )
+        return ( NO );
+    
+    // _pushXMLData:length: marks the stream complete if libxml reports an error
+    NSInteger len = 0;
+    if ( _streamComplete == NO && _internal->delegateAborted == NO )
+    {
+        const uint8_t * bytes = NULL;
+        len = [self _readPullBytes: &bytes buffer: _internal->pullBuffer maxLength: _internal->pullChunkSize];
+        if ( len > 0 )
+        {
+            _internal->pullTotal += len;
+            [self _pushInputBytes: bytes length: len];
+            
+            if ( _streamComplete == NO && _internal->delegateAborted == NO )
+                return ( YES );
+        }
+    }
+    
+    [self _endPullParseWithReadResult: len];
+    return ( NO );
+}
+
+- (NSUInteger) chunkSize
+{
+    return ( _internal->chunkSize );
+}
+
+- (void) setChunkSize: (NSUInteger) chunkSize
+{
+    if ( chunkSize < AQXMLParserMinimumChunkSize )
+        chunkSize = AQXMLParserMinimumChunkSize;
+    else if ( chunkSize > AQXMLParserMaximumChunkSize )
+        chunkSize = AQXMLParserMaximumChunkSize;
+    
+    _internal->chunkSize = chunkSize;
+}
+
+- (double) bytesPerSecond
+{
+    return ( _internal->bytesPerSecond );
+}
+
 - (BOOL) parseAsynchronouslyUsingRunLoop: (NSRunLoop *) runloop
                                     mode: (NSString *) mode
                        notifyingDelegate: (id) asyncCompletionDelegate
@@ -926,15 +1208,17 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	// see if bytes are already available on the stream
 	// if there are, we'll grab the first 4 bytes and use those to compute the encoding
 	// otherwise, we'll just go with no initial data
+	// they go through the input filter like everything else; the parser is created by the first push
 	uint8_t buf[4];
-	size_t buflen = 0;
+	NSInteger buflen = 0;
 	
 	_streamComplete = NO;
 	
 	if ( [_stream hasBytesAvailable] )
     {
 		buflen = [_stream read: buf maxLength: 4];
-        [self _initializeParserWithBytes: buf length: buflen];
+        if ( buflen > 0 )
+            [self _pushInputBytes: buf length: buflen];
     }
     
     // store async callbacks details
@@ -993,7 +1277,8 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 			
 		case NSStreamEventEndEncountered:
 		{
-			xmlParseChunk( _internal->parserContext, NULL, 0, 1 );
+			[self _flushInputFilter];
+			[self _finishParsing];
 			[self _setStreamComplete: YES];
 			break;
 		}
@@ -1030,13 +1315,7 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 			uint8_t buf[1024];
 			NSInteger len = [input read: buf maxLength: 1024];
 			if ( len > 0 )
-			{
-				char * found = strnstr( (char *)buf, "&#x13;", len );
-				if ( found != NULL )
-					memcpy( found, "[ARGH]", 6 );
-				
-				[self _pushXMLData: buf length: len];
-			}
+				[self _pushInputBytes: buf length: len];
 			
 			break;
 		}
@@ -1137,7 +1416,7 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	{
 		[_internal->namespaces addObject: nsDict];
 		
-		if ( [_delegate respondsToSelector: @selector(parser:didStartMappingPrefix:toURI:)] )
+		if ( (_internal->delegateFlags & AQXMLDelegateStartMappingPrefix) )
 		{
 			for ( NSString * key in nsDict )
 			{
@@ -1159,7 +1438,7 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	
 	if ( [obj isEqual: [NSNull null]] == NO )
 	{
-		if ( [_delegate respondsToSelector: @selector(parser:didEndMappingPrefix:)] )
+		if ( (_internal->delegateFlags & AQXMLDelegateEndMappingPrefix) )
 		{
 			for ( NSString * key in obj )
 			{
@@ -1171,10 +1450,62 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	[_internal->namespaces removeLastObject];
 }
 
+- (void) _updateDelegateFlags
+{
+	NSUInteger flags = 0;
+	id delegate = _delegate;
+	id tokenDelegate = _internal->tokenDelegate;
+	
+#define CHECK_DELEGATE(obj, sel, flag) if ( [obj respondsToSelector: @selector(sel)] ) flags |= flag
+	CHECK_DELEGATE(delegate, parserDidStartDocument:, AQXMLDelegateStartDocument);
+	CHECK_DELEGATE(delegate, parserDidEndDocument:, AQXMLDelegateEndDocument);
+	CHECK_DELEGATE(delegate, parser:foundNotationDeclarationWithName:publicID:systemID:, AQXMLDelegateNotationDecl);
+	CHECK_DELEGATE(delegate, parser:foundUnparsedEntityDeclarationWithName:publicID:systemID:notationName:, AQXMLDelegateUnparsedEntityDecl);
+	CHECK_DELEGATE(delegate, parser:foundAttributeDeclarationWithName:forElement:type:defaultValue:, AQXMLDelegateAttributeDecl);
+	CHECK_DELEGATE(delegate, parser:foundElementDeclarationWithName:model:, AQXMLDelegateElementDecl);
+	CHECK_DELEGATE(delegate, parser:foundInternalEntityDeclarationWithName:value:, AQXMLDelegateInternalEntityDecl);
+	CHECK_DELEGATE(delegate, parser:foundExternalEntityDeclarationWithName:publicID:systemID:, AQXMLDelegateExternalEntityDecl);
+	CHECK_DELEGATE(delegate, parser:didStartElement:namespaceURI:qualifiedName:attributes:, AQXMLDelegateStartElement);
+	CHECK_DELEGATE(delegate, parser:didEndElement:namespaceURI:qualifiedName:, AQXMLDelegateEndElement);
+	CHECK_DELEGATE(delegate, parser:didStartMappingPrefix:toURI:, AQXMLDelegateStartMappingPrefix);
+	CHECK_DELEGATE(delegate, parser:didEndMappingPrefix:, AQXMLDelegateEndMappingPrefix);
+	CHECK_DELEGATE(delegate, parser:foundCharacters:, AQXMLDelegateCharacters);
+	CHECK_DELEGATE(delegate, parser:foundIgnorableWhitespace:, AQXMLDelegateIgnorableWhitespace);
+	CHECK_DELEGATE(delegate, parser:foundProcessingInstructionWithTarget:data:, AQXMLDelegateProcessingInstruction);
+	CHECK_DELEGATE(delegate, parser:foundComment:, AQXMLDelegateComment);
+	CHECK_DELEGATE(delegate, parser:foundCDATA:, AQXMLDelegateCDATA);
+	CHECK_DELEGATE(delegate, parser:resolveExternalEntityName:systemID:, AQXMLDelegateResolveExternalEntity);
+	CHECK_DELEGATE(delegate, parser:parseErrorOccurred:, AQXMLDelegateParseError);
+	
+	CHECK_DELEGATE(tokenDelegate, parser:didStartElement:prefix:namespaceURI:attributes:count:, AQXMLTokenDelegateStartElement);
+	CHECK_DELEGATE(tokenDelegate, parser:didEndElement:prefix:namespaceURI:, AQXMLTokenDelegateEndElement);
+	CHECK_DELEGATE(tokenDelegate, parser:foundCharacterBytes:, AQXMLTokenDelegateCharacters);
+	CHECK_DELEGATE(tokenDelegate, parser:foundIgnorableWhitespaceBytes:, AQXMLTokenDelegateIgnorableWhitespace);
+	CHECK_DELEGATE(tokenDelegate, parser:foundCDATABytes:, AQXMLTokenDelegateCDATA);
+#undef CHECK_DELEGATE
+	
+	_internal->delegateFlags = flags;
+	
+	// libxml parses with its own copy of the handler table, so a live context needs it refreshed too
+	[self _initializeSAX2Callbacks];
+	xmlParserCtxtPtr ctx = _internal->parserContext;
+	if ( ctx != NULL && ctx->sax != NULL )
+	{
+		void * owner = ctx->sax->_private;
+		memcpy( ctx->sax, _internal.xmlSaxHandler, sizeof(xmlSAXHandler) );
+		ctx->sax->_private = owner;
+		
+		if ( ctx->sax->characters == NULL )
+			_internal->skipEntityCharacters = NO;
+	}
+}
+
 - (void) _initializeSAX2Callbacks
 {
 	xmlSAXHandlerPtr p = _internal.xmlSaxHandler;
+	NSUInteger flags = _internal->delegateFlags;
 	
+	// the handlers libxml itself relies upon are always installed
 	p->internalSubset = __internalSubset2;
 	p->isStandalone = __isStandalone;
 	p->hasInternalSubset = __hasInternalSubset2;
@@ -1182,29 +1513,36 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	p->resolveEntity = __resolveEntity;
 	p->getEntity = __getEntity;
 	p->entityDecl = __entityDecl;
-	p->notationDecl = __notationDecl;
-	p->attributeDecl = __attributeDecl;
-	p->elementDecl = __elementDecl;
 	p->unparsedEntityDecl = __unparsedEntityDecl;
 	p->setDocumentLocator = NULL;
 	p->startDocument = __startDocument;
-	p->endDocument = __endDocument;
-	p->startElement = NULL; //__startElement;
-	p->endElement = NULL; //__endElement;
-	p->startElementNs = __startElementNS;
-	p->endElementNs = __endElementNS;
+	// HTML uses the non-NS callbacks; for XML, we don't want these to get in the way
+	p->startElement = (self.HTMLMode && (flags & AQXMLDelegateAnyElement)) ? __startElement : NULL;
+	p->endElement = (self.HTMLMode && (flags & AQXMLDelegateAnyElement)) ? __endElement : NULL;
 	p->reference = __reference;
-	p->characters = __characters;
-	p->ignorableWhitespace = __ignorableWhitespace;
-	p->processingInstruction = __processingInstruction;
 	p->warning = __warningCallback;
 	p->error = __errorCallback;
     p->serror = __structuredErrorFunc;
 	//xmlSetStructuredErrorFunc( self, __structuredErrorFunc );
 	p->getParameterEntity = __getParameterEntity;
-	p->cdataBlock = __cdataBlock;
-	p->comment = __comment;
 	p->externalSubset = __externalSubset2;
+	
+	// the rest only if somebody is listening: libxml skips events with no handler
+#define DELEGATE_HANDLER(wanted, fn) ((flags & (wanted)) != 0 ? fn : NULL)
+	p->notationDecl = DELEGATE_HANDLER(AQXMLDelegateNotationDecl, __notationDecl);
+	p->attributeDecl = DELEGATE_HANDLER(AQXMLDelegateAttributeDecl, __attributeDecl);
+	p->elementDecl = DELEGATE_HANDLER(AQXMLDelegateElementDecl, __elementDecl);
+	p->endDocument = DELEGATE_HANDLER(AQXMLDelegateEndDocument, __endDocument);
+	// start & end are paired, since they push & pop the namespace stack
+	p->startElementNs = DELEGATE_HANDLER(AQXMLDelegateAnyElement, __startElementNS);
+	p->endElementNs = DELEGATE_HANDLER(AQXMLDelegateAnyElement, __endElementNS);
+	p->characters = DELEGATE_HANDLER(AQXMLDelegateCharacters|AQXMLTokenDelegateCharacters, __characters);
+	p->ignorableWhitespace = DELEGATE_HANDLER(AQXMLDelegateIgnorableWhitespace|AQXMLTokenDelegateIgnorableWhitespace, __ignorableWhitespace);
+	p->processingInstruction = DELEGATE_HANDLER(AQXMLDelegateProcessingInstruction, __processingInstruction);
+	p->cdataBlock = DELEGATE_HANDLER(AQXMLDelegateCDATA|AQXMLTokenDelegateCDATA, __cdataBlock);
+	p->comment = DELEGATE_HANDLER(AQXMLDelegateComment, __comment);
+#undef DELEGATE_HANDLER
+	
 	p->initialized = XML_SAX2_MAGIC;
 }
 
@@ -1212,10 +1550,8 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 {
     if ( self.HTMLMode )
     {
-        // for HTML, we use the non-NS callbacks; for XML, we don't want these to get in the way.
         htmlSAXHandlerPtr saxPtr = _internal.htmlSaxHandler;
-        saxPtr->startElement = __startElement;
-        saxPtr->endElement = __endElement;
+        [self _initializeSAX2Callbacks];
         
         _internal->parserContext = htmlCreatePushParserCtxt( saxPtr, (void *)&_internal->parserContext,
                                                              (const char *)(length > 0 ? buf : NULL),
@@ -1226,6 +1562,8 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
     }
     else
     {
+        // libxml copies the handler table, so install it to match the current delegates
+        [self _initializeSAX2Callbacks];
         _internal->parserContext = xmlCreatePushParserCtxt( _internal.xmlSaxHandler, (void *)&_internal->parserContext,
                                                            (const char *)(length > 0 ? buf : NULL),
                                                            (int)length, NULL );
@@ -1239,6 +1577,7 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
     }
     
     _internal->parserContext->userData = _internal->parserContext;
+    [self _adoptNameDictionary];
 }
 
 - (void) _pushXMLData: (const void *) bytes length: (NSUInteger) length
@@ -1345,5 +1684,204 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	return ( _internal->delegateAborted );
 }
 
+- (void) _finishParsing
+{
+    if ( _internal->parserContext == NULL )
+        return;
+    
+    if ( self.HTMLMode )
+        htmlParseChunk( _internal.htmlParserContext, NULL, 0, 1 );
+    else
+        xmlParseChunk( _internal.xmlParserContext, NULL, 0, 1 );
+}
+
+- (NSInteger) _readPullBytes: (const uint8_t **) bytes buffer: (uint8_t *) buf maxLength: (NSUInteger) maxLength
+{
+    NSData * input = _internal->inputData;
+    if ( input != nil )
+    {
+        NSUInteger len = MIN(maxLength, [input length] - _internal->inputOffset);
+        *bytes = (const uint8_t *)[input bytes] + _internal->inputOffset;
+        _internal->inputOffset += len;
+        return ( (NSInteger)len );
+    }
+    
+    *bytes = buf;
+    if ( _stream != nil )
+        return ( [_stream read: buf maxLength: maxLength] );
+    
+    ssize_t len = 0;
+    do
+    {
+        len = read( _internal->fileDescriptor, buf, maxLength );
+        
+    } while ( len < 0 && errno == EINTR );
+    
+    // anything called before the error is reported may overwrite errno
+    if ( len < 0 )
+        _internal->pullErrno = errno;
+    
+    return ( (NSInteger)len );
+}
+
+- (BOOL) _beginPullParse
+{
+    if ( _internal->pullStarted )
+        return ( YES );
+    
+    // the context has already seen the end of its input, and the input itself is consumed;
+    // either way there's nothing to parse, which callers mustn't mistake for an empty success
+    if ( _internal->pullFinished || (_stream == nil && _internal->fileDescriptor < 0) )
+    {
+        [self _setParserError: XML_ERR_INTERNAL_ERROR];
+        return ( NO );
+    }
+    
+    // the read size is fixed for the whole parse
+    _internal->pullChunkSize = self.chunkSize;
+    
+    // in-memory (or mapped) input is handed to libxml in place, so needs no read buffer
+    if ( _internal->inputData == nil )
+    {
+        _internal->pullBuffer = malloc( _internal->pullChunkSize );
+        if ( _internal->pullBuffer == NULL )
+        {
+            [self _setParserError: XML_ERR_NO_MEMORY];
+            return ( NO );
+        }
+        
+        if ( _stream != nil && [_stream streamStatus] == NSStreamStatusNotOpen )
+            [_stream open];
+    }
+    
+    _streamComplete = NO;
+    _internal->bytesPerSecond = 0.0;
+    _internal->inputOffset = 0;
+    _internal->pullTotal = 0;
+    _internal->pullStartTime = CFAbsoluteTimeGetCurrent();
+    _internal->pullStarted = YES;
+    
+    return ( YES );
+}
+
+- (void) _endPullParseWithReadResult: (NSInteger) len
+{
+    _internal->pullStarted = NO;
+    _internal->pullFinished = YES;
+    
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - _internal->pullStartTime;
+    if ( elapsed > 0.0 )
+        _internal->bytesPerSecond = (double)_internal->pullTotal / elapsed;
+    
+    if ( len < 0 )
+    {
+        if ( _internal->fileDescriptor < 0 )
+            _internal->error = [_stream streamError];
+        else
+            _internal->error = [NSError errorWithDomain: NSPOSIXErrorDomain code: _internal->pullErrno userInfo: nil];
+        
+        if ( DELEGATE_WANTS(self, AQXMLDelegateParseError) )
+            [_delegate parser: self parseErrorOccurred: _internal->error];
+        
+        [self _setStreamComplete: NO];
+    }
+    else if ( _streamComplete == NO && _internal->delegateAborted == NO )
+    {
+        [self _flushInputFilter];
+        [self _finishParsing];
+        [self _setStreamComplete: YES];
+    }
+    
+    free( _internal->pullBuffer );
+    _internal->pullBuffer = NULL;
+    
+    [_stream close];
+    [self _flushDebugOutput];
+}
+
+- (void) _adoptNameDictionary
+{
+    xmlParserCtxtPtr ctx = _internal->parserContext;
+    if ( ctx == NULL || _internal->nameDict == NULL || ctx->dict == _internal->nameDict )
+        return;
+    
+    // swap our dictionary in before any input is parsed, so tokens handed out by
+    // -tokenForName: are the same pointers SAX2 reports for those names
+    xmlDictReference( _internal->nameDict );
+    if ( ctx->dict != NULL )
+        xmlDictFree( ctx->dict );
+    ctx->dict = _internal->nameDict;
+    
+    // the context caches these from its original dictionary
+    ctx->str_xml = xmlDictLookup( ctx->dict, BAD_CAST "xml", 3 );
+    ctx->str_xmlns = xmlDictLookup( ctx->dict, BAD_CAST "xmlns", 5 );
+    ctx->str_xml_ns = xmlDictLookup( ctx->dict, XML_XML_NAMESPACE, 36 );
+}
+
+- (AQXMLTokenAttribute *) _tokenAttributeBuffer: (NSUInteger) count
+{
+    if ( count > _internal->tokenAttributeCapacity )
+    {
+        NSUInteger capacity = MAX(count, _internal->tokenAttributeCapacity * 2);
+        AQXMLTokenAttribute * buf = realloc( _internal->tokenAttributes, capacity * sizeof(AQXMLTokenAttribute) );
+        if ( buf == NULL )
+            return ( NULL );
+        
+        _internal->tokenAttributes = buf;
+        _internal->tokenAttributeCapacity = capacity;
+    }
+    
+    return ( _internal->tokenAttributes );
+}
+
+- (void) _pushInputBytes: (const void *) bytes length: (NSUInteger) length
+{
+    id<AQXMLParserInputFilter> filter = _internal->inputFilter;
+    if ( filter == nil )
+    {
+        [self _pushXMLData: bytes length: length];
+        return;
+    }
+    
+    // the filter runs in place over anything held back last time plus the new input
+    NSMutableData * work = _internal->filterBuffer;
+    [work appendBytes: bytes length: length];
+    
+    NSUInteger total = [work length];
+    NSUInteger held = MIN([filter filterBytes: [work mutableBytes] length: total final: NO], total);
+    if ( total > held )
+        [self _pushXMLData: [work bytes] length: total - held];
+    
+    memmove( [work mutableBytes], (const uint8_t *)[work bytes] + (total - held), held );
+    [work setLength: held];
+}
+
+- (void) _flushInputFilter
+{
+    NSMutableData * work = _internal->filterBuffer;
+    if ( _internal->inputFilter == nil || [work length] == 0 )
+        return;
+    
+    [_internal->inputFilter filterBytes: [work mutableBytes] length: [work length] final: YES];
+    [self _pushXMLData: [work bytes] length: [work length]];
+    [work setLength: 0];
+}
+
+- (void) _flushDebugOutput
+{
+	if ( _internal->debugOutputStream == nil || [_internal->debugOutputStream streamStatus] == NSStreamStatusClosed )
+		return;
+	
+	NSData * data = [_internal->debugOutputStream propertyForKey: NSStreamDataWrittenToMemoryStreamKey];
+	if ( [_delegate respondsToSelector: @selector(writeReceivedData:)] )
+		[_delegate performSelector: @selector(writeReceivedData:) withObject: data];
+	
+	NSString * str = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+	// DO NOT COMMENT OUT THIS LINE!!!!!!!!
+	// NO, REALLY--- STOP DOING IT!!!!!
+	NSLog( @"Response:\n%@", str );
+	[_internal->debugOutputStream close];
+}
+
 @end
 
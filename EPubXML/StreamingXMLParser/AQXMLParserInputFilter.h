@@ -0,0 +1,53 @@
+//
+//  AQXMLParserInputFilter.h
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-14.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+
+// An input filter rewrites raw document bytes in place before they reach libxml.
+// Filters see the input in arbitrary chunks, so any trailing bytes which might begin
+// a match must be held back: the parser prepends them to the next chunk.
+@protocol AQXMLParserInputFilter <NSObject>
+// returns the number of bytes at the end of the buffer to hold back until more input arrives
+// when isFinal is YES, no more input is coming and nothing can be held back
+- (NSUInteger) filterBytes: (uint8_t *) bytes length: (NSUInteger) length final: (BOOL) isFinal;
+@end
+
+// Replaces every occurrence of a byte pattern with a replacement of the same length.
+@interface AQXMLByteReplacementFilter : NSObject <AQXMLParserInputFilter>
+- (id) initWithPattern: (NSData *) pattern replacement: (NSData *) replacement;
+@property (nonatomic, readonly) NSData * pattern;
+@property (nonatomic, readonly) NSData * replacement;
+@end
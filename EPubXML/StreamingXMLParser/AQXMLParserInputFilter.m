@@ -0,0 +1,105 @@
+//
+//  AQXMLParserInputFilter.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-14.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQXMLParserInputFilter.h"
+
+@implementation AQXMLByteReplacementFilter
+{
+    const uint8_t * _patternBytes;
+    const uint8_t * _replacementBytes;
+    NSUInteger      _length;
+}
+
+- (id) initWithPattern: (NSData *) pattern replacement: (NSData *) replacement
+{
+    NSParameterAssert([pattern length] != 0 && [pattern length] == [replacement length]);
+    if ( [pattern length] == 0 || [pattern length] != [replacement length] )
+        return ( nil );
+    
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    _pattern = [pattern copy];
+    _replacement = [replacement copy];
+    _patternBytes = [_pattern bytes];
+    _replacementBytes = [_replacement bytes];
+    _length = [_pattern length];
+    
+    return ( self );
+}
+
+- (NSUInteger) filterBytes: (uint8_t *) bytes length: (NSUInteger) length final: (BOOL) isFinal
+{
+    uint8_t * p = bytes;
+    uint8_t * end = bytes + length;
+    uint8_t * replaced = bytes;     // end of the last replacement written
+    
+    // memchr() is vectorized by libc, so candidates are found a register at a time
+    while ( (NSUInteger)(end - p) >= _length )
+    {
+        p = memchr( p, _patternBytes[0], (end - p) - _length + 1 );
+        if ( p == NULL )
+            break;
+        
+        if ( memcmp(p, _patternBytes, _length) == 0 )
+        {
+            memcpy( p, _replacementBytes, _length );
+            p += _length;
+            replaced = p;
+        }
+        else
+        {
+            p++;
+        }
+    }
+    
+    if ( isFinal )
+        return ( 0 );
+    
+    // hold back the longest tail which could be the start of a match straddling the chunk boundary
+    // replacement output is never held, or it would be matched (and replaced) again next time
+    NSUInteger keep = MIN(_length - 1, (NSUInteger)(end - replaced));
+    for ( ; keep > 0; keep-- )
+    {
+        if ( memcmp(end - keep, _patternBytes, keep) == 0 )
+            break;
+    }
+    
+    return ( keep );
+}
+
+@end
@@ -16,6 +16,8 @@
 #import <libxml/encoding.h>
 #import <libxml/entities.h>
 
+#import "AQXMLParser.h"
+
 @class HTTPMessage;
 
 @interface _AQXMLParserInternal : NSObject
@@ -27,10 +29,18 @@
 	
     // internal stuff
     NSUInteger			parserFlags;
+    NSUInteger          delegateFlags;
+    BOOL                skipEntityCharacters;
 	NSError *			error;
 	NSMutableArray *	namespaces;
 	BOOL				delegateAborted;
     
+    // token delegate support
+    id __weak           tokenDelegate;
+    xmlDictPtr          nameDict;
+    AQXMLTokenAttribute * tokenAttributes;
+    NSUInteger          tokenAttributeCapacity;
+    
     // async parse callback data
     id                  asyncDelegate;
     SEL                 asyncSelector;
@@ -39,6 +49,26 @@
     // progress variables
     float               expectedDataLength;
     float               currentLength;
+    
+    // optional rewriting of raw input
+    id<AQXMLParserInputFilter> inputFilter;
+    NSMutableData *     filterBuffer;
+    
+    // synchronous pull-mode input
+    NSData *            inputData;
+    NSUInteger          inputOffset;
+    int                 fileDescriptor;
+    NSUInteger          chunkSize;
+    double              bytesPerSecond;
+    
+    // pull-mode state between -parseNextChunk calls
+    BOOL                pullStarted;
+    uint8_t *           pullBuffer;
+    NSUInteger          pullChunkSize;
+    unsigned long long  pullTotal;
+    CFAbsoluteTime      pullStartTime;
+    int                 pullErrno;
+    BOOL                pullFinished;
 	
 	NSOutputStream *	debugOutputStream;
 	
@@ -62,7 +62,7 @@
 
 - (AQXMLNode *) contentNode
 {
-    return ( (__bridge AQXMLNode *)self.xmlObj->children->_private );
+    return ( AQXMLWrapperForNode(self.xmlObj->children) );
 }
 
 - (AQXMLAttributeType) attributeType
@@ -0,0 +1,56 @@
+//
+//  AQXMLCanonicalEscaping.h
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-18.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+
+// Byte-level escaping for the canonicalizer. All input and output is UTF-8.
+
+__BEGIN_DECLS
+
+// Appends character content, replacing & < > CR and TAB with entity references.
+extern void AQXMLAppendCanonicalText(NSMutableData * output, const uint8_t * bytes, NSUInteger length);
+
+// Appends an attribute value, replacing & < " CR LF and TAB with entity references and
+// any other whitespace with a space. If collapseWhitespace is set (NMTOKENS attributes),
+// each run of whitespace becomes a single space.
+extern void AQXMLAppendCanonicalAttributeValue(NSMutableData * output, const uint8_t * bytes,
+                                               NSUInteger length, BOOL collapseWhitespace);
+
+// Returns the range left after trimming the characters in
+// +[NSCharacterSet whitespaceAndNewlineCharacterSet] from both ends.
+extern NSRange AQXMLTrimmedWhitespaceRange(const uint8_t * bytes, NSUInteger length);
+
+__END_DECLS
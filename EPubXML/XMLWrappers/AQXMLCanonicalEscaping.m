@@ -0,0 +1,286 @@
+//
+//  AQXMLCanonicalEscaping.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-18.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQXMLCanonicalEscaping.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+# include <arm_neon.h>
+#endif
+
+enum
+{
+    kPlain = 0,
+    kAmp,
+    kLessThan,
+    kGreaterThan,
+    kQuote,
+    kCarriageReturn,
+    kLineFeed,
+    kTab,
+    kSpace,             // whitespace which becomes (or collapses to) a space
+    kMultiByteSpace     // lead byte of a possible non-ASCII whitespace character
+};
+
+static const struct { const char * str; NSUInteger len; } __escapes[] = {
+    [kAmp]              = { "&amp;",  5 },
+    [kLessThan]         = { "&lt;",   4 },
+    [kGreaterThan]      = { "&gt;",   4 },
+    [kQuote]            = { "&quot;", 6 },
+    [kCarriageReturn]   = { "&#xD;",  5 },
+    [kLineFeed]         = { "&#xA;",  5 },
+    [kTab]              = { "&#x9;",  5 }
+};
+
+static const uint8_t __textClasses[256] = {
+    ['&'] = kAmp, ['<'] = kLessThan, ['>'] = kGreaterThan, ['\r'] = kCarriageReturn, ['\t'] = kTab
+};
+
+// the space character only needs attention when collapsing runs of whitespace
+static const uint8_t __attributeClasses[256] = {
+    ['&'] = kAmp, ['<'] = kLessThan, ['"'] = kQuote, ['\r'] = kCarriageReturn, ['\n'] = kLineFeed,
+    ['\t'] = kTab, ['\f'] = kSpace, [0xC2] = kMultiByteSpace, [0xE1] = kMultiByteSpace,
+    [0xE2] = kMultiByteSpace, [0xE3] = kMultiByteSpace
+};
+
+static const uint8_t __collapsingAttributeClasses[256] = {
+    ['&'] = kAmp, ['<'] = kLessThan, ['"'] = kQuote, ['\r'] = kCarriageReturn, ['\n'] = kLineFeed,
+    ['\t'] = kTab, ['\f'] = kSpace, [' '] = kSpace, [0xC2] = kMultiByteSpace, [0xE1] = kMultiByteSpace,
+    [0xE2] = kMultiByteSpace, [0xE3] = kMultiByteSpace
+};
+
+// Returns the number of leading bytes with no special meaning. The vector loop only has
+// to be conservative: anything it flags is checked against the table.
+static NSUInteger _ScanPlainBytes( const uint8_t * bytes, NSUInteger length, const uint8_t * classes, BOOL attribute )
+{
+    NSUInteger i = 0;
+    
+#if defined(__SSE2__)
+    const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<');
+    const __m128i gtOrQuote = _mm_set1_epi8(attribute ? '"' : '>');
+    const __m128i cr = _mm_set1_epi8('\r'), tab = _mm_set1_epi8('\t');
+    const __m128i controlOrHigh = _mm_set1_epi8(0x21);
+    
+    for ( ; i + 16 <= length; i += 16 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(v, gtOrQuote));
+        if ( attribute )
+        {
+            // signed compare: catches every control character and space, plus all non-ASCII bytes
+            hits = _mm_or_si128(hits, _mm_cmplt_epi8(v, controlOrHigh));
+        }
+        else
+        {
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, tab)));
+        }
+        
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+        while ( mask != 0 )
+        {
+            unsigned int bit = __builtin_ctz(mask);
+            if ( classes[bytes[i+bit]] != kPlain )
+                return ( i + bit );
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON__)
+    const uint8x16_t amp = vdupq_n_u8('&'), lt = vdupq_n_u8('<');
+    const uint8x16_t gtOrQuote = vdupq_n_u8(attribute ? '"' : '>');
+    const uint8x16_t cr = vdupq_n_u8('\r'), tab = vdupq_n_u8('\t');
+    const uint8x16_t firstPrintable = vdupq_n_u8(0x21), firstHigh = vdupq_n_u8(0x80);
+    
+    for ( ; i + 16 <= length; i += 16 )
+    {
+        uint8x16_t v = vld1q_u8(bytes + i);
+        uint8x16_t hits = vorrq_u8(vceqq_u8(v, amp), vceqq_u8(v, lt));
+        hits = vorrq_u8(hits, vceqq_u8(v, gtOrQuote));
+        if ( attribute )
+            hits = vorrq_u8(hits, vorrq_u8(vcltq_u8(v, firstPrintable), vcgeq_u8(v, firstHigh)));
+        else
+            hits = vorrq_u8(hits, vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, tab)));
+        
+        uint64x2_t wide = vreinterpretq_u64_u8(hits);
+        if ( (vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) == 0 )
+            continue;
+        
+        for ( NSUInteger j = 0; j < 16; j++ )
+        {
+            if ( classes[bytes[i+j]] != kPlain )
+                return ( i + j );
+        }
+    }
+#endif
+    
+    while ( i < length && classes[bytes[i]] == kPlain )
+        i++;
+    
+    return ( i );
+}
+
+// Non-ASCII whitespace as matched by the \s regular expression class, i.e. \p{Z}.
+// Returns the encoded length of the character at 'p', or zero if it isn't whitespace.
+static NSUInteger _UnicodeSpaceLength( const uint8_t * p, NSUInteger remaining, BOOL includeNEL )
+{
+    if ( remaining >= 2 && p[0] == 0xC2 )
+    {
+        if ( p[1] == 0xA0 || (includeNEL && p[1] == 0x85) )     // U+00A0, U+0085
+            return ( 2 );
+        return ( 0 );
+    }
+    
+    if ( remaining < 3 )
+        return ( 0 );
+    
+    switch ( p[0] )
+    {
+        case 0xE1:      // U+1680
+            return ( (p[1] == 0x9A && p[2] == 0x80) ? 3 : 0 );
+            
+        case 0xE2:      // U+2000-U+200A, U+2028, U+2029, U+202F, U+205F
+            if ( p[1] == 0x80 )
+                return ( (p[2] <= 0x8A || p[2] == 0xA8 || p[2] == 0xA9 || p[2] == 0xAF) ? 3 : 0 );
+            return ( (p[1] == 0x81 && p[2] == 0x9F) ? 3 : 0 );
+            
+        case 0xE3:      // U+3000
+            return ( (p[1] == 0x80 && p[2] == 0x80) ? 3 : 0 );
+            
+        default:
+            break;
+    }
+    
+    return ( 0 );
+}
+
+void AQXMLAppendCanonicalText( NSMutableData * output, const uint8_t * bytes, NSUInteger length )
+{
+    NSUInteger i = 0;
+    while ( i < length )
+    {
+        NSUInteger run = _ScanPlainBytes(bytes + i, length - i, __textClasses, NO);
+        if ( run != 0 )
+        {
+            [output appendBytes: bytes + i length: run];
+            i += run;
+            if ( i == length )
+                break;
+        }
+        
+        uint8_t cls = __textClasses[bytes[i++]];
+        [output appendBytes: __escapes[cls].str length: __escapes[cls].len];
+    }
+}
+
+void AQXMLAppendCanonicalAttributeValue( NSMutableData * output, const uint8_t * bytes,
+                                         NSUInteger length, BOOL collapseWhitespace )
+{
+    const uint8_t * classes = (collapseWhitespace ? __collapsingAttributeClasses : __attributeClasses);
+    BOOL inSpaceRun = NO;
+    NSUInteger i = 0;
+    
+    while ( i < length )
+    {
+        NSUInteger run = _ScanPlainBytes(bytes + i, length - i, classes, YES);
+        if ( run != 0 )
+        {
+            [output appendBytes: bytes + i length: run];
+            inSpaceRun = NO;
+            i += run;
+            if ( i == length )
+                break;
+        }
+        
+        uint8_t cls = classes[bytes[i]];
+        NSUInteger spaceLength = 0;
+        if ( cls == kSpace )
+            spaceLength = 1;
+        else if ( cls == kMultiByteSpace )
+            spaceLength = _UnicodeSpaceLength(bytes + i, length - i, NO);
+        
+        if ( spaceLength != 0 )
+        {
+            if ( inSpaceRun == NO )
+                [output appendBytes: " " length: 1];
+            inSpaceRun = collapseWhitespace;
+            i += spaceLength;
+        }
+        else if ( cls == kMultiByteSpace )
+        {
+            // just an ordinary non-ASCII character
+            [output appendBytes: bytes + i length: 1];
+            inSpaceRun = NO;
+            i++;
+        }
+        else
+        {
+            [output appendBytes: __escapes[cls].str length: __escapes[cls].len];
+            inSpaceRun = NO;
+            i++;
+        }
+    }
+}
+
+static NSUInteger _TrimmableLength( const uint8_t * p, NSUInteger remaining )
+{
+    if ( (*p >= '\t' && *p <= '\r') || *p == ' ' )
+        return ( 1 );
+    return ( _UnicodeSpaceLength(p, remaining, YES) );
+}
+
+NSRange AQXMLTrimmedWhitespaceRange( const uint8_t * bytes, NSUInteger length )
+{
+    NSUInteger start = 0, end = length;
+    
+    NSUInteger len;
+    while ( start < end && (len = _TrimmableLength(bytes + start, end - start)) != 0 )
+        start += len;
+    
+    while ( end > start )
+    {
+        // step back to the start of the last character
+        NSUInteger charStart = end - 1;
+        while ( charStart > start && end - charStart < 3 && (bytes[charStart] & 0xC0) == 0x80 )
+            charStart--;
+        
+        if ( _TrimmableLength(bytes + charStart, end - charStart) != end - charStart )
+            break;
+        end = charStart;
+    }
+    
+    return ( NSMakeRange(start, end - start) );
+}
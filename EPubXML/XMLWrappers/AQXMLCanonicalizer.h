@@ -49,7 +49,10 @@ typedef NS_OPTIONS(uint8_t, AQXMLCanonicalizationMethod) {
 
 @interface AQXMLCanonicalizer : NSObject
 
-// NB: node visibility isn't yet implemented for the streaming (v2.0) canonicalizer
+// NB: a visibility filter needs a document, so the streaming (v2.0) canonicalizer ignores
+// it. Use an element selection (below) to canonicalize part of a document while streaming.
+// For v1.x an element is canonicalized from a standalone copy of its subtree, but a filter
+// given with one is still handed the element's own nodes.
 
 + (NSData *) canonicalizeDocument: (AQXMLDocument *) document
                       usingMethod: (AQXMLCanonicalizationMethod) method
@@ -64,12 +67,64 @@ typedef NS_OPTIONS(uint8_t, AQXMLCanonicalizationMethod) {
                   usingMethod: (AQXMLCanonicalizationMethod) method
              visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible;
 
+// As above, but the canonical form is passed to the handler piece by piece as it is
+// generated, e.g. straight into a digest, rather than being gathered into memory.
+// If the handler fails, its error is the one returned.
++ (BOOL) canonicalizeDocument: (AQXMLDocument *) document
+                  usingMethod: (AQXMLCanonicalizationMethod) method
+             visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+                outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                        error: (NSError **) error;
++ (BOOL) canonicalizeElement: (AQXMLElement *) element
+                 usingMethod: (AQXMLCanonicalizationMethod) method
+            visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+               outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                       error: (NSError **) error;
++ (BOOL) canonicalizeData: (NSData *) data
+              usingMethod: (AQXMLCanonicalizationMethod) method
+         visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+            outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                    error: (NSError **) error;
+
+// Only the subtrees of the selected elements are output. For v2.0 the selection is matched
+// on parser events, so no document is built. An ID matches an xml:id, Id, ID or id attribute;
+// if no element has it, these return NO with an error. A pattern that matches nothing isn't
+// an error, and produces no output.
+// A pattern is a path such as "/a/b" or "//ds:Signature" in the streamable subset of XPath
+// that libxml's xmlPattern accepts; the dictionary maps its prefixes to namespace URIs.
++ (BOOL) canonicalizeData: (NSData *) data
+              usingMethod: (AQXMLCanonicalizationMethod) method
+   selectingElementWithID: (NSString *) elementID
+            outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                    error: (NSError **) error;
++ (BOOL) canonicalizeData: (NSData *) data
+              usingMethod: (AQXMLCanonicalizationMethod) method
+         selectingPattern: (NSString *) pattern
+               namespaces: (NSDictionary *) namespaces
+            outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                    error: (NSError **) error;
+
+// Only the nodes in the set are visible. Membership is checked against an index built
+// once per set rather than by scanning the set for every node in the document.
++ (NSData *) canonicalizeNodeSet: (AQXMLNodeSet *) nodeSet
+                     usingMethod: (AQXMLCanonicalizationMethod) method;
++ (BOOL) canonicalizeNodeSet: (AQXMLNodeSet *) nodeSet
+                 usingMethod: (AQXMLCanonicalizationMethod) method
+               outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                       error: (NSError **) error;
+
+// C14N 1.x only: the root element's children are canonicalized concurrently, in copies,
+// and joined in document order. The output is identical to +canonicalizeDocument:...
++ (NSData *) canonicalizeDocumentConcurrently: (AQXMLDocument *) document
+                                  usingMethod: (AQXMLCanonicalizationMethod) method;
+
 // streaming mode initializer
 - (id) initWithData: (NSData *) data;
 - (id) initWithStream: (NSInputStream *) stream;    // designated initializer
 
 // DOM mode initializer
 - (id) initWithDocument: (AQXMLDocument *) document; // designated initializer too
+- (id) initWithElement: (AQXMLElement *) element;    // only the element's subtree
 
 @property (nonatomic) BOOL preserveWhitespace;
 @property (nonatomic) BOOL preserveComments;
@@ -77,11 +132,29 @@ typedef NS_OPTIONS(uint8_t, AQXMLCanonicalizationMethod) {
 @property (nonatomic, strong) NSString * fragment;
 @property (nonatomic, copy) BOOL (^isNodeVisible)(AQXMLNode * node);
 
+// streaming mode only: restricts output to the subtrees of matching elements
+@property (nonatomic, copy) NSString * selectedElementID;
+- (BOOL) setSelectionPattern: (NSString *) pattern namespaces: (NSDictionary *) namespaces error: (NSError **) error;
+
 - (void) addQNameAwareAttribute: (NSString *) name namespaceURI: (NSString *) namespaceURI;
 - (void) addQNameAwareElement: (NSString *) name namespaceURI: (NSString *) namespaceURI;
 - (void) addQNameAwareXPathElement: (NSString *) name namespaceURI: (NSString *) namespaceURI;
 
 - (void) canonicalizeToStream: (NSOutputStream *) stream completionHandler: (void (^)(NSError * error)) handler;
+// Parsing runs on the queue a chunk at a time, and output is written as the stream has space.
+// Parsing pauses while too much output is waiting, without holding a thread, so many of
+// these can run at once. The handler is called on the queue.
+- (void) canonicalizeToStream: (NSOutputStream *) stream
+                   parseQueue: (dispatch_queue_t) queue
+            completionHandler: (void (^)(NSError * error)) handler;
 - (BOOL) canonicalizeToStream: (NSOutputStream *) stream error: (NSError **) error;
 
+// These bypass NSStream entirely. Output is coalesced into large chunks before reaching
+// the data, file descriptor (which is not closed) or handler. A handler returns NO,
+// setting *error, to stop canonicalization.
+- (BOOL) canonicalizeToData: (NSMutableData *) data error: (NSError **) error;
+- (BOOL) canonicalizeToFileDescriptor: (int) fd error: (NSError **) error;
+- (BOOL) canonicalizeWithOutputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                                 error: (NSError **) error;
+
 @end
@@ -36,28 +36,183 @@
 
 #import "AQXMLCanonicalizer.h"
 #import "AQXML_Private.h"
+#import "AQXMLUtilities.h"
+#import "AQXMLCanonicalEscaping.h"
 #import "AQXMLParser.h"
 #import <libxml/c14n.h>
+#import <libxml/pattern.h>
 #import <libxml/xpathInternals.h>
+#import <unistd.h>
+#import <errno.h>
 
-@class _StackContext;
+@class _NamespaceScope;
 
 static NSString * const AQXMLCanonicalizerOutputRunLoopMode = @"AQXMLCanonicalizerOutputRunLoopMode";
 
+// output is coalesced into writes of around this size
+#define kAQXMLCanonicalizerOutputBufferSize     (64 * 1024)
+
 @interface AQXMLCanonicalizer () <AQXMLParserDelegate, NSStreamDelegate>
-- (_StackContext *) newStackContext;
 @end
 
-@interface _StackContext : NSObject
-@property (nonatomic, strong) NSMutableDictionary * namespaceContext; // prefix -> uri
-@property (nonatomic, strong) NSMutableSet * outputPrefixes;
-@property (nonatomic, strong) NSString * elementQName;
+// The namespace bindings in scope for the 2.0 canonicalizer. Every binding lives in one
+// table; a change made within an element is logged and then undone when that element
+// ends, so starting an element costs nothing unless it declares or outputs a namespace.
+@interface _NamespaceScope : NSObject
+- (void) pushElement: (NSString *) qName;
+- (void) popElement;
+@property (nonatomic, readonly) NSUInteger depth;
+@property (nonatomic, strong) NSString * elementQName;          // of the current element
 @property (nonatomic, readonly) NSString * elementLocalName;
 @property (nonatomic, readonly) NSString * elementPrefix;
-@property (nonatomic) BOOL preserveSpace;
+- (NSString *) URIForPrefix: (NSString *) prefix;
+- (void) bindPrefix: (NSString *) prefix toURI: (NSString *) uri; // not yet output
+- (BOOL) isPrefixOutput: (NSString *) prefix;
+- (void) setPrefixOutput: (NSString *) prefix;
 @end
 
-@implementation _StackContext
+@implementation _NamespaceScope
+{
+    NSMutableDictionary *   _bindings;          // prefix -> uri
+    NSMutableSet *          _outputPrefixes;
+    
+    // undo log, one entry per change
+    NSMutableArray *        _undoPrefixes;
+    NSMutableArray *        _undoURIs;          // NSNull where there was no binding
+    NSMutableIndexSet *     _undoWasOutput;
+    
+    // one per open element
+    NSMutableArray *        _qNames;
+    NSUInteger *            _marks;             // undo log length at element start
+    NSUInteger              _marksCapacity;
+}
+
+- (id) init
+{
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    _bindings = [NSMutableDictionary new];
+    _outputPrefixes = [NSMutableSet new];
+    _undoPrefixes = [NSMutableArray new];
+    _undoURIs = [NSMutableArray new];
+    _undoWasOutput = [NSMutableIndexSet new];
+    _qNames = [NSMutableArray new];
+    
+    return ( self );
+}
+
+- (void) dealloc
+{
+    free(_marks);
+}
+
+- (NSUInteger) depth
+{
+    return ( [_qNames count] );
+}
+
+- (void) pushElement: (NSString *) qName
+{
+    NSUInteger depth = [_qNames count];
+    if ( depth == _marksCapacity )
+    {
+        _marksCapacity = (_marksCapacity == 0 ? 32 : _marksCapacity * 2);
+        _marks = reallocf(_marks, _marksCapacity * sizeof(NSUInteger));
+    }
+    
+    _marks[depth] = [_undoPrefixes count];
+    [_qNames addObject: (qName != nil ? qName : (id)[NSNull null])];
+}
+
+- (void) popElement
+{
+    NSUInteger depth = [_qNames count];
+    if ( depth == 0 )
+        return;
+    
+    // unwind everything this element changed, most recent first
+    NSUInteger mark = _marks[depth-1];
+    for ( NSUInteger i = [_undoPrefixes count]; i > mark; i-- )
+    {
+        NSString * prefix = _undoPrefixes[i-1];
+        id uri = _undoURIs[i-1];
+        
+        if ( uri == [NSNull null] )
+            [_bindings removeObjectForKey: prefix];
+        else
+            _bindings[prefix] = uri;
+        
+        if ( [_undoWasOutput containsIndex: i-1] )
+            [_outputPrefixes addObject: prefix];
+        else
+            [_outputPrefixes removeObject: prefix];
+    }
+    
+    NSRange r = NSMakeRange(mark, [_undoPrefixes count] - mark);
+    [_undoPrefixes removeObjectsInRange: r];
+    [_undoURIs removeObjectsInRange: r];
+    [_undoWasOutput removeIndexesInRange: r];
+    
+    [_qNames removeLastObject];
+}
+
+- (void) recordPrefix: (NSString *) prefix
+{
+    // nothing outside an element is ever unwound
+    if ( [_qNames count] == 0 )
+        return;
+    
+    id uri = _bindings[prefix];
+    if ( [_outputPrefixes containsObject: prefix] )
+        [_undoWasOutput addIndex: [_undoPrefixes count]];
+    
+    [_undoPrefixes addObject: prefix];
+    [_undoURIs addObject: (uri != nil ? uri : [NSNull null])];
+}
+
+- (NSString *) URIForPrefix: (NSString *) prefix
+{
+    if ( prefix == nil )
+        return ( nil );
+    return ( _bindings[prefix] );
+}
+
+- (void) bindPrefix: (NSString *) prefix toURI: (NSString *) uri
+{
+    [self recordPrefix: prefix];
+    _bindings[prefix] = uri;
+    [_outputPrefixes removeObject: prefix];
+}
+
+- (BOOL) isPrefixOutput: (NSString *) prefix
+{
+    return ( [_outputPrefixes containsObject: prefix] );
+}
+
+- (void) setPrefixOutput: (NSString *) prefix
+{
+    if ( [_outputPrefixes containsObject: prefix] )
+        return;
+    
+    [self recordPrefix: prefix];
+    [_outputPrefixes addObject: prefix];
+}
+
+- (NSString *) elementQName
+{
+    id q = [_qNames lastObject];
+    return ( q == [NSNull null] ? nil : q );
+}
+
+- (void) setElementQName: (NSString *) elementQName
+{
+    if ( [_qNames count] == 0 )
+        return;
+    
+    _qNames[[_qNames count]-1] = (elementQName != nil ? elementQName : (id)[NSNull null]);
+}
 
 - (NSString *) elementLocalName
 {
@@ -86,12 +241,298 @@ static NSString * const AQXMLCanonicalizerOutputRunLoopMode = @"AQXMLCanonicaliz
 
 @end
 
+// Carries output from the parsing queue to a stream, which is written on its own serial
+// queue as it signals space. Parsing pauses (its next step simply isn't scheduled) while
+// more than the high-water mark is waiting, and resumes once the stream has drained it
+// below the low-water mark, so neither side ever blocks a thread waiting for the other.
+#define kAQXMLPipelineHighWaterMark     (4 * kAQXMLCanonicalizerOutputBufferSize)
+#define kAQXMLPipelineLowWaterMark      (kAQXMLCanonicalizerOutputBufferSize)
+
+@interface _OutputPipeline : NSObject
+- (id) initWithStream: (NSOutputStream *) stream
+           parseQueue: (dispatch_queue_t) parseQueue
+    completionHandler: (void (^)(NSError * error)) handler;
+// step returns NO once there's nothing left to parse; finish is then called, also on the
+// parse queue, and returns any error
+- (void) startWithStep: (BOOL (^)(void)) step finish: (NSError * (^)(void)) finish;
+- (BOOL) enqueueBytes: (const void *) bytes length: (NSUInteger) length error: (NSError **) error;
+@end
+
+@interface _OutputPipeline ()
+- (void) drain;
+- (void) failWithError: (NSError *) error;
+@end
+
+static void __pipeline_stream_callback(CFWriteStreamRef stream, CFStreamEventType type, void * info)
+{
+    _OutputPipeline * pipeline = (__bridge _OutputPipeline *)info;
+    if ( type == kCFStreamEventErrorOccurred )
+        [pipeline failWithError: CFBridgingRelease(CFWriteStreamCopyError(stream))];
+    else
+        [pipeline drain];
+}
+
+static void * __pipeline_retain(void * info)
+{
+    return ( (void *)CFRetain(info) );
+}
+
+static void __pipeline_release(void * info)
+{
+    CFRelease(info);
+}
+
+@implementation _OutputPipeline
+{
+    NSOutputStream *        _stream;
+    dispatch_queue_t        _parseQueue;
+    dispatch_queue_t        _drainQueue;
+    void                    (^_completionHandler)(NSError *);
+    BOOL                    (^_step)(void);
+    NSError *               (^_finish)(void);
+    
+    // only touched on the drain queue
+    NSMutableArray *        _chunks;
+    NSUInteger              _chunkOffset;
+    NSUInteger              _bufferedBytes;
+    BOOL                    _scheduled;         // stream events arrive on the drain queue
+    BOOL                    _paused;
+    BOOL                    _producerFinished;
+    BOOL                    _completed;
+    NSError *               _error;
+}
+
+- (id) initWithStream: (NSOutputStream *) stream
+           parseQueue: (dispatch_queue_t) parseQueue
+    completionHandler: (void (^)(NSError * error)) handler
+{
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    _stream = stream;
+    _parseQueue = parseQueue;
+    _drainQueue = dispatch_queue_create("com.kobo.AQXMLCanonicalizer.output", DISPATCH_QUEUE_SERIAL);
+    _completionHandler = [handler copy];
+    _chunks = [NSMutableArray new];
+    
+    return ( self );
+}
+
+- (void) startWithStep: (BOOL (^)(void)) step finish: (NSError * (^)(void)) finish
+{
+    _step = [step copy];
+    _finish = [finish copy];
+    
+    dispatch_async(_drainQueue, ^{
+        // without a queue to deliver stream events, writes simply block the drain queue
+        if ( &CFWriteStreamSetDispatchQueue != NULL )
+        {
+            // the stream keeps us alive while parsing is paused
+            CFStreamClientContext ctx = { 0, (__bridge void *)self, &__pipeline_retain, &__pipeline_release, NULL };
+            CFOptionFlags events = kCFStreamEventOpenCompleted|kCFStreamEventCanAcceptBytes|kCFStreamEventErrorOccurred;
+            CFWriteStreamRef stream = (__bridge CFWriteStreamRef)_stream;
+            if ( CFWriteStreamSetClient(stream, events, &__pipeline_stream_callback, &ctx) )
+            {
+                CFWriteStreamSetDispatchQueue(stream, _drainQueue);
+                _scheduled = YES;
+            }
+        }
+        
+        if ( [_stream streamStatus] == NSStreamStatusNotOpen )
+            [_stream open];
+    });
+    
+    dispatch_async(_parseQueue, ^{ [self runStep]; });
+}
+
+- (void) runStep
+{
+    if ( _step() == NO )
+    {
+        [self finishProducing];
+        return;
+    }
+    
+    // decide on the drain queue, after the output of this step has been queued
+    dispatch_async(_drainQueue, ^{
+        if ( _error != nil )
+            dispatch_async(_parseQueue, ^{ [self finishProducing]; });
+        else if ( _bufferedBytes > kAQXMLPipelineHighWaterMark )
+            _paused = YES;
+        else
+            dispatch_async(_parseQueue, ^{ [self runStep]; });
+    });
+}
+
+- (void) finishProducing
+{
+    NSError * error = _finish();
+    
+    // these reference the canonicalizer, which references us
+    _step = nil;
+    _finish = nil;
+    
+    dispatch_async(_drainQueue, ^{
+        if ( _error == nil )
+            _error = error;
+        _producerFinished = YES;
+        [self drain];
+    });
+}
+
+- (BOOL) enqueueBytes: (const void *) bytes length: (NSUInteger) length error: (NSError **) error
+{
+    NSData * chunk = [[NSData alloc] initWithBytes: bytes length: length];
+    dispatch_async(_drainQueue, ^{
+        if ( _error != nil )
+            return;
+        
+        [_chunks addObject: chunk];
+        _bufferedBytes += length;
+        [self drain];
+    });
+    
+    return ( YES );
+}
+
+- (void) drain
+{
+    CFWriteStreamRef stream = (__bridge CFWriteStreamRef)_stream;
+    while ( _error == nil && [_chunks count] != 0 )
+    {
+        // we'll be called again once there's space
+        if ( _scheduled && CFWriteStreamCanAcceptBytes(stream) == false )
+            break;
+        
+        NSData * chunk = _chunks[0];
+        NSInteger written = [_stream write: (const uint8_t *)[chunk bytes] + _chunkOffset
+                                 maxLength: [chunk length] - _chunkOffset];
+        if ( written < 0 )
+        {
+            [self failWithError: [_stream streamError]];
+            return;
+        }
+        
+        _chunkOffset += written;
+        _bufferedBytes -= written;
+        if ( _chunkOffset == [chunk length] )
+        {
+            [_chunks removeObjectAtIndex: 0];
+            _chunkOffset = 0;
+        }
+    }
+    
+    if ( _paused && _error == nil && _bufferedBytes <= kAQXMLPipelineLowWaterMark )
+    {
+        _paused = NO;
+        dispatch_async(_parseQueue, ^{ [self runStep]; });
+    }
+    
+    [self completeIfFinished];
+}
+
+- (void) failWithError: (NSError *) error
+{
+    if ( _error == nil )
+        _error = (error != nil ? error : [NSError xmlGenericErrorWithDescription: @"Unable to write canonical output"]);
+    
+    [_chunks removeAllObjects];
+    _chunkOffset = 0;
+    _bufferedBytes = 0;
+    
+    // a paused parse must still be wound up
+    if ( _paused )
+    {
+        _paused = NO;
+        dispatch_async(_parseQueue, ^{ [self finishProducing]; });
+    }
+    
+    [self completeIfFinished];
+}
+
+- (void) completeIfFinished
+{
+    if ( _completed || _producerFinished == NO )
+        return;
+    if ( _error == nil && [_chunks count] != 0 )
+        return;
+    
+    _completed = YES;
+    if ( _scheduled )
+    {
+        CFWriteStreamRef stream = (__bridge CFWriteStreamRef)_stream;
+        CFWriteStreamSetDispatchQueue(stream, NULL);
+        CFWriteStreamSetClient(stream, kCFStreamEventNone, NULL, NULL);
+        _scheduled = NO;
+    }
+    
+    void (^handler)(NSError *) = _completionHandler;
+    NSError * error = _error;
+    _completionHandler = nil;
+    if ( handler != nil )
+        dispatch_async(_parseQueue, ^{ handler(error); });
+}
+
+@end
+
+static inline BOOL __is_name_start(UniChar c)
+{
+    return ( (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' || c >= 0xC0 );
+}
+
+static inline BOOL __is_name_char(UniChar c)
+{
+    return ( __is_name_start(c) || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == 0xB7 );
+}
+
+// Calls the block with the range of each namespace prefix used in an XPath expression,
+// in a single pass. String literals are skipped, as are axis names ('child::').
+static void __enumerate_xpath_prefixes(NSString * expr, void (^block)(NSRange prefixRange))
+{
+    CFStringRef str = (__bridge CFStringRef)expr;
+    CFIndex len = CFStringGetLength(str);
+    CFStringInlineBuffer buf;
+    CFStringInitInlineBuffer(str, &buf, CFRangeMake(0, len));
+    
+    CFIndex i = 0;
+    while ( i < len )
+    {
+        UniChar c = CFStringGetCharacterFromInlineBuffer(&buf, i);
+        if ( c == '"' || c == '\'' )
+        {
+            // an unterminated literal runs to the end
+            CFIndex end = i + 1;
+            while ( end < len && CFStringGetCharacterFromInlineBuffer(&buf, end) != c )
+                end++;
+            i = end + 1;
+        }
+        else if ( __is_name_start(c) )
+        {
+            CFIndex start = i++;
+            while ( i < len && __is_name_char(CFStringGetCharacterFromInlineBuffer(&buf, i)) )
+                i++;
+            
+            if ( i + 1 < len && CFStringGetCharacterFromInlineBuffer(&buf, i) == ':' &&
+                 __is_name_start(CFStringGetCharacterFromInlineBuffer(&buf, i + 1)) )
+            {
+                block(NSMakeRange(start, i - start));
+            }
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
 @implementation AQXMLCanonicalizer
 {
     AQXMLParser *           _parser;
     AQXMLDocument *         _document;
+    AQXMLElement *          _subtreeRoot;
     
-    NSMutableArray *        _stack;
+    _NamespaceScope *       _scope;
     NSMutableDictionary *   _qnameAwareAttrs; // name -> uri
     NSMutableDictionary *   _qnameAwareElements;
     NSMutableDictionary *   _qnameAwareXPathElements;
@@ -103,9 +544,20 @@ static NSString * const AQXMLCanonicalizerOutputRunLoopMode = @"AQXMLCanonicaliz
     NSMutableDictionary *   _attrDecls;
     BOOL                    _documentRootEncountered;
     
-    NSInvocation *          _qualifiedContentStartElementInvocation;
+    // start tag of a QName-aware element, held back until its content has been seen
+    NSString *              _pendingElementName;
+    NSString *              _pendingNamespaceURI;
+    NSDictionary *          _pendingAttributes;
+    
+    // streaming selection: nothing is output outside the subtrees of selected elements
+    xmlPatternPtr           _selectionPattern;
+    xmlStreamCtxtPtr        _selectionStream;
+    NSUInteger              _selectedDepth;     // scope depth of the selected element, or 0
+    BOOL                    _selectionFound;
     
     NSOutputStream *        _output;
+    NSMutableData *         _outputBuffer;
+    BOOL                    (^_outputHandler)(const void *, NSUInteger, NSError **);
     NSError *               _error;
 }
 
@@ -133,98 +585,655 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
     if ( block == nil )
         return ( 1 );       // assume it's included
     
-    AQXMLNode * obj = (__bridge AQXMLNode *)node->_private;
-    return ( block(obj) ? 1 : 0 );
+    AQXMLNode * obj = AQXMLWrapperForNode(node);
+    return ( block(obj) ? 1 : 0 );
+}
+
+typedef struct {
+    void *      handler;
+    CFTypeRef   error;      // retained: the first error the handler reported
+} __output_context;
+
+static int __output_write_callback(void *context, const char *buffer, int len)
+{
+    __output_context * output = context;
+    BOOL (^handler)(const void *, NSUInteger, NSError **) = (__bridge BOOL (^)(const void *, NSUInteger, NSError **))output->handler;
+    
+    NSError * error = nil;
+    if ( handler(buffer, (NSUInteger)len, &error) )
+        return ( len );
+    
+    if ( output->error == NULL && error != nil )
+        output->error = CFBridgingRetain(error);
+    return ( -1 );
+}
+
+static BOOL __libxml_canonicalize_with_callback(xmlDocPtr doc, AQXMLCanonicalizationMethod method,
+                                                xmlC14NIsVisibleCallback isVisible, void * userData,
+                                                BOOL (^handler)(const void *, NSUInteger, NSError **),
+                                                NSError ** error)
+{
+    if ( doc == NULL )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"No document to canonicalize"];
+        return ( NO );
+    }
+    
+    // libxml hands us its output in chunks as it fills its own buffer
+    __output_context context = { (__bridge void *)handler, NULL };
+    xmlOutputBufferPtr output = xmlOutputBufferCreateIO(&__output_write_callback, NULL, &context, NULL);
+    if ( output == NULL )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"Unable to allocate XML output buffer"];
+        return ( NO );
+    }
+    
+    int mode = (method & ~AQXMLCanonicalizationMethod_with_comments);
+    int ok = xmlC14NExecute(doc, isVisible, userData, mode, NULL, (method & AQXMLCanonicalizationMethod_with_comments), output);
+    
+    if ( xmlOutputBufferClose(output) < 0 )
+        ok = -1;
+    
+    // a handler's own error explains the failure better than anything libxml has
+    NSError * handlerError = CFBridgingRelease(context.error);
+    if ( ok < 0 && error != NULL )
+        *error = (handlerError != nil ? handlerError : [NSError xmlGenericErrorWithDescription: @"Canonicalization failed"]);
+    
+    return ( ok >= 0 );
+}
+
+static BOOL __libxml_canonicalize(xmlDocPtr doc, AQXMLCanonicalizationMethod method,
+                                  BOOL (^isNodeVisible)(AQXMLNode *),
+                                  BOOL (^handler)(const void *, NSUInteger, NSError **),
+                                  NSError ** error)
+{
+    return ( __libxml_canonicalize_with_callback(doc, method, &__node_visible_callback, (__bridge void *)isNodeVisible, handler, error) );
+}
+
+// Marks the bare copies of an element's ancestors made by __subtree_document(): they
+// supply inherited namespaces and xml:* attributes, but are never output themselves.
+static char __ancestor_marker;
+
+static int __subtree_copy_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr parent)
+{
+    // namespace and attribute nodes belong to their parent element
+    xmlNodePtr owner = (node->type == XML_ELEMENT_NODE ? node : parent);
+    return ( owner == NULL || owner->psvi != &__ancestor_marker ? 1 : 0 );
+}
+
+// returns the copy of node's parent, having copied everything above it first
+static xmlNodePtr __copy_ancestors(xmlNodePtr node, xmlDocPtr doc)
+{
+    xmlNodePtr parent = node->parent;
+    if ( parent == NULL || parent->type != XML_ELEMENT_NODE )
+        return ( (xmlNodePtr)doc );
+    
+    xmlNodePtr above = __copy_ancestors(parent, doc);
+    if ( above == NULL )
+        return ( NULL );
+    
+    // attributes and namespace declarations only
+    xmlNodePtr copy = xmlDocCopyNode(parent, doc, 2);
+    if ( copy == NULL )
+        return ( NULL );
+    
+    copy->psvi = &__ancestor_marker;
+    return ( xmlAddChild(above, copy) );
+}
+
+// records in each copied node (attributes included) the node it was copied from
+static void __link_copies(xmlNodePtr copy, xmlNodePtr original)
+{
+    for ( ; copy != NULL && original != NULL; copy = copy->next, original = original->next )
+    {
+        copy->psvi = original;
+        if ( copy->type != XML_ELEMENT_NODE )
+            continue;
+        
+        xmlAttrPtr originalAttr = original->properties;
+        for ( xmlAttrPtr attr = copy->properties; attr != NULL && originalAttr != NULL; attr = attr->next, originalAttr = originalAttr->next )
+            attr->psvi = originalAttr;
+        
+        __link_copies(copy->children, original->children);
+    }
+}
+
+// A standalone document containing a copy of the element's subtree under bare copies of
+// its ancestors, so canonicalizing it never visits anything outside the element. Each
+// node of the subtree's copy has its original in psvi.
+static xmlDocPtr __subtree_document(xmlNodePtr element)
+{
+    xmlDocPtr doc = xmlNewDoc(element->doc != NULL ? element->doc->version : NULL);
+    if ( doc == NULL )
+        return ( NULL );
+    
+    xmlNodePtr parent = __copy_ancestors(element, doc);
+    xmlNodePtr copy = (parent == NULL ? NULL : xmlDocCopyNode(element, doc, 1));
+    if ( copy == NULL || xmlAddChild(parent, copy) == NULL )
+    {
+        xmlFreeDoc(doc);
+        return ( NULL );
+    }
+    
+    doc->psvi = element->doc;
+    __link_copies(copy, element);
+    return ( doc );
+}
+
+// maps a node of the subtree's copy back to the original; parent is its element
+static xmlNodePtr __original_of_copy(xmlNodePtr node, xmlNodePtr parent)
+{
+    void * original = NULL;
+    switch ( node->type )
+    {
+        case XML_ELEMENT_NODE:
+        case XML_TEXT_NODE:
+        case XML_CDATA_SECTION_NODE:
+        case XML_ENTITY_REF_NODE:
+        case XML_PI_NODE:
+        case XML_COMMENT_NODE:
+            original = node->psvi;
+            break;
+            
+        // these keep their psvi somewhere else
+        case XML_ATTRIBUTE_NODE:
+            original = ((xmlAttrPtr)node)->psvi;
+            break;
+            
+        case XML_DOCUMENT_NODE:
+            original = ((xmlDocPtr)node)->psvi;
+            break;
+            
+        case XML_NAMESPACE_DECL:
+        {
+            // namespaces have no psvi, and the copy may have declared its own where the
+            // original inherited them, so look for the declaration in scope in the original
+            xmlNsPtr ns = (xmlNsPtr)node;
+            xmlNodePtr originalElement = (parent != NULL ? (xmlNodePtr)parent->psvi : NULL);
+            if ( originalElement == NULL || xmlStrEqual(ns->prefix, BAD_CAST "xml") )
+                break;
+            
+            xmlNsPtr originalNs = xmlSearchNs(originalElement->doc, originalElement, ns->prefix);
+            if ( originalNs != NULL && xmlStrEqual(originalNs->href, ns->href) )
+                original = originalNs;
+            break;
+        }
+            
+        default:
+            break;
+    }
+    
+    return ( original != NULL ? (xmlNodePtr)original : node );
+}
+
+// as above, then put to the caller's filter, which is shown the original nodes
+static int __subtree_copy_filter_callback(void *user_data, xmlNodePtr node, xmlNodePtr parent)
+{
+    if ( __subtree_copy_visible_callback(NULL, node, parent) == 0 )
+        return ( 0 );
+    return ( __node_visible_callback(user_data, __original_of_copy(node, parent), parent) );
+}
+
+// Element selection, for canonicalizing part of a document without a visibility filter
+static const char * const __id_attribute_names[] = { "Id", "ID", "id" };
+
+static BOOL __element_has_id(xmlNodePtr element, const xmlChar * elementID)
+{
+    BOOL result = NO;
+    xmlChar * value = xmlGetNsProp(element, BAD_CAST "id", XML_XML_NAMESPACE);
+    for ( int i = 0; ; i++ )
+    {
+        if ( value != NULL )
+            result = xmlStrEqual(value, elementID);
+        xmlFree(value);
+        
+        if ( result || i == 3 )
+            break;
+        value = xmlGetNoNsProp(element, BAD_CAST __id_attribute_names[i]);
+    }
+    
+    return ( result );
+}
+
+static NSError * __missing_element_error(NSString * elementID)
+{
+    return ( [NSError xmlGenericErrorWithDescription: [NSString stringWithFormat: @"No element has the ID '%@'", elementID]] );
+}
+
+static xmlNodePtr __find_element_with_id(xmlNodePtr node, const xmlChar * elementID)
+{
+    for ( ; node != NULL; node = node->next )
+    {
+        if ( node->type != XML_ELEMENT_NODE )
+            continue;
+        if ( __element_has_id(node, elementID) )
+            return ( node );
+        
+        xmlNodePtr found = __find_element_with_id(node->children, elementID);
+        if ( found != NULL )
+            return ( found );
+    }
+    
+    return ( NULL );
+}
+
+static xmlPatternPtr __compile_selection_pattern(NSString * pattern, NSDictionary * namespaces, NSError ** error)
+{
+    // libxml wants { uri, prefix, ..., NULL, NULL }
+    const xmlChar ** pairs = calloc([namespaces count] * 2 + 2, sizeof(const xmlChar *));
+    __block NSUInteger i = 0;
+    [namespaces enumerateKeysAndObjectsUsingBlock: ^(NSString * prefix, NSString * uri, BOOL *stop) {
+        pairs[i++] = BAD_CAST [uri UTF8String];
+        pairs[i++] = BAD_CAST [prefix UTF8String];
+    }];
+    
+    xmlPatternPtr comp = xmlPatterncompile(BAD_CAST [pattern UTF8String], NULL, 0, pairs);
+    free(pairs);
+    
+    // it must be possible to match it on parser events
+    if ( comp != NULL && xmlPatternStreamable(comp) != 1 )
+    {
+        xmlFreePattern(comp);
+        comp = NULL;
+    }
+    
+    if ( comp == NULL && error != NULL )
+        *error = [NSError xmlGenericErrorWithDescription: [NSString stringWithFormat: @"Cannot select elements using the pattern '%@'", pattern]];
+    
+    return ( comp );
+}
+
+// Elements the pattern selects, and everything within them, are marked through psvi in one
+// pass over the tree, running the pattern's streaming form as the walk goes down and up
+static char __selected_marker;
+
+static void __mark_subtree_selected(xmlNodePtr element)
+{
+    element->psvi = &__selected_marker;
+    for ( xmlNodePtr child = element->children; child != NULL; child = child->next )
+    {
+        if ( child->type == XML_ELEMENT_NODE )
+            __mark_subtree_selected(child);
+    }
+}
+
+static BOOL __mark_pattern_selection(xmlStreamCtxtPtr stream, xmlNodePtr node)
+{
+    for ( ; node != NULL; node = node->next )
+    {
+        if ( node->type != XML_ELEMENT_NODE )
+            continue;
+        
+        int match = xmlStreamPush(stream, node->name, (node->ns != NULL ? node->ns->href : NULL));
+        if ( match < 0 )
+            return ( NO );
+        
+        // nothing below a selected element needs matching
+        BOOL ok = YES;
+        if ( match == 1 )
+            __mark_subtree_selected(node);
+        else
+            ok = __mark_pattern_selection(stream, node->children);
+        
+        xmlStreamPop(stream);
+        if ( ok == NO )
+            return ( NO );
+    }
+    
+    return ( YES );
+}
+
+static BOOL __mark_pattern_selection_in_document(xmlPatternPtr comp, xmlDocPtr doc)
+{
+    xmlStreamCtxtPtr stream = xmlPatternGetStreamCtxt(comp);
+    if ( stream == NULL )
+        return ( NO );
+    
+    BOOL ok = (xmlStreamPush(stream, NULL, NULL) >= 0);     // the document node
+    if ( ok )
+        ok = __mark_pattern_selection(stream, doc->children);
+    
+    xmlFreeStreamCtxt(stream);
+    return ( ok );
+}
+
+// visible if the node is a marked element, or belongs to one
+static int __pattern_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr parent)
+{
+    // attributes, namespaces and character content go with their element
+    xmlNodePtr element = (node->type == XML_ELEMENT_NODE ? node : parent);
+    return ( element != NULL && element->psvi == &__selected_marker ? 1 : 0 );
+}
+
+static BOOL (^__data_output_handler(NSMutableData * data))(const void *, NSUInteger, NSError **)
+{
+    return ( ^BOOL(const void * bytes, NSUInteger length, NSError ** error) {
+        [data appendBytes: bytes length: length];
+        return ( YES );
+    } );
+}
+
++ (NSData *) canonicalizeDocument: (AQXMLDocument *) document
+                      usingMethod: (AQXMLCanonicalizationMethod) method
+                 visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+{
+    NSMutableData * output = [NSMutableData new];
+    if ( [self canonicalizeDocument: document usingMethod: method visibilityFilter: isNodeVisible outputHandler: __data_output_handler(output) error: NULL] == NO )
+        return ( nil );
+    
+    return ( output );
+}
+
+// A standalone document holding a shallow copy of root (its attributes and namespace
+// declarations) with copies of the given children, plus the comments and PIs found
+// before and/or after root in the source document.
+static xmlDocPtr __partial_document(xmlDocPtr source, xmlNodePtr root, xmlNodePtr * children, NSUInteger count,
+                                    BOOL withPrologue, BOOL withEpilogue)
+{
+    xmlDocPtr doc = xmlNewDoc(source->version);
+    if ( doc == NULL )
+        return ( NULL );
+    
+    xmlNodePtr rootCopy = xmlDocCopyNode(root, doc, 2);
+    if ( rootCopy == NULL )
+    {
+        xmlFreeDoc(doc);
+        return ( NULL );
+    }
+    
+    for ( xmlNodePtr node = source->children; node != NULL; node = node->next )
+    {
+        if ( node == root )
+        {
+            xmlAddChild((xmlNodePtr)doc, rootCopy);
+            continue;
+        }
+        
+        if ( node->type != XML_COMMENT_NODE && node->type != XML_PI_NODE )
+            continue;
+        
+        if ( (rootCopy->parent == NULL && withPrologue) || (rootCopy->parent != NULL && withEpilogue) )
+        {
+            xmlNodePtr copy = xmlDocCopyNode(node, doc, 1);
+            if ( copy == NULL || xmlAddChild((xmlNodePtr)doc, copy) == NULL )
+                goto fail;
+        }
+    }
+    
+    for ( NSUInteger i = 0; i < count; i++ )
+    {
+        // any namespace declared on root is found on its copy, so the output is unchanged
+        xmlNodePtr copy = xmlDocCopyNode(children[i], doc, 1);
+        if ( copy == NULL || xmlAddChild(rootCopy, copy) == NULL )
+            goto fail;
+    }
+    
+    return ( doc );
+    
+fail:
+    if ( rootCopy->parent == NULL )
+        xmlFreeNode(rootCopy);
+    xmlFreeDoc(doc);
+    return ( NULL );
+}
+
+static NSData * __canonicalize_partial_document(xmlDocPtr source, xmlNodePtr root, xmlNodePtr * children, NSUInteger count,
+                                                BOOL withPrologue, BOOL withEpilogue, AQXMLCanonicalizationMethod method)
+{
+    xmlDocPtr doc = __partial_document(source, root, children, count, withPrologue, withEpilogue);
+    if ( doc == NULL )
+        return ( nil );
+    
+    NSMutableData * output = [NSMutableData new];
+    BOOL ok = __libxml_canonicalize(doc, method, nil, __data_output_handler(output), NULL);
+    xmlFreeDoc(doc);
+    
+    return ( ok ? output : nil );
+}
+
++ (NSData *) canonicalizeDocumentConcurrently: (AQXMLDocument *) document
+                                  usingMethod: (AQXMLCanonicalizationMethod) method
+{
+    xmlDocPtr doc = document.xmlObj;
+    xmlNodePtr root = (doc == NULL ? NULL : xmlDocGetRootElement(doc));
+    
+    NSUInteger count = 0;
+    for ( xmlNodePtr child = (root == NULL ? NULL : root->children); child != NULL; child = child->next )
+        count++;
+    
+    NSUInteger numCPUs = [[NSProcessInfo processInfo] activeProcessorCount];
+    if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 || numCPUs < 2 || count < 2 )
+        return ( [self canonicalizeDocument: document usingMethod: method visibilityFilter: nil] );
+    
+    xmlNodePtr * children = malloc(count * sizeof(xmlNodePtr));
+    if ( children == NULL )
+        return ( nil );
+    
+    NSUInteger idx = 0;
+    for ( xmlNodePtr child = root->children; child != NULL; child = child->next )
+        children[idx++] = child;
+    
+    // Each run gives us root's start tag, some content, then root's end tag. The root alone
+    // tells us how long those tags are; the prologue and epilogue come from two more runs.
+    NSData * rootOnly = __canonicalize_partial_document(doc, root, NULL, 0, NO, NO, method);
+    NSData * head = __canonicalize_partial_document(doc, root, NULL, 0, YES, NO, method);
+    NSData * tail = __canonicalize_partial_document(doc, root, NULL, 0, NO, YES, method);
+    
+    NSUInteger endTagLength = strlen((const char *)root->name) + 3;
+    if ( root->ns != NULL && root->ns->prefix != NULL )
+        endTagLength += strlen((const char *)root->ns->prefix) + 1;
+    
+    if ( rootOnly == nil || head == nil || tail == nil || [rootOnly length] < endTagLength )
+    {
+        free(children);
+        return ( nil );
+    }
+    
+    NSUInteger startTagLength = [rootOnly length] - endTagLength;
+    
+    // copying an xml:* attribute can look up the 'xml' namespace on the source document,
+    // which creates it on first use -- do that now, rather than from several threads
+    (void) xmlSearchNs(doc, root, BAD_CAST "xml");
+    
+    // contiguous runs of children, several per CPU so uneven subtrees balance out
+    NSUInteger numGroups = MIN(count, numCPUs * 4);
+    void ** results = calloc(numGroups, sizeof(void *));
+    dispatch_apply(numGroups, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        NSUInteger first = (i * count) / numGroups;
+        NSUInteger last = ((i + 1) * count) / numGroups;
+        NSData * data = __canonicalize_partial_document(doc, root, children + first, last - first, NO, NO, method);
+        if ( data != nil && [data length] >= [rootOnly length] )
+            results[i] = (void *)CFBridgingRetain(data);
+    });
+    
+    free(children);
+    
+    NSMutableData * output = [NSMutableData new];
+    [output appendBytes: [head bytes] length: [head length] - [rootOnly length]];
+    [output appendBytes: [rootOnly bytes] length: startTagLength];
+    
+    for ( NSUInteger i = 0; i < numGroups; i++ )
+    {
+        NSData * data = CFBridgingRelease(results[i]);
+        if ( data == nil )
+        {
+            output = nil;       // keep going, to release the rest
+            continue;
+        }
+        
+        [output appendBytes: (const uint8_t *)[data bytes] + startTagLength
+                     length: [data length] - [rootOnly length]];
+    }
+    
+    free(results);
+    
+    [output appendBytes: (const uint8_t *)[rootOnly bytes] + startTagLength length: endTagLength];
+    [output appendBytes: (const uint8_t *)[tail bytes] + [rootOnly length] length: [tail length] - [rootOnly length]];
+    
+    return ( output );
+}
+
++ (NSData *) canonicalizeElement: (AQXMLElement *) element
+                     usingMethod: (AQXMLCanonicalizationMethod) method
+                visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+{
+    NSMutableData * output = [NSMutableData new];
+    if ( [self canonicalizeElement: element usingMethod: method visibilityFilter: isNodeVisible outputHandler: __data_output_handler(output) error: NULL] == NO )
+        return ( nil );
+    
+    return ( output );
+}
+
++ (BOOL) canonicalizeDocument: (AQXMLDocument *) document
+                  usingMethod: (AQXMLCanonicalizationMethod) method
+             visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+                outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                        error: (NSError **) error
+{
+    if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
+    {
+        AQXMLCanonicalizer * worker = [[self alloc] initWithDocument: document];
+        worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
+        worker.isNodeVisible = isNodeVisible;
+        return ( [worker canonicalizeWithOutputHandler: handler error: error] );
+    }
+    
+    // otherwise it's something libxml can handle
+    return ( __libxml_canonicalize(document.xmlObj, method, isNodeVisible, handler, error) );
+}
+
++ (BOOL) canonicalizeElement: (AQXMLElement *) element
+                 usingMethod: (AQXMLCanonicalizationMethod) method
+            visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+               outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                       error: (NSError **) error
+{
+    if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
+    {
+        AQXMLCanonicalizer * worker = [[self alloc] initWithElement: element];
+        worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
+        worker.isNodeVisible = isNodeVisible;
+        return ( [worker canonicalizeWithOutputHandler: handler error: error] );
+    }
+    
+    // otherwise it's something libxml can handle, working on a copy of just the element
+    xmlDocPtr doc = __subtree_document(element.xmlObj);
+    if ( doc == NULL )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"Unable to copy the element for canonicalization"];
+        return ( NO );
+    }
+    
+    BOOL ok = NO;
+    if ( isNodeVisible == nil )
+        ok = __libxml_canonicalize_with_callback(doc, method, &__subtree_copy_visible_callback, NULL, handler, error);
+    else
+        ok = __libxml_canonicalize_with_callback(doc, method, &__subtree_copy_filter_callback, (__bridge void *)isNodeVisible, handler, error);
+    
+    xmlFreeDoc(doc);
+    return ( ok );
+}
+
++ (BOOL) canonicalizeData: (NSData *) data
+              usingMethod: (AQXMLCanonicalizationMethod) method
+   selectingElementWithID: (NSString *) elementID
+            outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                    error: (NSError **) error
+{
+    if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
+    {
+        AQXMLCanonicalizer * worker = [[self alloc] initWithData: data];
+        worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
+        worker.selectedElementID = elementID;
+        return ( [worker canonicalizeWithOutputHandler: handler error: error] );
+    }
+    
+    // libxml needs a document
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLData: data error: error];
+    if ( doc == nil )
+        return ( NO );
+    
+    xmlNodePtr element = __find_element_with_id(doc.xmlObj->children, BAD_CAST [elementID UTF8String]);
+    if ( element == NULL )
+    {
+        if ( error != NULL )
+            *error = __missing_element_error(elementID);
+        return ( NO );
+    }
+    
+    return ( [self canonicalizeElement: AQXMLWrapperForNode(element) usingMethod: method visibilityFilter: nil outputHandler: handler error: error] );
 }
 
-+ (NSData *) canonicalizeDocument: (AQXMLDocument *) document
-                      usingMethod: (AQXMLCanonicalizationMethod) method
-                 visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
++ (BOOL) canonicalizeData: (NSData *) data
+              usingMethod: (AQXMLCanonicalizationMethod) method
+         selectingPattern: (NSString *) pattern
+               namespaces: (NSDictionary *) namespaces
+            outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                    error: (NSError **) error
 {
     if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
     {
-        AQXMLCanonicalizer * worker = [[self alloc] initWithDocument: document];
+        AQXMLCanonicalizer * worker = [[self alloc] initWithData: data];
         worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
-        worker.isNodeVisible = isNodeVisible;
-        NSOutputStream * output = [NSOutputStream outputStreamToMemory];
-        if ( [worker canonicalizeToStream: output error: NULL] )
-            return ( [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey] );
-        
-        return ( nil );
+        if ( [worker setSelectionPattern: pattern namespaces: namespaces error: error] == NO )
+            return ( NO );
+        return ( [worker canonicalizeWithOutputHandler: handler error: error] );
     }
     
-    // otherwise it's something libxml can handle
-    xmlBufferPtr xmlBuf = xmlBufferCreate();
-    xmlOutputBufferPtr output = xmlOutputBufferCreateBuffer(xmlBuf, NULL);
-    
-    int mode = (method & ~AQXMLCanonicalizationMethod_with_comments);
-    int ok = xmlC14NExecute(document.xmlObj, &__node_visible_callback, (__bridge void *)isNodeVisible, mode, NULL, (method & AQXMLCanonicalizationMethod_with_comments), output);
+    xmlPatternPtr comp = __compile_selection_pattern(pattern, namespaces, error);
+    if ( comp == NULL )
+        return ( NO );
     
-    xmlOutputBufferClose(output);
-    if ( ok != 0 )
+    // the document is our own, so its elements can be marked in place
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLData: data error: error];
+    BOOL ok = NO;
+    if ( doc != nil )
     {
-        xmlBufferFree(xmlBuf);
-        return ( nil );
+        ok = __mark_pattern_selection_in_document(comp, doc.xmlObj);
+        if ( ok )
+            ok = __libxml_canonicalize_with_callback(doc.xmlObj, method, &__pattern_visible_callback, NULL, handler, error);
+        else if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: [NSString stringWithFormat: @"Cannot select elements using the pattern '%@'", pattern]];
     }
     
-    NSData * data = [NSData dataWithBytes: xmlBuf->content length: xmlBuf->use];
-    xmlBufferFree(xmlBuf);
-    
-    return ( data );
+    xmlFreePattern(comp);
+    return ( ok );
 }
 
-+ (NSData *) canonicalizeElement: (AQXMLElement *) element
++ (NSData *) canonicalizeNodeSet: (AQXMLNodeSet *) nodeSet
                      usingMethod: (AQXMLCanonicalizationMethod) method
-                visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
 {
-    if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
-    {
-        BOOL (^checkElementHierarchy)(AQXMLNode *) = ^BOOL(AQXMLNode * node) {
-            AQXMLNode * check = node;
-            while ( check != nil )
-            {
-                if ( check == node )
-                    break;      // matched, so this one succeeds
-                check = check.parent;
-            }
-            
-            if ( check == nil )
-                return ( NO );      // not a descendant of the element node
-            
-            if ( isNodeVisible != nil )
-                return ( isNodeVisible(node) );
-            return ( YES );
-        };
-        
-        // get a data blob for stream processing
-        AQXMLCanonicalizer * worker = [[self alloc] initWithDocument: element.document];
-        worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
-        worker.isNodeVisible = checkElementHierarchy;
-        NSOutputStream * output = [NSOutputStream outputStreamToMemory];
-        if ( [worker canonicalizeToStream: output error: NULL] )
-            return ( [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey] );
-        
+    NSMutableData * output = [NSMutableData new];
+    if ( [self canonicalizeNodeSet: nodeSet usingMethod: method outputHandler: __data_output_handler(output) error: NULL] == NO )
         return ( nil );
-    }
     
-    // otherwise it's something libxml can handle
-    xmlBufferPtr xmlBuf = xmlBufferCreate();
-    xmlOutputBufferPtr output = xmlOutputBufferCreateBuffer(xmlBuf, NULL);
-    
-    int mode = (method & ~AQXMLCanonicalizationMethod_with_comments);
-    int ok = xmlC14NExecute(element.document.xmlObj, &__node_visible_callback, (__bridge void *)isNodeVisible, mode, NULL, (method & AQXMLCanonicalizationMethod_with_comments), output);
+    return ( output );
+}
+
++ (BOOL) canonicalizeNodeSet: (AQXMLNodeSet *) nodeSet
+                 usingMethod: (AQXMLCanonicalizationMethod) method
+               outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                       error: (NSError **) error
+{
+    if ( [nodeSet count] == 0 )
+        return ( YES );     // an empty node set canonicalizes to nothing
     
-    xmlOutputBufferClose(output);
-    if ( ok != 0 )
+    AQXMLDocument * document = nodeSet[0].document;
+    if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
     {
-        xmlBufferFree(xmlBuf);
-        return ( nil );
+        AQXMLCanonicalizer * worker = [[self alloc] initWithDocument: document];
+        worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
+        worker.isNodeVisible = ^BOOL(AQXMLNode * node) {
+            return ( [nodeSet containsNode: node] );
+        };
+        return ( [worker canonicalizeWithOutputHandler: handler error: error] );
     }
     
-    NSData * data = [NSData dataWithBytes: xmlBuf->content length: xmlBuf->use];
-    xmlBufferFree(xmlBuf);
-    
-    return ( data );
+    // libxml consults the set's index directly
+    return ( __libxml_canonicalize_with_callback(document.xmlObj, method, &AQXMLNodeSetIsVisibleCallback, (void *)nodeSet.visibilityIndex, handler, error) );
 }
 
 + (NSData *) canonicalizeContentAtURI: (NSURL *) uri
@@ -238,9 +1247,9 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
         worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
         worker.fragment = [uri fragment];
         worker.isNodeVisible = isNodeVisible;
-        NSOutputStream * output = [NSOutputStream outputStreamToMemory];
-        if ( [worker canonicalizeToStream: output error: NULL] )
-            return ( [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey] );
+        NSMutableData * output = [NSMutableData new];
+        if ( [worker canonicalizeToData: output error: NULL] )
+            return ( output );
         
         return ( nil );
     }
@@ -261,27 +1270,39 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
 + (NSData *) canonicalizeData: (NSData *) data
                   usingMethod: (AQXMLCanonicalizationMethod) method
              visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+{
+    NSMutableData * output = [NSMutableData new];
+    if ( [self canonicalizeData: data usingMethod: method visibilityFilter: isNodeVisible outputHandler: __data_output_handler(output) error: NULL] == NO )
+        return ( nil );
+    
+    return ( output );
+}
+
++ (BOOL) canonicalizeData: (NSData *) data
+              usingMethod: (AQXMLCanonicalizationMethod) method
+         visibilityFilter: (BOOL (^)(AQXMLNode * node)) isNodeVisible
+            outputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                    error: (NSError **) error
 {
     if ( (method & 0x7f) == AQXMLCanonicalizationMethod_2_0 )
     {
         AQXMLCanonicalizer * worker = nil;
         
         if ( isNodeVisible != nil )
-            worker = [[self alloc] initWithDocument: [AQXMLDocument documentWithXMLData: data error: NULL]];
+            worker = [[self alloc] initWithDocument: [AQXMLDocument documentWithXMLData: data error: error]];
         else
             worker = [[self alloc] initWithData: data];
         
         worker.preserveComments = (method & AQXMLCanonicalizationMethod_with_comments);
         worker.isNodeVisible = isNodeVisible;
-        NSOutputStream * output = [NSOutputStream outputStreamToMemory];
-        if ( [worker canonicalizeToStream: output error: NULL] )
-            return ( [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey] );
-        
-        return ( nil );
+        return ( [worker canonicalizeWithOutputHandler: handler error: error] );
     }
     
-    AQXMLDocument * doc = [AQXMLDocument documentWithXMLData: data error: NULL];
-    return ( [self canonicalizeDocument: doc usingMethod: method visibilityFilter: isNodeVisible] );
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLData: data error: error];
+    if ( doc == nil )
+        return ( NO );
+    
+    return ( [self canonicalizeDocument: doc usingMethod: method visibilityFilter: isNodeVisible outputHandler: handler error: error] );
 }
 
 - (id) initWithData: (NSData *) data
@@ -301,7 +1322,7 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
     _parser.shouldReportNamespacePrefixes = YES;
     _parser.shouldResolveExternalEntities = YES;
     
-    _stack = [NSMutableArray new];
+    _scope = [_NamespaceScope new];
     _qnameAwareAttrs = [NSMutableDictionary new];
     _qnameAwareElements = [NSMutableDictionary new];
     _qnameAwareXPathElements = [NSMutableDictionary new];
@@ -323,7 +1344,7 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
     
     _document = document;
     
-    _stack = [NSMutableArray new];
+    _scope = [_NamespaceScope new];
     _qnameAwareAttrs = [NSMutableDictionary new];
     _qnameAwareElements = [NSMutableDictionary new];
     _qnameAwareXPathElements = [NSMutableDictionary new];
@@ -337,6 +1358,40 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
     return ( self );
 }
 
+- (id) initWithElement: (AQXMLElement *) element
+{
+    self = [self initWithDocument: element.document];
+    if ( self == nil )
+        return ( nil );
+    
+    _subtreeRoot = element;
+    
+    return ( self );
+}
+
+- (void) dealloc
+{
+    if ( _selectionPattern != NULL )
+        xmlFreePattern(_selectionPattern);
+}
+
+- (BOOL) setSelectionPattern: (NSString *) pattern namespaces: (NSDictionary *) namespaces error: (NSError **) error
+{
+    xmlPatternPtr comp = NULL;
+    if ( pattern != nil )
+    {
+        comp = __compile_selection_pattern(pattern, namespaces, error);
+        if ( comp == NULL )
+            return ( NO );
+    }
+    
+    if ( _selectionPattern != NULL )
+        xmlFreePattern(_selectionPattern);
+    _selectionPattern = comp;
+    
+    return ( YES );
+}
+
 - (void) addQNameAwareAttribute: (NSString *) name namespaceURI: (NSString *) namespaceURI
 {
     _qnameAwareAttrs[name] = namespaceURI;
@@ -352,37 +1407,44 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
     _qnameAwareXPathElements[name] = namespaceURI;
 }
 
-- (_StackContext *) newStackContext
+- (void) canonicalizeToStream: (NSOutputStream *) stream completionHandler: (void (^)(NSError * error)) handler
 {
-    _StackContext * ctx = [_StackContext new];
-    _StackContext * cur = [_stack lastObject];
-    if ( cur != nil )
-    {
-        ctx.namespaceContext = [cur.namespaceContext mutableCopy];
-        ctx.outputPrefixes = [cur.outputPrefixes mutableCopy];
-        ctx.preserveSpace = cur.preserveSpace;
-    }
-    else
-    {
-        ctx.namespaceContext = [NSMutableDictionary new];
-        ctx.outputPrefixes = [NSMutableSet new];
-    }
-    
-    [_stack addObject: ctx];
-    
-    return ( ctx );
+    [self canonicalizeToStream: stream
+                    parseQueue: dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0)
+             completionHandler: handler];
 }
 
-- (void) canonicalizeToStream: (NSOutputStream *) stream completionHandler: (void (^)(NSError * error)) handler
+- (void) canonicalizeToStream: (NSOutputStream *) stream
+                   parseQueue: (dispatch_queue_t) queue
+            completionHandler: (void (^)(NSError * error)) handler
 {
-    void (^handlerCopy)(NSError *) = [handler copy];
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    _OutputPipeline * pipeline = [[_OutputPipeline alloc] initWithStream: stream parseQueue: queue completionHandler: handler];
+    
+    // parse in small steps, so the pipeline's bound is a tight one
+    if ( _parser != nil )
+        _parser.chunkSize = kAQXMLCanonicalizerOutputBufferSize;
+    
+    [self beginOutputWithHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** error) {
+        return ( [pipeline enqueueBytes: bytes length: length error: error] );
+    }];
+    
+    [pipeline startWithStep: ^BOOL{
+        // a document is walked in a single step
+        if ( _parser == nil )
+        {
+            [self canonicalizeDocumentTree];
+            return ( NO );
+        }
+        
+        return ( [_parser parseNextChunk] );
+    } finish: ^NSError *{
         NSError * error = nil;
-        if ( [self canonicalizeToStream: stream error: &error] == NO )
-            handlerCopy(error);
-        else
-            handlerCopy(nil);
-    });
+        BOOL result = (_error == nil && [_parser parserError] == nil);
+        if ( [self endOutputWithResult: result error: &error] )
+            return ( nil );
+        
+        return ( error != nil ? error : [NSError xmlGenericErrorWithDescription: @"Canonicalization failed"] );
+    }];
 }
 
 - (BOOL) canonicalizeToStream: (NSOutputStream *) stream error: (NSError **) error
@@ -399,39 +1461,173 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
         }
     }
     
-    if ( _parser != nil )
-    {
-        // operating in streaming mode
-        if ( [_parser parse] == NO )
+    BOOL result = [self canonicalizeWithOutputHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** outError) {
+        return ( [self writeBytes: bytes length: length toStreamWithError: outError] );
+    } error: error];
+    
+    _output = nil;
+    return ( result );
+}
+
+- (BOOL) canonicalizeToData: (NSMutableData *) data error: (NSError **) error
+{
+    return ( [self canonicalizeWithOutputHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** outError) {
+        [data appendBytes: bytes length: length];
+        return ( YES );
+    } error: error] );
+}
+
+- (BOOL) canonicalizeToFileDescriptor: (int) fd error: (NSError **) error
+{
+    return ( [self canonicalizeWithOutputHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** outError) {
+        const uint8_t * p = bytes;
+        while ( length > 0 )
         {
-            if ( error != NULL )
+            ssize_t written = write(fd, p, length);
+            if ( written < 0 )
             {
-                if ( _error != nil )
-                    *error = _error;
-                else
-                    *error = [_parser parserError];
+                if ( errno == EINTR )
+                    continue;
+                
+                if ( outError != NULL )
+                    *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+                return ( NO );
             }
             
-            return ( NO );
+            p += written;
+            length -= written;
         }
         
-        _output = nil;
         return ( YES );
+    } error: error] );
+}
+
+- (BOOL) canonicalizeWithOutputHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+                                 error: (NSError **) error
+{
+    [self beginOutputWithHandler: handler];
+    
+    BOOL result = YES;
+    if ( _parser != nil )
+    {
+        // operating in streaming mode
+        result = [_parser parse];
     }
     else
     {
-        // operating in DOM mode
-        // this is a recursive algorithm
-        AQXMLDocument * doc = _document;
-        if ( self.rewritePrefixes )
-            doc = [doc copy];       // we modify text nodes & attr values when rewriting
-        [self canonicalizeSubtreeAtNode: [_document copy]];
+        result = [self canonicalizeDocumentTree];
     }
     
-    _output = nil;
+    return ( [self endOutputWithResult: result error: error] );
+}
+
+- (void) beginOutputWithHandler: (BOOL (^)(const void * bytes, NSUInteger length, NSError ** error)) handler
+{
+    _outputHandler = handler;
+    _outputBuffer = [[NSMutableData alloc] initWithCapacity: kAQXMLCanonicalizerOutputBufferSize];
+    _error = nil;
+    
+    if ( _parser != nil && _selectionPattern != NULL )
+    {
+        _selectionStream = xmlPatternGetStreamCtxt(_selectionPattern);
+        if ( _selectionStream != NULL )
+            xmlStreamPush(_selectionStream, NULL, NULL);    // the document node
+    }
+    _selectedDepth = 0;
+    _selectionFound = NO;
+}
+
+- (BOOL) canonicalizeDocumentTree
+{
+    // operating in DOM mode
+    // this is a recursive algorithm
+    AQXMLNode * root = (_subtreeRoot != nil ? _subtreeRoot : _document);
+    AQXMLNode * node = root;
+    if ( self.rewritePrefixes )
+        node = [root copy];     // we modify text nodes & attr values when rewriting
+    [self canonicalizeSubtreeAtNode: node inScopeOf: root];
+    return ( _error == nil );
+}
+
+- (BOOL) endOutputWithResult: (BOOL) result error: (NSError **) error
+{
+    if ( _selectionStream != NULL )
+    {
+        xmlFreeStreamCtxt(_selectionStream);
+        _selectionStream = NULL;
+    }
+    
+    if ( result )
+    {
+        NSError * flushError = nil;
+        result = [self flushOutput: &flushError];
+        if ( result == NO )
+            _error = flushError;
+    }
+    
+    // an ID names one particular element, so it's an error if that isn't there
+    if ( result && _parser != nil && self.selectedElementID != nil && _selectionFound == NO )
+    {
+        _error = __missing_element_error(self.selectedElementID);
+        result = NO;
+    }
+    
+    if ( result == NO && error != NULL )
+    {
+        if ( _error != nil )
+            *error = _error;
+        else
+            *error = [_parser parserError];
+    }
+    
+    // the handler may well reference us
+    _outputHandler = nil;
+    _outputBuffer = nil;
+    return ( result );
+}
+
+#pragma mark - Output Buffering
+
+- (BOOL) flushOutput: (NSError **) error
+{
+    NSUInteger length = [_outputBuffer length];
+    if ( length == 0 )
+        return ( YES );
+    
+    BOOL result = _outputHandler([_outputBuffer bytes], length, error);
+    [_outputBuffer setLength: 0];
+    return ( result );
+}
+
+- (BOOL) outputBytes: (const void *) bytes length: (NSUInteger) length error: (NSError **) error
+{
+    if ( [_outputBuffer length] + length > kAQXMLCanonicalizerOutputBufferSize )
+    {
+        if ( [self flushOutput: error] == NO )
+            return ( NO );
+        
+        // large fragments go straight through
+        if ( length >= kAQXMLCanonicalizerOutputBufferSize )
+            return ( _outputHandler(bytes, length, error) );
+    }
+    
+    [_outputBuffer appendBytes: bytes length: length];
     return ( YES );
 }
 
+- (BOOL) outputData: (NSData *) data error: (NSError **) error
+{
+    return ( [self outputBytes: [data bytes] length: [data length] error: error] );
+}
+
+- (BOOL) outputString: (NSString *) string error: (NSError **) error
+{
+    const char * utf8 = [string UTF8String];
+    if ( utf8 == NULL )
+        return ( YES );
+    return ( [self outputBytes: utf8 length: strlen(utf8) error: error] );
+}
+
 #pragma mark - Output Stream Helpers
 
 - (void) stream: (NSStream *) aStream handleEvent: (NSStreamEvent) eventCode
@@ -477,9 +1673,9 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
                        forMode: AQXMLCanonicalizerOutputRunLoopMode];
 }
 
-- (BOOL) outputData: (NSData *) data error: (NSError **) error
+- (BOOL) writeBytes: (const uint8_t *) bytes length: (NSUInteger) length toStreamWithError: (NSError **) error
 {
-    NSInteger written = [_output write: [data bytes] maxLength: [data length]];
+    NSInteger written = [_output write: bytes maxLength: length];
     if ( written < 0 )
     {
         if ( error != NULL )
@@ -487,15 +1683,15 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
         return ( NO );
     }
     
-    if ( written == [data length] )
+    if ( written == length )
         return ( YES );
     
     [_output setDelegate: self];
     [_output scheduleInRunLoop: [NSRunLoop currentRunLoop]
                        forMode: AQXMLCanonicalizerOutputRunLoopMode];
     
-    const uint8_t *p = [data bytes];
-    NSUInteger len = [data length];
+    const uint8_t *p = bytes;
+    NSUInteger len = length;
     p += written;
     len -= written;
     
@@ -536,30 +1732,72 @@ static int __node_visible_callback(void *user_data, xmlNodePtr node, xmlNodePtr
     return ( YES );
 }
 
-#define WRITE(d, e) \
-if ( [self outputData: d error: &e] == NO ) \
+#define _CHECKED_WRITE(call, e) \
+if ( (call) == NO ) \
 { \
     [_parser abortParsing]; \
     _error = e; \
     return; \
 }
 
+#define WRITE(d, e)             _CHECKED_WRITE([self outputData: d error: &e], e)
+#define WRITE_BYTES(b, l, e)    _CHECKED_WRITE([self outputBytes: b length: l error: &e], e)
+#define WRITE_STRING(s, e)      _CHECKED_WRITE([self outputString: s error: &e], e)
+
+static inline void _AppendString( NSMutableData * data, NSString * string )
+{
+    const char * utf8 = [string UTF8String];
+    if ( utf8 != NULL )
+        [data appendBytes: utf8 length: strlen(utf8)];
+}
+
 #pragma mark - Streaming Mode
 
+- (BOOL) isOutsideSelection
+{
+    return ( _selectedDepth == 0 && (_selectionPattern != NULL || self.selectedElementID != nil) );
+}
+
+- (BOOL) selectionMatchesElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI attributes: (NSDictionary *) attributeDict
+{
+    BOOL matched = NO;
+    if ( _selectionStream != NULL )
+    {
+        // every element is pushed, selected or not, so the pattern can follow the path
+        const xmlChar * ns = ([namespaceURI length] != 0 ? BAD_CAST [namespaceURI UTF8String] : NULL);
+        matched = (xmlStreamPush(_selectionStream, BAD_CAST [elementName UTF8String], ns) == 1);
+    }
+    
+    NSString * elementID = self.selectedElementID;
+    if ( matched == NO && elementID != nil )
+    {
+        for ( NSString * name in @[@"xml:id", @"Id", @"ID", @"id"] )
+        {
+            if ( [attributeDict[name] isEqualToString: elementID] )
+                return ( YES );
+        }
+    }
+    
+    return ( matched );
+}
+
 - (void) outputBufferedChars
 {
+    [self flushPendingStartTag];
+    
     if ( [_runningChars length] > 0 )
     {
-        if (self.preserveWhitespace == NO)
+        const char * utf8 = [_runningChars UTF8String];
+        NSRange r = NSMakeRange(0, strlen(utf8));
+        if ( self.preserveWhitespace == NO )
+            r = AQXMLTrimmedWhitespaceRange((const uint8_t *)utf8, r.length);
+        
+        if ( r.length != 0 )
         {
-            [_runningChars setString: [_runningChars stringByTrimmingCharactersInSet: [NSCharacterSet whitespaceAndNewlineCharacterSet]]];
+            NSError * error = nil;
+            WRITE_BYTES(utf8 + r.location, r.length, error);
         }
         
-        if ( [_runningChars length] == 0 )
-            return;
-        
-        NSError * error = nil;
-        WRITE([_runningChars dataUsingEncoding: NSUTF8StringEncoding], error);
         [_runningChars setString: @""];
     }
 }
@@ -593,10 +1831,10 @@ if ( [self outputData: d error: &e] == NO ) \
     _attrDecls[key] = dict;
 }
 
-- (NSDictionary *) visiblyUsedNamespacesInContext: (_StackContext *) ctx fromAttributes: (NSMutableDictionary *) attributeDict
+- (NSDictionary *) visiblyUsedNamespacesFromAttributes: (NSMutableDictionary *) attributeDict
 {
     NSMutableSet * visiblyUsed = [NSMutableSet new];
-    NSString * prefix = ctx.elementPrefix;
+    NSString * prefix = _scope.elementPrefix;
     if ( [prefix length] > 0 )
     {
         [visiblyUsed addObject: prefix];
@@ -610,10 +1848,10 @@ if ( [self outputData: d error: &e] == NO ) \
         }
         
         // ensure it's in the context, to avoid redeclarations later
-        if ( ctx.namespaceContext[@""] == nil )
+        if ( [_scope URIForPrefix: @""] == nil )
         {
-            ctx.namespaceContext[@""] = @"";
-            [ctx.outputPrefixes addObject: @""];
+            [_scope bindPrefix: @"" toURI: @""];
+            [_scope setPrefixOutput: @""];
         }
     }
     
@@ -632,15 +1870,15 @@ if ( [self outputData: d error: &e] == NO ) \
             NSString * pre = [key substringToIndex: r.location];
             [visiblyUsed addObject: pre];
             qLookup = [key substringFromIndex: NSMaxRange(r)];
-            attrURI = ctx.namespaceContext[pre];
+            attrURI = [_scope URIForPrefix: pre];
         }
         else if ( [prefix length] == 0 && [key isEqualToString: @"xmlns"] )
         {
-            if ( [ctx.outputPrefixes containsObject: @""] == NO || [ctx.namespaceContext[@""] isEqualToString: obj] == NO )
+            if ( [_scope isPrefixOutput: @""] == NO || [[_scope URIForPrefix: @""] isEqualToString: obj] == NO )
                 [visiblyUsed addObject: @""];
             
             // lookup URI of thue default namespace
-            attrURI = ctx.namespaceContext[@""];
+            attrURI = [_scope URIForPrefix: @""];
         }
         
         NSString *attrURICheck = _qnameAwareAttrs[qLookup];
@@ -668,10 +1906,10 @@ if ( [self outputData: d error: &e] == NO ) \
         // this element has been identified as QName-aware
         // is it Element or XPathElement ?
         BOOL contentIsQName = YES;
-        NSString * uri = _qnameAwareElements[ctx.elementLocalName];
+        NSString * uri = _qnameAwareElements[_scope.elementLocalName];
         if ( uri == nil )
         {
-            uri = _qnameAwareXPathElements[ctx.elementLocalName];
+            uri = _qnameAwareXPathElements[_scope.elementLocalName];
             contentIsQName = NO;
         }
         
@@ -693,22 +1931,7 @@ if ( [self outputData: d error: &e] == NO ) \
         }
         else
         {
-            NSRegularExpression * killQuoted = [NSRegularExpression regularExpressionWithPattern: @"(\".*?\"|\'.*?\')" options: 0 error: NULL];
-            NSMutableIndexSet * quoteRanges = [NSMutableIndexSet new];
-            [killQuoted enumerateMatchesInString: _runningChars options: 0 range: NSMakeRange(0, [_runningChars length]) usingBlock: ^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
-                [quoteRanges addIndexesInRange: result.range];
-            }];
-            
-            NSRegularExpression * reg = [NSRegularExpression regularExpressionWithPattern: @"([[:alpha:]-_][[:alnum:]-_]*):[[:alpha:]-]" options: 0 error: NULL];
-            [reg enumerateMatchesInString: _runningChars options: 0 range: NSMakeRange(0, [_runningChars length]) usingBlock: ^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
-                NSRange prefixRange = [result rangeAtIndex: 1];
-                if ( prefixRange.location == NSNotFound || prefixRange.length == 0 )
-                    return;
-                
-                // if the match is within a quoted range, ignore it
-                if ( [quoteRanges containsIndexesInRange: prefixRange] )
-                    return;
-                
+            __enumerate_xpath_prefixes(_runningChars, ^(NSRange prefixRange) {
                 NSString * pre = [_runningChars substringWithRange: prefixRange];
                 [visiblyUsed addObject: pre];
                 
@@ -717,7 +1940,7 @@ if ( [self outputData: d error: &e] == NO ) \
                     // record the range to replace
                     [contentSubstitutions addIndexesInRange: prefixRange];
                 }
-            }];
+            });
         }
     }
     
@@ -729,7 +1952,7 @@ if ( [self outputData: d error: &e] == NO ) \
             if ( [prefix isEqualToString: @"xml"] )
                 continue;       // 'xml' is never rewritten
             
-            NSString * uri = ctx.namespaceContext[prefix];
+            NSString * uri = [_scope URIForPrefix: prefix];
             if ( _rewrittenPrefixes[uri] == nil )
                 [newNamespaceURIs addObject: uri];
         }
@@ -743,7 +1966,7 @@ if ( [self outputData: d error: &e] == NO ) \
         
         // now modify the contents of any attribute values
         [rewrittenAttrNames enumerateKeysAndObjectsUsingBlock: ^(id key, id obj, BOOL *stop) {
-            NSString * uri = ctx.namespaceContext[obj];
+            NSString * uri = [_scope URIForPrefix: obj];
             NSString * newPrefix = _rewrittenPrefixes[uri];
             NSString * value = [attributeDict[key] stringByReplacingOccurrencesOfString: obj withString: newPrefix];
             attributeDict[key] = value;
@@ -752,7 +1975,7 @@ if ( [self outputData: d error: &e] == NO ) \
         // now modify any element content, going in reverse so we handle length changes properly
         [contentSubstitutions enumerateRangesWithOptions: NSEnumerationReverse usingBlock: ^(NSRange range, BOOL *stop) {
             NSString * pre = [_runningChars substringWithRange: range];
-            NSString * uri = ctx.namespaceContext[pre];
+            NSString * uri = [_scope URIForPrefix: pre];
             NSString * newPrefix = _rewrittenPrefixes[uri];
             if ( newPrefix != nil )
                 [_runningChars replaceCharactersInRange: range withString: newPrefix];
@@ -765,13 +1988,13 @@ if ( [self outputData: d error: &e] == NO ) \
         if ( [prefix isEqualToString: @"xml"] )
             continue;
         
-        NSString * uri = ctx.namespaceContext[prefix];
+        NSString * uri = [_scope URIForPrefix: prefix];
         if ( self.rewritePrefixes )
             prefix = _rewrittenPrefixes[uri];
         
-        if ( [ctx.outputPrefixes containsObject: prefix] == NO )
+        if ( [_scope isPrefixOutput: prefix] == NO )
         {
-            [ctx.outputPrefixes addObject: prefix];
+            [_scope setPrefixOutput: prefix];
             nsToBeOutputList[prefix] = uri;
         }
     }
@@ -779,26 +2002,16 @@ if ( [self outputData: d error: &e] == NO ) \
     return ( nsToBeOutputList );
 }
 
-- (NSString *) canonicalizeAttributeValue: (NSString *) value
-                                   forKey: (NSString *) attrName
-                                     type: (AQXMLAttributeType) typeOrZero
+- (void) appendCanonicalAttribute: (NSString *) attrName
+                            value: (NSString *) value
+                             type: (AQXMLAttributeType) typeOrZero
+                           toData: (NSMutableData *) output
 {
-    _StackContext * ctx = [_stack lastObject];
-    NSMutableString * mutable = [value mutableCopy];
-    [mutable replaceOccurrencesOfString: @"&" withString: @"&amp;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"<" withString: @"&lt;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\"" withString: @"&quot;" options: 0 range: NSMakeRange(0, [mutable length])];
-    
-    // replace characters 0xd, 0xa, 0x9 (\r, \n, \t) with canonical character references
-    [mutable replaceOccurrencesOfString: @"\r" withString: @"&#xD;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\n" withString: @"&#xA;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\t" withString: @"&#x9;" options: 0 range: NSMakeRange(0, [mutable length])];
-    
     // whitespace compression/replacement
     BOOL isNMTOKEN = NO;
     if ( typeOrZero == 0 )
     {
-        NSString * key = [ctx.elementLocalName stringByAppendingFormat: @":%@", attrName];
+        NSString * key = [_scope.elementLocalName stringByAppendingFormat: @":%@", attrName];
         NSDictionary * dict = _attrDecls[key];
         if ( dict != nil && [dict[@"type"] hasSuffix: @"NMTOKENS"] )
             isNMTOKEN = YES;
@@ -808,64 +2021,85 @@ if ( [self outputData: d error: &e] == NO ) \
         isNMTOKEN = (typeOrZero == AQXMLAttributeTypeNMTokens);
     }
     
+    [output appendBytes: " " length: 1];
+    _AppendString(output, attrName);
+    [output appendBytes: "=\"" length: 2];
+    
+    // & < " CR LF TAB become character references; then
     // NMTOKENS type has all whitespace ranges compressed to a single space
     // CDATA type has all whitespace chars replaced with spaces, no compression
-    NSRegularExpression * reg = [[NSRegularExpression alloc] initWithPattern: (isNMTOKEN ? @"\\s+" : @"\\s") options: 0 error: NULL];
-    [reg replaceMatchesInString: mutable options: 0 range: NSMakeRange(0, [mutable length]) withTemplate: @" "];
+    const char * utf8 = [value UTF8String];
+    if ( utf8 != NULL )
+        AQXMLAppendCanonicalAttributeValue(output, (const uint8_t *)utf8, strlen(utf8), isNMTOKEN);
     
-    return ( [mutable copy] );
+    [output appendBytes: "\"" length: 1];
 }
 
 - (void) parser: (AQXMLParser *) parser didStartElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI qualifiedName: (NSString *) qName attributes: (NSDictionary *) attributeDict
 {
     _documentRootEncountered = YES;
     
-    // don't output buffered chars if we're being called via this invocation
-    if ( _qualifiedContentStartElementInvocation == nil )
-        [self outputBufferedChars];
-    
-    NSError * error = nil;
-    _StackContext * ctx = nil;
-    if ( _qualifiedContentStartElementInvocation == nil )
-        ctx = [self newStackContext];
-    else
-        ctx = [_stack lastObject];  // context was already created
+    [self outputBufferedChars];
+    [_scope pushElement: qName];
     
     // any namespaces reported prior to this call?
     [_pendingNamespaces enumerateKeysAndObjectsUsingBlock: ^(id key, id obj, BOOL *stop) {
-        if ( [ctx.namespaceContext[key] isEqualToString: obj] )
+        if ( [[_scope URIForPrefix: key] isEqualToString: obj] )
             return;
-        ctx.namespaceContext[key] = obj;
-        [ctx.outputPrefixes removeObject: key];
+        [_scope bindPrefix: key toURI: obj];
     }];
     [_pendingNamespaces removeAllObjects];
     
-    ctx.elementQName = qName;
-    
-    if ( _qualifiedContentStartElementInvocation == nil &&
-        (_qnameAwareElements[elementName] != nil || _qnameAwareXPathElements[elementName] != nil) )
-    {
-        // need to inspect this element's content, so defer the call entirely
-        _qualifiedContentStartElementInvocation = [NSInvocation invocationWithMethodSignature: [self methodSignatureForSelector: _cmd]];
-        [_qualifiedContentStartElementInvocation setTarget: self];
-        [_qualifiedContentStartElementInvocation setSelector: _cmd];
-        [_qualifiedContentStartElementInvocation setArgument: &parser atIndex: 2];
-        [_qualifiedContentStartElementInvocation setArgument: &elementName atIndex: 3];
-        [_qualifiedContentStartElementInvocation setArgument: &namespaceURI atIndex: 4];
-        [_qualifiedContentStartElementInvocation setArgument: &qName atIndex: 5];
-        [_qualifiedContentStartElementInvocation setArgument: &attributeDict atIndex: 6];
-        [_qualifiedContentStartElementInvocation retainArguments];
-        
+    if ( _selectionPattern != NULL || self.selectedElementID != nil )
+    {
+        BOOL selected = [self selectionMatchesElement: elementName namespaceURI: namespaceURI attributes: attributeDict];
+        if ( _selectedDepth == 0 )
+        {
+            if ( selected == NO )
+                return;     // its namespaces are in scope, but it isn't output
+            _selectedDepth = _scope.depth;
+            _selectionFound = YES;
+        }
+    }
+    
+    if ( _qnameAwareElements[elementName] != nil || _qnameAwareXPathElements[elementName] != nil )
+    {
+        // need to inspect this element's content before writing its start tag
+        _pendingElementName = elementName;
+        _pendingNamespaceURI = namespaceURI;
+        _pendingAttributes = attributeDict;
         return;
     }
     
-    NSMutableDictionary * allAttrs = [attributeDict mutableCopy];
-    NSString * prefix = ctx.elementPrefix;
-    NSDictionary * usedNamespaces = [self visiblyUsedNamespacesInContext: ctx fromAttributes: allAttrs];
+    [self writeStartTagForElement: elementName namespaceURI: namespaceURI attributes: attributeDict];
+}
+
+- (void) flushPendingStartTag
+{
+    if ( _pendingElementName == nil )
+        return;
     
-    // find out if we need to rewrite it based on
+    NSString * elementName = _pendingElementName;
+    NSString * namespaceURI = _pendingNamespaceURI;
+    NSDictionary * attributeDict = _pendingAttributes;
+    _pendingElementName = nil;
+    _pendingNamespaceURI = nil;
+    _pendingAttributes = nil;
+    
+    // the buffered content is examined (and possibly rewritten) along the way
+    [self writeStartTagForElement: elementName namespaceURI: namespaceURI attributes: attributeDict];
+}
+
+- (void) writeStartTagForElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI attributes: (NSDictionary *) attributeDict
+{
+    NSError * error = nil;
+    NSMutableDictionary * allAttrs = [attributeDict mutableCopy];
+    NSString * prefix = _scope.elementPrefix;
+    NSDictionary * usedNamespaces = [self visiblyUsedNamespacesFromAttributes: allAttrs];
     
-    WRITE([NSData dataWithBytesNoCopy: "<" length: 1 freeWhenDone: NO], error);
+    // the whole start tag is assembled here, then written in one go
+    NSMutableData * tag = [[NSMutableData alloc] initWithCapacity: 256];
+    [tag appendBytes: "<" length: 1];
     
     @autoreleasepool
     {
@@ -876,26 +2110,33 @@ if ( [self outputData: d error: &e] == NO ) \
             {
                 if ( outName == nil )
                     outName = @"";
-                NSString * uri = ctx.namespaceContext[prefix];
+                NSString * uri = [_scope URIForPrefix: prefix];
                 outName = _rewrittenPrefixes[uri];
             }
             
             outName = [outName stringByAppendingString: @":"];
         }
         
-        outName = [outName stringByAppendingString: ctx.elementLocalName];
-        ctx.elementQName = outName;
-        WRITE([outName dataUsingEncoding: NSUTF8StringEncoding], error);
+        outName = [outName stringByAppendingString: _scope.elementLocalName];
+        _scope.elementQName = outName;
+        _AppendString(tag, outName);
         
         NSArray * namespaceKeys = [[usedNamespaces allKeys] sortedArrayUsingSelector: @selector(compare:)];
         for ( NSString * prefix in namespaceKeys )
         {
-            NSString * output = nil;
             if ( [prefix length] == 0 )
-                output = [NSString stringWithFormat: @" xmlns=\"%@\"", usedNamespaces[prefix]];
+            {
+                [tag appendBytes: " xmlns=\"" length: 8];
+            }
             else
-                output = [NSString stringWithFormat: @" xmlns:%@=\"%@\"", prefix, usedNamespaces[prefix]];
-            WRITE([output dataUsingEncoding: NSUTF8StringEncoding], error);
+            {
+                [tag appendBytes: " xmlns:" length: 7];
+                _AppendString(tag, prefix);
+                [tag appendBytes: "=\"" length: 2];
+            }
+            
+            _AppendString(tag, usedNamespaces[prefix]);
+            [tag appendBytes: "\"" length: 1];
         }
     }
     
@@ -924,7 +2165,7 @@ if ( [self outputData: d error: &e] == NO ) \
     // insert any default attributes
     if ( schema != nil )
     {
-        NSDictionary * defaultAttrs = [schema defaultAttributesForElementName: elementName prefix: ctx.elementPrefix];
+        NSDictionary * defaultAttrs = [schema defaultAttributesForElementName: elementName prefix: _scope.elementPrefix];
         [defaultAttrs enumerateKeysAndObjectsUsingBlock: ^(id key, id obj, BOOL *stop) {
             if ( allAttrs[key] == nil )
                 allAttrs[key] = obj;
@@ -932,7 +2173,7 @@ if ( [self outputData: d error: &e] == NO ) \
     }
     else
     {
-        NSString * pre = [ctx.elementLocalName stringByAppendingString: @":"];
+        NSString * pre = [_scope.elementLocalName stringByAppendingString: @":"];
         [_attrDecls enumerateKeysAndObjectsUsingBlock: ^(id key, id obj, BOOL *stop) {
             if ( [key hasPrefix: pre] == NO )
                 return;
@@ -970,8 +2211,8 @@ if ( [self outputData: d error: &e] == NO ) \
                 name2 = [name2 substringFromIndex: NSMaxRange(r)];
             }
             
-            NSString * uri1 = ctx.namespaceContext[prefix1];
-            NSString * uri2 = ctx.namespaceContext[prefix2];
+            NSString * uri1 = [_scope URIForPrefix: prefix1];
+            NSString * uri2 = [_scope URIForPrefix: prefix2];
             
             NSComparisonResult cr = [uri1 compare: uri2];
             if ( cr != NSOrderedSame )
@@ -992,60 +2233,63 @@ if ( [self outputData: d error: &e] == NO ) \
                 if ( r.location != NSNotFound )
                 {
                     NSString * pre = [attrName substringToIndex: r.location];
-                    NSString * uri = ctx.namespaceContext[pre];
+                    NSString * uri = [_scope URIForPrefix: pre];
                     NSString * newPrefix = _rewrittenPrefixes[uri];
                     attrName = [newPrefix stringByAppendingFormat: @":%@", [attrName substringFromIndex: NSMaxRange(r)]];
                 }
             }
             
-            value = [self canonicalizeAttributeValue: value forKey: attrName type: 0];
-            NSString * output = [NSString stringWithFormat: @" %@=\"%@\"", attrName, value];
-            WRITE([output dataUsingEncoding: NSUTF8StringEncoding], error);
+            [self appendCanonicalAttribute: attrName value: value type: 0 toData: tag];
         }
     }
     
-    WRITE([NSData dataWithBytesNoCopy: ">" length: 1 freeWhenDone: NO], error);
+    [tag appendBytes: ">" length: 1];
+    WRITE(tag, error);
 }
 
 - (void) parser: (AQXMLParser *) parser didEndElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI qualifiedName: (NSString *) qName
 {
-    if ( _qualifiedContentStartElementInvocation != nil )
-    {
-        // reached the end of the content for an element containing qualified content
-        // process the start element now
-        [_qualifiedContentStartElementInvocation invoke];
-        _qualifiedContentStartElementInvocation = nil;
-        
-        // at this point, the content has been correctly processed and even rewritten
-    }
-    
+    // writes any held start tag first, then the (possibly rewritten) content
     [self outputBufferedChars];
-    _StackContext * ctx = [_stack lastObject];
     
-    @autoreleasepool
+    if ( [self isOutsideSelection] == NO )
     {
-        NSError * error = nil;
-        WRITE([NSData dataWithBytesNoCopy: "</" length: 2 freeWhenDone: NO], error);
-        WRITE([ctx.elementQName dataUsingEncoding: NSUTF8StringEncoding], error);
-        WRITE([NSData dataWithBytesNoCopy: ">" length: 1 freeWhenDone: NO], error);
+        @autoreleasepool
+        {
+            NSError * error = nil;
+            WRITE_BYTES("</", 2, error);
+            WRITE_STRING(_scope.elementQName, error);
+            WRITE_BYTES(">", 1, error);
+        }
     }
     
-    [_stack removeLastObject];
+    if ( _selectionStream != NULL )
+        xmlStreamPop(_selectionStream);
+    if ( _selectedDepth == _scope.depth )
+        _selectedDepth = 0;
+    
+    [_scope popElement];
 }
 
 - (void) parser: (AQXMLParser *) parser foundIgnorableWhitespace: (NSString *) whitespaceString
 {
+    if ( [self isOutsideSelection] )
+        return;
+    
     [self outputBufferedChars];
     
     if ( self.preserveWhitespace )
     {
         NSError * error = nil;
-        WRITE([whitespaceString dataUsingEncoding: NSUTF8StringEncoding], error);
+        WRITE_STRING(whitespaceString, error);
     }
 }
 
 - (void) parser: (AQXMLParser *) parser foundComment: (NSString *) comment
 {
+    if ( [self isOutsideSelection] )
+        return;
+    
     [self outputBufferedChars];
     
     if ( self.preserveComments )
@@ -1053,18 +2297,18 @@ if ( [self outputData: d error: &e] == NO ) \
         @autoreleasepool
         {
             NSError * error = nil;
-            if ( _documentRootEncountered && [_stack count] == 0 )
+            if ( _documentRootEncountered && _scope.depth == 0 )
             {
-                WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+                WRITE_BYTES("\n", 1, error);
             }
             
-            WRITE([NSData dataWithBytesNoCopy: "<!--" length: 4 freeWhenDone: NO], error);
-            WRITE([comment dataUsingEncoding: NSUTF8StringEncoding], error);
-            WRITE([NSData dataWithBytesNoCopy: "-->" length: 3 freeWhenDone: NO], error);
+            WRITE_BYTES("<!--", 4, error);
+            WRITE_STRING(comment, error);
+            WRITE_BYTES("-->", 3, error);
             
             if ( !_documentRootEncountered )
             {
-                WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+                WRITE_BYTES("\n", 1, error);
             }
         }
     }
@@ -1072,6 +2316,9 @@ if ( [self outputData: d error: &e] == NO ) \
 
 - (void) parser: (AQXMLParser *) parser foundProcessingInstructionWithTarget: (NSString *) target data: (NSString *) data
 {
+    if ( [self isOutsideSelection] )
+        return;
+    
     [self outputBufferedChars];
     
     // the XML declaration and document type are removed
@@ -1081,25 +2328,25 @@ if ( [self outputData: d error: &e] == NO ) \
     @autoreleasepool
     {
         NSError * error = nil;
-        if ( _documentRootEncountered && [_stack count] == 0 )
+        if ( _documentRootEncountered && _scope.depth == 0 )
         {
-            WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+            WRITE_BYTES("\n", 1, error);
         }
         
-        WRITE([NSData dataWithBytesNoCopy: "<?" length: 2 freeWhenDone: NO], error);
-        WRITE([target dataUsingEncoding: NSUTF8StringEncoding], error);
+        WRITE_BYTES("<?", 2, error);
+        WRITE_STRING(target, error);
         
         if ( [data length] != 0 )
         {
-            WRITE([NSData dataWithBytesNoCopy: " " length: 1 freeWhenDone: NO], error);
-            WRITE([data dataUsingEncoding: NSUTF8StringEncoding], error);
+            WRITE_BYTES(" ", 1, error);
+            WRITE_STRING(data, error);
         }
         
-        WRITE([NSData dataWithBytesNoCopy: "?>" length: 2 freeWhenDone: NO], error);
+        WRITE_BYTES("?>", 2, error);
         
         if ( !_documentRootEncountered )
         {
-            WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+            WRITE_BYTES("\n", 1, error);
         }
     }
 }
@@ -1112,35 +2359,42 @@ if ( [self outputData: d error: &e] == NO ) \
 
 - (void) parser: (AQXMLParser *) parser foundCharacters: (NSString *) string
 {
+    if ( [self isOutsideSelection] )
+        return;
+    
     // replace certain characters with character entities
-    NSMutableString * mutable = [string mutableCopy];
-    [mutable replaceOccurrencesOfString: @"&" withString: @"&amp;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"<" withString: @"&lt;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @">" withString: @"&gt;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\r" withString: @"&#xD;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\t" withString: @"&#x9;" options: 0 range: NSMakeRange(0, [mutable length])];
+    const char * utf8 = [string UTF8String];
+    NSUInteger length = strlen(utf8);
+    NSMutableData * escaped = [[NSMutableData alloc] initWithCapacity: length + 16];
+    AQXMLAppendCanonicalText(escaped, (const uint8_t *)utf8, length);
     
-    if ( self.preserveWhitespace && _qualifiedContentStartElementInvocation == nil )
+    if ( self.preserveWhitespace && _pendingElementName == nil )
     {
         NSError * error = nil;
-        WRITE([mutable dataUsingEncoding: NSUTF8StringEncoding], error);
+        WRITE(escaped, error);
         return;
     }
     
-    [_runningChars appendString: mutable];
+    NSString * str = [[NSString alloc] initWithBytesNoCopy: [escaped mutableBytes] length: [escaped length]
+                                                  encoding: NSUTF8StringEncoding freeWhenDone: NO];
+    [_runningChars appendString: str];
 }
 
 #pragma mark - DOM Mode
 
-- (void) canonicalizeSubtreeAtNode: (AQXMLNode *) node
+- (void) canonicalizeSubtreeAtNode: (AQXMLNode *) node inScopeOf: (AQXMLNode *) original
 {
-    // collect namespaces
-    if ( node.parent != nil && node != node.document.rootElement )
+    // collect namespaces from the original, as a copy is detached from its ancestors
+    if ( original.parent != nil && original != original.document.rootElement )
     {
-        (void) [self newStackContext];
-        [self addNamespaces: node];
+        [_scope pushElement: nil];
+        [self addNamespaces: original];
     }
     
+    // starting within the document element
+    if ( node.type == AQXMLNodeTypeElement )
+        _documentRootEncountered = YES;
+    
     [self processNode: node];
 }
 
@@ -1193,29 +2447,36 @@ if ( [self outputData: d error: &e] == NO ) \
     if ( self.isNodeVisible != nil && self.isNodeVisible(element) == NO )
         return;
     
-    _StackContext * ctx = [self newStackContext];
-    ctx.elementQName = element.qualifiedName;
+    [_scope pushElement: element.qualifiedName];
     [element consolidateConsecutiveTextNodes];
     NSDictionary * nsToBeOutput = [self processNamespaces: element];
     
     NSError * error = nil;
-    WRITE([NSData dataWithBytes: "<" length: 1], error);
+    NSMutableData * tag = [[NSMutableData alloc] initWithCapacity: 256];
+    [tag appendBytes: "<" length: 1];
     
-    NSString * qName = ctx.elementQName;
+    NSString * qName = _scope.elementQName;
     if ( self.rewritePrefixes )
-        qName = [NSString stringWithFormat: @"%@:%@", _rewrittenPrefixes[ctx.elementPrefix], ctx.elementLocalName];
+        qName = [NSString stringWithFormat: @"%@:%@", _rewrittenPrefixes[_scope.elementPrefix], _scope.elementLocalName];
     
-    WRITE([qName dataUsingEncoding: NSUTF8StringEncoding], error);
+    _AppendString(tag, qName);
     
     NSArray * namespaceKeys = [[nsToBeOutput allKeys] sortedArrayUsingSelector: @selector(compare:)];
     for ( NSString * prefix in namespaceKeys )
     {
-        NSString * output = nil;
         if ( [prefix length] == 0 )
-            output = [NSString stringWithFormat: @" xmlns=\"%@\"", nsToBeOutput[prefix]];
+        {
+            [tag appendBytes: " xmlns=\"" length: 8];
+        }
         else
-            output = [NSString stringWithFormat: @" xmlns:%@=\"%@\"", prefix, nsToBeOutput[prefix]];
-        WRITE([output dataUsingEncoding: NSUTF8StringEncoding], error);
+        {
+            [tag appendBytes: " xmlns:" length: 7];
+            _AppendString(tag, prefix);
+            [tag appendBytes: "=\"" length: 2];
+        }
+        
+        _AppendString(tag, nsToBeOutput[prefix]);
+        [tag appendBytes: "\"" length: 1];
     }
     
     @autoreleasepool
@@ -1239,8 +2500,8 @@ if ( [self outputData: d error: &e] == NO ) \
                 name2 = [name2 substringFromIndex: NSMaxRange(r)];
             }
             
-            NSString * uri1 = ctx.namespaceContext[prefix1];
-            NSString * uri2 = ctx.namespaceContext[prefix2];
+            NSString * uri1 = [_scope URIForPrefix: prefix1];
+            NSString * uri2 = [_scope URIForPrefix: prefix2];
             
             NSComparisonResult cr = [uri1 compare: uri2];
             if ( cr != NSOrderedSame )
@@ -1262,31 +2523,28 @@ if ( [self outputData: d error: &e] == NO ) \
                 if ( r.location != NSNotFound )
                 {
                     NSString * pre = [attrName substringToIndex: r.location];
-                    NSString * uri = ctx.namespaceContext[pre];
+                    NSString * uri = [_scope URIForPrefix: pre];
                     NSString * newPrefix = _rewrittenPrefixes[uri];
                     attrName = [newPrefix stringByAppendingFormat: @":%@", [attrName substringFromIndex: NSMaxRange(r)]];
                 }
             }
             
-            value = [self canonicalizeAttributeValue: value
-                                              forKey: attrName
-                                                type: attr.attributeType];
-            NSString * output = [NSString stringWithFormat: @" %@=\"%@\"", attrName, value];
-            WRITE([output dataUsingEncoding: NSUTF8StringEncoding], error);
+            [self appendCanonicalAttribute: attrName value: value type: attr.attributeType toData: tag];
         }
     }
     
-    WRITE([NSData dataWithBytesNoCopy: ">" length: 1 freeWhenDone: NO], error);
+    [tag appendBytes: ">" length: 1];
+    WRITE(tag, error);
     
     [element enumerateChildrenUsingBlock: ^(AQXMLNode *child, NSUInteger idx, BOOL *stop) {
         [self processNode: child];
     }];
     
-    WRITE([NSData dataWithBytes: "</" length: 2], error);
-    WRITE([qName dataUsingEncoding: NSUTF8StringEncoding], error);
-    WRITE([NSData dataWithBytes: ">" length: 1], error);
+    WRITE_BYTES("</", 2, error);
+    WRITE_STRING(qName, error);
+    WRITE_BYTES(">", 1, error);
     
-    [_stack removeLastObject];
+    [_scope popElement];
 }
 
 - (void) processComment: (AQXMLNode *) commentNode
@@ -1296,18 +2554,18 @@ if ( [self outputData: d error: &e] == NO ) \
         @autoreleasepool
         {
             NSError * error = nil;
-            if ( _documentRootEncountered && [_stack count] == 0 )
+            if ( _documentRootEncountered && _scope.depth == 0 )
             {
-                WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+                WRITE_BYTES("\n", 1, error);
             }
             
-            WRITE([NSData dataWithBytesNoCopy: "<!--" length: 4 freeWhenDone: NO], error);
-            WRITE([commentNode.content dataUsingEncoding: NSUTF8StringEncoding], error);
-            WRITE([NSData dataWithBytesNoCopy: "-->" length: 3 freeWhenDone: NO], error);
+            WRITE_BYTES("<!--", 4, error);
+            WRITE_STRING(commentNode.content, error);
+            WRITE_BYTES("-->", 3, error);
             
             if ( !_documentRootEncountered )
             {
-                WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+                WRITE_BYTES("\n", 1, error);
             }
         }
     }
@@ -1322,25 +2580,25 @@ if ( [self outputData: d error: &e] == NO ) \
     @autoreleasepool
     {
         NSError * error = nil;
-        if ( _documentRootEncountered && [_stack count] == 0 )
+        if ( _documentRootEncountered && _scope.depth == 0 )
         {
-            WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+            WRITE_BYTES("\n", 1, error);
         }
         
-        WRITE([NSData dataWithBytesNoCopy: "<?" length: 2 freeWhenDone: NO], error);
-        WRITE([PINode.name dataUsingEncoding: NSUTF8StringEncoding], error);
+        WRITE_BYTES("<?", 2, error);
+        WRITE_STRING(PINode.name, error);
         
         if ( [PINode.content length] != 0 )
         {
-            WRITE([NSData dataWithBytesNoCopy: " " length: 1 freeWhenDone: NO], error);
-            WRITE([PINode.content dataUsingEncoding: NSUTF8StringEncoding], error);
+            WRITE_BYTES(" ", 1, error);
+            WRITE_STRING(PINode.content, error);
         }
         
-        WRITE([NSData dataWithBytesNoCopy: "?>" length: 2 freeWhenDone: NO], error);
+        WRITE_BYTES("?>", 2, error);
         
         if ( !_documentRootEncountered )
         {
-            WRITE([NSData dataWithBytesNoCopy: "\n" length: 1 freeWhenDone: NO], error);
+            WRITE_BYTES("\n", 1, error);
         }
     }
 }
@@ -1354,50 +2612,37 @@ if ( [self outputData: d error: &e] == NO ) \
 - (void) processText: (AQXMLNode *) textNode
 {
     // we know that we've already consolidated adjacent text nodes
-    NSMutableString * mutable = [textNode.content mutableCopy];
-    
+    const char * utf8 = [textNode.content UTF8String];
+    NSRange r = NSMakeRange(0, (utf8 == NULL ? 0 : strlen(utf8)));
     if ( self.preserveWhitespace == NO )
-        mutable = [[mutable stringByTrimmingCharactersInSet: [NSCharacterSet whitespaceAndNewlineCharacterSet]] mutableCopy];
+        r = AQXMLTrimmedWhitespaceRange((const uint8_t *)utf8, r.length);
     
     // replace certain characters with character entities
-    [mutable replaceOccurrencesOfString: @"&" withString: @"&amp;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"<" withString: @"&lt;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @">" withString: @"&gt;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\r" withString: @"&#xD;" options: 0 range: NSMakeRange(0, [mutable length])];
-    [mutable replaceOccurrencesOfString: @"\t" withString: @"&#x9;" options: 0 range: NSMakeRange(0, [mutable length])];
+    NSMutableData * escaped = [[NSMutableData alloc] initWithCapacity: r.length + 16];
+    AQXMLAppendCanonicalText(escaped, (const uint8_t *)utf8 + r.location, r.length);
     
     NSError * error = nil;
-    WRITE([mutable dataUsingEncoding: NSUTF8StringEncoding], error);
+    WRITE(escaped, error);
 }
 
 - (void) addNamespaces: (AQXMLNode *) element
 {
-    _StackContext * ctx = [_stack lastObject];
     for ( AQXMLNamespace * ns in element.namespacesInScope )
     {
         NSString * uri = [ns.uri absoluteString];
-        NSString * currentURI = ctx.namespaceContext[ns.prefix];
-        
-        if ( [currentURI isEqualToString: uri] )
-        {
+        if ( [[_scope URIForPrefix: ns.prefix] isEqualToString: uri] )
             continue;
-        }
-        else if ( currentURI != nil )
-        {
-            [ctx.outputPrefixes removeObject: ns.prefix];
-        }
         
-        ctx.namespaceContext[ns.prefix] = uri;
+        [_scope bindPrefix: ns.prefix toURI: uri];
     }
 }
 
 - (NSDictionary *) processNamespaces: (AQXMLElement *) element
 {
-    _StackContext * ctx = [_stack lastObject];
     [self addNamespaces: element];
     
     BOOL isQNameAware = NO;
-    if ( _qnameAwareElements[ctx.elementLocalName] != nil || _qnameAwareXPathElements[ctx.elementLocalName] != nil )
+    if ( _qnameAwareElements[_scope.elementLocalName] != nil || _qnameAwareXPathElements[_scope.elementLocalName] != nil )
     {
         [_runningChars setString: element.firstChild.content];
         isQNameAware = YES;
@@ -1405,7 +2650,7 @@ if ( [self outputData: d error: &e] == NO ) \
     
     NSMutableDictionary * allAttrs = [element.attributes mutableCopy];
     
-    NSDictionary * nsToBeOutputList = [self visiblyUsedNamespacesInContext: ctx fromAttributes: allAttrs];
+    NSDictionary * nsToBeOutputList = [self visiblyUsedNamespacesFromAttributes: allAttrs];
     if ( self.rewritePrefixes )
     {
         if ( isQNameAware )
@@ -51,8 +51,9 @@
 
 + (AQXMLDocument *) documentWithXMLDocument: (xmlDocPtr) doc
 {
-    if ( doc->_private != NULL )
-        return ( (__bridge AQXMLDocument *)doc->_private );
+    AQXMLDocument * existing = AQXMLPublishedWrapper(&doc->_private);
+    if ( existing != nil )
+        return ( existing );
     
     return ( [[self alloc] initWithXMLDocument: doc] );
 }
@@ -64,10 +65,7 @@
 
 - (AQXMLElement *) rootElement
 {
-    xmlNodePtr node = xmlDocGetRootElement(self.xmlObj);
-    if ( node == NULL )
-        return ( nil );
-    return ( (__bridge AQXMLElement *)node->_private );
+    return ( AQXMLWrapperForNode(xmlDocGetRootElement(self.xmlObj)) );
 }
 
 - (void) setRootElement: (AQXMLElement *) rootElement
@@ -93,7 +91,7 @@
 
 + (AQXMLDocument *) documentWithXMLData: (NSData *) data error: (NSError **) error
 {
-    return ( [AQXMLReader parseXML: [data bytes] length: [data length] error: error] );
+    return ( [AQXMLReader parseXMLData: data error: error] );
 }
 
 + (AQXMLDocument *) documentWithXMLString: (NSString *) string error: (NSError **) error
@@ -113,7 +111,7 @@
     xmlDocPtr node = xmlNewDoc((const xmlChar *)"1.0");
     if ( node == NULL )
         return ( nil );
-    return ( (__bridge AQXMLDocument *)node->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)node) );
 }
 
 + (AQXMLDocument *) documentWithRootElement: (AQXMLElement *) root
@@ -186,7 +184,7 @@
 {
     xmlDtdPtr newDTD = xmlNewDtd(self.xmlObj, [name xmlString],
                                  [externalID xmlString], [systemID xmlString]);
-    return ( (__bridge AQXMLDTDNode *)newDTD->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)newDTD) );
 }
 
 - (AQXMLDTDNode *) createInternalSubsetWithName: (NSString *) name
@@ -195,7 +193,7 @@
 {
     xmlDtdPtr newDTD = xmlCreateIntSubset(self.xmlObj, [name xmlString],
                                           [externalID xmlString], [systemID xmlString]);
-    return ( (__bridge AQXMLDTDNode *)newDTD->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)newDTD) );
 }
 
 - (AQXMLAttribute *) addAttributeWithName: (NSString *) name
@@ -204,7 +202,7 @@
     xmlAttrPtr node = xmlNewDocProp(self.xmlObj, [name xmlString], [value xmlString]);
     if ( node == NULL )
         return ( nil );
-    return ( (__bridge AQXMLAttribute *)node->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)node) );
 }
 
 - (AQXMLAttribute *) attributeWithName: (NSString *) name
@@ -212,7 +210,7 @@
     xmlAttrPtr node = xmlHasProp((xmlNodePtr)self.xmlObj, [name xmlString]);
     if ( node == NULL )
         return ( nil );
-    return ( (__bridge AQXMLAttribute *)node->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)node) );
 }
 
 - (void) removeAttribute: (NSString *) name
@@ -78,7 +78,9 @@
     if ( self == nil )
         return ( nil );
     
-    _enumerationSemaphore = dispatch_semaphore_create(1);
+    // we may have been handed an existing wrapper, which already has one of these
+    if ( _enumerationSemaphore == NULL )
+        _enumerationSemaphore = dispatch_semaphore_create(1);
     
     return ( self );
 }
@@ -117,15 +119,7 @@
     xmlNodePtr child = self.xmlObj->children;
     while ( child != NULL )
     {
-        if ( child->_private != NULL )
-        {
-            [children addObject: (__bridge id)child->_private];
-        }
-        else
-        {
-            AQXMLNode * node = [AQXMLNode nodeWithXMLNode: child];
-            [children addObject: node];
-        }
+        [children addObject: AQXMLWrapperForNode(child)];
         
         child = child->next;
     }
@@ -164,13 +158,7 @@
     NSUInteger idx = 1;
     
     void (^perChild)(xmlNodePtr, NSUInteger, BOOL*) = ^(xmlNodePtr child, NSUInteger i, BOOL *stop){
-        AQXMLNode * node = nil;
-        if ( child->_private != NULL )
-            node = (__bridge AQXMLNode *)child->_private;
-        else
-            node = [AQXMLNode nodeWithXMLNode: child];
-        
-        block(node, i, stop);
+        block(AQXMLWrapperForNode(child), i, stop);
     };
     
     if ( options == 0 )
@@ -240,26 +228,12 @@
 
 - (AQXMLNode *) firstChild
 {
-    xmlNodePtr n = self.xmlObj->children;
-    if ( n == NULL )
-        return ( nil );
-    
-    if ( n->_private != NULL )
-        return ( (__bridge AQXMLNode *)n->_private );
-    
-    return ( [AQXMLNode nodeWithXMLNode: n] );
+    return ( AQXMLWrapperForNode(self.xmlObj->children) );
 }
 
 - (AQXMLNode *) lastChild
 {
-    xmlNodePtr n = xmlGetLastChild(self.xmlObj);
-    if ( n == NULL )
-        return ( nil );
-    
-    if ( n->_private != NULL )
-        return ( (__bridge AQXMLNode *)n->_private );
-    
-    return ( [AQXMLNode nodeWithXMLNode: n] );
+    return ( AQXMLWrapperForNode(xmlGetLastChild(self.xmlObj)) );
 }
 
 - (AQXMLNode *) childAtIndex: (NSUInteger) idx
@@ -282,10 +256,7 @@
         [NSException raise: NSRangeException format: @"-[%@ %@]: Index %lu outside range {1,%lu}", NSStringFromClass([self class]), NSStringFromSelector(_cmd), (unsigned long)idx, (unsigned long)curIdx-1];
     }
     
-    if ( child->_private != NULL )
-        return ( (__bridge AQXMLNode *)child->_private );
-    
-    return ( [AQXMLNode nodeWithXMLNode: child] );
+    return ( AQXMLWrapperForNode(child) );
 }
 
 - (NSString *) qualifiedName
@@ -357,11 +328,11 @@
             {
                 if ( prefix == nil )
                 {
-                    return ( (__bridge AQXMLElement *)xml->_private );
+                    return ( AQXMLWrapperForNode(xml) );
                 }
                 else if ( xml->ns != NULL  && xmlStrEqual([prefix xmlString], xml->ns->prefix) )
                 {
-                    return ( (__bridge AQXMLElement *)xml->_private );
+                    return ( AQXMLWrapperForNode(xml) );
                 }
             }
         }
@@ -491,7 +462,7 @@
 {
     [node detach];
     xmlNodePtr newNode = xmlAddChild(self.xmlObj, node.xmlObj);
-    return ( (__bridge AQXMLNode *)newNode->_private );
+    return ( AQXMLWrapperForNode(newNode) );
 }
 
 - (AQXMLNode *) _addRawChild: (xmlNodePtr) rawNode
@@ -552,9 +523,9 @@
                 // ideally we'd use xmlTextMerge(), but since that might delete an
                 //  xmlNodePtr out from underneath an ObjC object, we inline it
                 xmlNodeAddContent(prior, child->content);
-                if ( child->_private != NULL )
+                AQXMLNode * dead = AQXMLPublishedWrapper(&child->_private);
+                if ( dead != nil )
                 {
-                    AQXMLNode * dead = (__bridge AQXMLNode *)child->_private;
                     [dead detach];
                     // leave the xmlNodePtr around, it'll be deleted when the wrapper deallocates
                 }
@@ -592,10 +563,7 @@
     if ( attr == NULL )
         return ( nil );
     
-    if ( attr->_private != NULL )
-        return ( (__bridge AQXMLAttribute *)attr->_private );
-    
-    return ( [AQXMLAttribute attributeWithXMLNode: attr] );
+    return ( AQXMLWrapperForNode((xmlNodePtr)attr) );
 }
 
 - (AQXMLAttribute *) addAttributeNamed: (NSString *) attributeName withValue: (NSString *) attributeValue
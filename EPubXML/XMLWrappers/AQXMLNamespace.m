@@ -39,10 +39,14 @@
 #import "AQXMLDocument.h"
 #import "AQXMLUtilities.h"
 #import "AQXML_Private.h"
+#import <libxml/xpath.h>
+#import <libxml/xpathInternals.h>
 
 @implementation AQXMLNamespace
 {
     xmlNsPtr    _ns;
+    void *      _weakCell;
+    BOOL        _ownsSetEntry;
 }
 
 + (AQXMLNamespace *) namespaceWithXMLNamespace: (xmlNsPtr) ns
@@ -50,6 +54,11 @@
     return ( [[self alloc] initWithXMLNamespace: ns] );
 }
 
++ (AQXMLNamespace *) namespaceWithNodeSetEntry: (xmlNsPtr) ns
+{
+    return ( [[self alloc] initWithNodeSetEntry: ns] );
+}
+
 + (AQXMLNamespace *) namespaceWithNode: (AQXMLNode *) node
                                    URI: (NSString *) uri
                                 prefix: (NSString *) prefix
@@ -79,15 +88,44 @@
         return ( nil );
     
     _ns = ns;
-    if ( _ns->_private == NULL )
-        _ns->_private = (void *)CFBridgingRetain(self);
+    
+    id wrapper = AQXMLPublishWrapper(&ns->_private, self, &_weakCell);
+    if ( wrapper != self )
+    {
+        [self invalidate];
+        return ( wrapper );
+    }
     
     return ( self );
 }
 
+- (id) initWithNodeSetEntry: (xmlNsPtr) ns
+{
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    // the set may free its entry at any time, so hold a copy shaped the same way:
+    // its 'next' still names the owning element, so set lookups match it
+    _ns = xmlXPathNodeSetDupNs((xmlNodePtr)ns->next, ns);
+    if ( _ns == NULL )
+        return ( nil );
+    
+    _ownsSetEntry = YES;
+    return ( self );
+}
+
 - (void) dealloc
 {
-    if ( _valid == NO )
+    if ( _ownsSetEntry )
+    {
+        xmlXPathNodeSetFreeNs(_ns);
+        return;
+    }
+    
+    AQXMLRetireWrapperCell(_weakCell);
+    
+    if ( _valid == NO || _weakCell != NULL )
         return;
     
     _ns->_private = NULL;
@@ -44,10 +44,13 @@
 #import <libxml/xmlmemory.h>
 #import <libxml/tree.h>
 #import <libxml/xmlsave.h>
+#import "xml_arena.h"
 
 @implementation AQXMLNode
 {
-    xmlNodePtr  _node;
+    xmlNodePtr      _node;
+    void *          _weakCell;
+    AQXMLDocument * _arenaDocument;
 }
 
 + (AQXMLNode *) nodeWithString: (NSString *) string
@@ -138,17 +141,45 @@
         return ( nil );
     
     _node = node;
-    if ( node->_private == NULL )
-        node->_private = (void *)CFBridgingRetain(self);
+    
+    // publish ourselves as the node's wrapper; if someone else got there first, use theirs
+    id wrapper = AQXMLPublishWrapper(&node->_private, self, &_weakCell);
+    if ( wrapper != self )
+    {
+        [self invalidate];
+        return ( wrapper );
+    }
+    
+    // an arena-backed node doesn't own its wrapper, so the wrapper owns the tree instead
+    if ( _weakCell != NULL && node->doc != NULL && (xmlNodePtr)node->doc != node )
+        _arenaDocument = AQXMLWrapperForNode((xmlNodePtr)node->doc);
     
     return ( self );
 }
 
 - (void) dealloc
 {
+    // this must happen before _arenaDocument (and possibly the arena) goes away
+    AQXMLRetireWrapperCell(_weakCell);
+    
     if ( _valid == NO )
         return;
     
+    if ( _weakCell != NULL )
+    {
+        // arena trees are released all at once, along with their document
+        if ( _node == (xmlNodePtr)_node->doc )
+        {
+            // libxml still has to free what lives outside the arena (nodes added since the parse,
+            // the dictionary & its lock); the free hook passes over everything inside it
+            AQXMLArena * arena = AQXMLArenaForPointer(_node);
+            _node->_private = NULL;
+            xmlFreeDoc((xmlDocPtr)_node);
+            AQXMLArenaDestroy(arena);
+        }
+        return;
+    }
+    
     _node->_private = NULL;
     
     // only free if it's not linked to any other nodes
@@ -168,8 +199,7 @@
         return ( nil );
     
     xmlNodePtr copyNode = xmlCopyNode(_node, 1);
-    // the corresponding ObjC class is created by the node registration callback
-    return ( (__bridge AQXMLNode *)copyNode->_private );
+    return ( AQXMLWrapperForNode(copyNode) );
 }
 
 - (xmlNodePtr) xmlObj
@@ -261,12 +291,7 @@
             break;
     }
     
-    if ( _node->ns == NULL )
-        return ( nil );
-    if ( _node->ns->_private != NULL )
-        return ( (__bridge AQXMLNamespace *)self.xmlObj->ns->_private );
-    
-    return ( [AQXMLNamespace namespaceWithXMLNamespace: self.xmlObj->ns] );
+    return ( AQXMLWrapperForNamespace(_node->ns, _node->doc) );
 }
 
 - (void) setNs: (AQXMLNamespace *) ns
@@ -283,7 +308,7 @@
     NSMutableArray * result = [NSMutableArray new];
     for ( int i = 0; pNamespaces[i] != NULL; i++ )
     {
-        [result addObject: (__bridge AQXMLNamespace *)pNamespaces[i]->_private];
+        [result addObject: AQXMLWrapperForNamespace(pNamespaces[i], _node->doc)];
     }
     
     xmlMemFree(pNamespaces);
@@ -323,22 +348,12 @@
 
 - (AQXMLElement *) parent
 {
-    xmlNodePtr xmlParent = _node->parent;
-    if ( xmlParent == NULL )
-        return ( nil );
-    
-    if ( xmlParent->_private != nil )
-        return ( (__bridge AQXMLElement *)xmlParent->_private );
-    
-    return ( [AQXMLElement elementWithXMLNode: xmlParent] );
+    return ( AQXMLWrapperForNode(_node->parent) );
 }
 
 - (AQXMLDocument *) document
 {
-    xmlDocPtr doc = _node->doc;
-    if ( doc == NULL )
-        return ( nil );
-    return ( (__bridge AQXMLDocument *)doc->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)_node->doc) );
 }
 
 - (AQXMLNode *) nextNode
@@ -351,14 +366,7 @@
 
 - (AQXMLNode *) nextSibling
 {
-    xmlNodePtr next = _node->next;
-    if ( next == NULL )
-        return ( nil );
-    
-    if ( next->_private != NULL )
-        return ( (__bridge AQXMLNode *)next->_private );
-    
-    return ( [AQXMLNode nodeWithXMLNode: next] );
+    return ( AQXMLWrapperForNode(_node->next) );
 }
 
 - (AQXMLNode *) previousNode
@@ -372,14 +380,7 @@
 
 - (AQXMLNode *) previousSibling
 {
-    xmlNodePtr previous = _node->prev;
-    if ( previous == NULL )
-        return ( nil );
-    
-    if ( previous->_private != NULL )
-        return ( (__bridge AQXMLNode *)previous->_private );
-    
-    return ( [AQXMLNode nodeWithXMLNode: previous] );
+    return ( AQXMLWrapperForNode(_node->prev) );
 }
 
 - (AQXMLElement *) rootElement
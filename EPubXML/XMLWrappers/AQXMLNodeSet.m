@@ -40,9 +40,78 @@
 #import <libxml/xpath.h>
 #import <libxml/xpathInternals.h>
 
+// The visibility index hashes nodes by address. Namespace nodes in a node set are
+// copies whose 'next' field holds the owning element, so those are matched on that
+// element and their prefix, as xmlXPathNodeSetContains() does.
+static Boolean __index_equal(const void * value1, const void * value2)
+{
+    if ( value1 == value2 )
+        return ( true );
+    
+    const xmlNs * ns1 = value1, * ns2 = value2;
+    if ( ns1->type != XML_NAMESPACE_DECL || ns2->type != XML_NAMESPACE_DECL )
+        return ( false );
+    
+    return ( ns1->next != NULL && ns1->next == ns2->next && xmlStrEqual(ns1->prefix, ns2->prefix) );
+}
+
+static CFHashCode __index_hash(const void * value)
+{
+    const xmlNs * ns = value;
+    if ( ns->type != XML_NAMESPACE_DECL )
+        return ( (CFHashCode)((uintptr_t)value >> 4) );
+    
+    CFHashCode hash = (CFHashCode)((uintptr_t)ns->next >> 4);
+    for ( const xmlChar * p = ns->prefix; p != NULL && *p != 0; p++ )
+        hash = (hash * 31) + *p;
+    return ( hash );
+}
+
+int AQXMLNodeSetIsVisibleCallback(void * index, xmlNodePtr node, xmlNodePtr parent)
+{
+    if ( index == NULL || node == NULL )
+        return ( 1 );
+    
+    if ( node->type != XML_NAMESPACE_DECL )
+        return ( CFSetContainsValue((CFSetRef)index, node) ? 1 : 0 );
+    
+    // libxml hands us the original namespace, so build a key shaped like the set's copies
+    xmlNs ns;
+    memcpy(&ns, node, sizeof(ns));
+    if ( parent != NULL && parent->type == XML_ATTRIBUTE_NODE )
+        ns.next = (xmlNsPtr)parent->parent;
+    else
+        ns.next = (xmlNsPtr)parent;
+    
+    return ( CFSetContainsValue((CFSetRef)index, &ns) ? 1 : 0 );
+}
+
+// The set holds a copy of a namespace for each element it's in scope on, while a wrapper
+// usually holds the declaration itself; it's contained if one of those elements sees it.
+static BOOL __contains_declaration(xmlNodeSetPtr set, xmlNsPtr ns)
+{
+    // the xml namespace is never declared, and looking it up would add it to the document
+    if ( set == NULL || xmlStrEqual(ns->prefix, BAD_CAST "xml") )
+        return ( NO );
+    
+    for ( int i = 0; i < set->nodeNr; i++ )
+    {
+        xmlNsPtr entry = (xmlNsPtr)set->nodeTab[i];
+        if ( entry->type != XML_NAMESPACE_DECL || xmlStrEqual(entry->prefix, ns->prefix) == 0 )
+            continue;
+        
+        xmlNodePtr owner = (xmlNodePtr)entry->next;
+        if ( owner != NULL && owner->type == XML_ELEMENT_NODE && xmlSearchNs(owner->doc, owner, ns->prefix) == ns )
+            return ( YES );
+    }
+    
+    return ( NO );
+}
+
 @implementation AQXMLNodeSet
 {
-    xmlNodeSetPtr   _nodeSet;
+    xmlNodeSetPtr       _nodeSet;
+    CFMutableSetRef     _index;     // built on demand, dropped on mutation
 }
 
 + (AQXMLNodeSet *) nodeSetWithXMLNodeSet: (xmlNodeSetPtr) nodeSet
@@ -109,10 +178,36 @@
 
 - (void) dealloc
 {
+    if ( _index != NULL )
+        CFRelease(_index);
     xmlXPathFreeNodeSet(_nodeSet);
     _nodeSet = NULL;
 }
 
+- (CFSetRef) visibilityIndex
+{
+    if ( _index != NULL )
+        return ( _index );
+    
+    CFSetCallBacks callbacks = { 0, NULL, NULL, NULL, &__index_equal, &__index_hash };
+    _index = CFSetCreateMutable(kCFAllocatorDefault, _nodeSet->nodeNr, &callbacks);
+    for ( int i = 0; i < _nodeSet->nodeNr; i++ )
+    {
+        CFSetAddValue(_index, _nodeSet->nodeTab[i]);
+    }
+    
+    return ( _index );
+}
+
+- (void) invalidateIndex
+{
+    if ( _index == NULL )
+        return;
+    
+    CFRelease(_index);
+    _index = NULL;
+}
+
 - (id) copyWithZone: (NSZone *) zone
 {
     AQXMLNodeSet * result = [AQXMLNodeSet new];
@@ -130,7 +225,7 @@
     NSMutableArray * nodes = [NSMutableArray new];
     for ( int i = 0; i < _nodeSet->nodeNr; i++ )
     {
-        [nodes addObject: (__bridge AQXMLNode *)_nodeSet->nodeTab[i]->_private];
+        [nodes addObject: AQXMLWrapperForNode(_nodeSet->nodeTab[i])];
     }
     return ( nodes );
 }
@@ -140,7 +235,7 @@
     if ( idx >= _nodeSet->nodeNr )
         [NSException raise: NSRangeException format: @"AQXMLNodeSet: Index %lu beyond bounds (0 .. %d)", idx, _nodeSet->nodeNr];
     
-    return ( (__bridge AQXMLNode *)_nodeSet->nodeTab[idx]->_private );
+    return ( AQXMLWrapperForNode(_nodeSet->nodeTab[idx]) );
 }
 
 - (AQXMLNode *) objectAtIndexedSubscript: (NSUInteger) idx
@@ -148,7 +243,7 @@
     if ( idx >= _nodeSet->nodeNr )
         [NSException raise: NSRangeException format: @"AQXMLNodeSet: Index %lu beyond bounds (0 .. %d)", idx, _nodeSet->nodeNr];
     
-    return ( (__bridge AQXMLNode *)_nodeSet->nodeTab[idx]->_private );
+    return ( AQXMLWrapperForNode(_nodeSet->nodeTab[idx]) );
 }
 
 - (BOOL) boolValue
@@ -189,6 +284,7 @@
 
 - (void) addNode: (AQXMLNode *) node
 {
+    [self invalidateIndex];
     xmlXPathNodeSetAdd(_nodeSet, node.xmlObj);
     AQXMLNamespace * ns = node.ns;
     if ( ns != nil )
@@ -197,16 +293,44 @@
 
 - (void) removeNode: (AQXMLNode *) node
 {
-    xmlXPathNodeSetDel(_nodeSet, node.xmlObj);
+    xmlNodePtr xmlNode = node.xmlObj;
+    if ( xmlNode == NULL )
+        return;
+    
+    [self invalidateIndex];
+    if ( xmlNode->type != XML_NAMESPACE_DECL )
+    {
+        xmlXPathNodeSetDel(_nodeSet, xmlNode);
+        return;
+    }
+    
+    // a namespace wrapper doesn't hold the set's own entry, so match on owner & prefix
+    for ( int i = 0; i < _nodeSet->nodeNr; i++ )
+    {
+        if ( __index_equal(_nodeSet->nodeTab[i], xmlNode) )
+        {
+            xmlXPathNodeSetRemove(_nodeSet, i);
+            break;
+        }
+    }
 }
 
 - (BOOL) containsNode: (AQXMLNode *) node
 {
-    return ( xmlXPathNodeSetContains(_nodeSet, node.xmlObj) == 1 );
+    xmlNodePtr xmlNode = node.xmlObj;
+    if ( xmlNode == NULL )
+        return ( NO );
+    
+    // a namespace wrapper holds the original namespace rather than one of our copies
+    if ( xmlNode->type == XML_NAMESPACE_DECL )
+        return ( xmlXPathNodeSetContains(_nodeSet, xmlNode) == 1 || __contains_declaration(_nodeSet, (xmlNsPtr)xmlNode) );
+    
+    return ( CFSetContainsValue([self visibilityIndex], xmlNode) );
 }
 
 - (void) addUniqueNode: (AQXMLNode *) node
 {
+    [self invalidateIndex];
     xmlXPathNodeSetAddUnique(_nodeSet, node.xmlObj);
     AQXMLNamespace * ns = node.ns;
     if ( ns != nil )
@@ -215,23 +339,42 @@
 
 - (void) unionSet: (AQXMLNodeSet *) set
 {
+    [self invalidateIndex];
     _nodeSet = xmlXPathNodeSetMerge(_nodeSet, set->_nodeSet);
 }
 
+// Entries are tested & removed in place, last first, so removing one never shifts an
+// entry still to be visited, and no wrappers are built for namespace copies on the way.
+- (void) filterEntriesAgainstSet: (AQXMLNodeSet *) set keepingContained: (BOOL) keepContained
+{
+    // our own index can't be consulted while the namespace copies in it are being freed
+    if ( set == self )
+    {
+        [self invalidateIndex];
+        while ( keepContained == NO && _nodeSet->nodeNr > 0 )
+            xmlXPathNodeSetRemove(_nodeSet, _nodeSet->nodeNr - 1);
+        return;
+    }
+    
+    CFSetRef index = [set visibilityIndex];
+    [self invalidateIndex];
+    
+    for ( int i = _nodeSet->nodeNr - 1; i >= 0; i-- )
+    {
+        BOOL contained = CFSetContainsValue(index, _nodeSet->nodeTab[i]);
+        if ( contained != keepContained )
+            xmlXPathNodeSetRemove(_nodeSet, i);
+    }
+}
+
 - (void) intersectSet: (AQXMLNodeSet *) set
 {
-    [self enumerateNodesUsingBlock: ^(AQXMLNode *node, BOOL *stop) {
-        if ( [set containsNode: node] == NO )
-            [self removeNode: node];
-    }];
+    [self filterEntriesAgainstSet: set keepingContained: YES];
 }
 
 - (void) subtractSet: (AQXMLNodeSet *) set
 {
-    [self enumerateNodesUsingBlock: ^(AQXMLNode *node, BOOL *stop) {
-        if ( [set containsNode: node] )
-            [self removeNode: node];
-    }];
+    [self filterEntriesAgainstSet: set keepingContained: NO];
 }
 
 #if NS_BLOCKS_AVAILABLE
@@ -242,7 +385,7 @@
     for ( int i = 0; i < _nodeSet->nodeNr; i++ )
     {
         BOOL stop = NO;
-        AQXMLNode * node = (__bridge AQXMLNode *)_nodeSet->nodeTab[i]->_private;
+        AQXMLNode * node = AQXMLWrapperForNode(_nodeSet->nodeTab[i]);
         if ( node != nil )
             block(node, &stop);
         if ( stop )
@@ -38,10 +38,28 @@
 
 @class AQXMLDocument;
 
+typedef NS_OPTIONS(NSUInteger, AQXMLReaderOptions) {
+    AQXMLReaderOptionsNone          = 0,
+    
+    // Builds the whole tree in a private arena, released in one go when the document
+    // is deallocated. Nodes from such a document must not be moved into another one.
+    // Ignored when the library is built with AQXML_USE_ARENA_ALLOCATOR=0.
+    AQXMLReaderUseArenaAllocator    = 1 << 0
+};
+
 @interface AQXMLReader : NSObject
 
 + (AQXMLDocument *) parseXMLFileAtURL: (NSURL *) url error: (NSError **) error;
 + (AQXMLDocument *) parseXMLString: (NSString *) string error: (NSError **) error;
++ (AQXMLDocument *) parseXMLData: (NSData *) data error: (NSError **) error;
 + (AQXMLDocument *) parseXML: (const char *) xml length: (NSUInteger) length error: (NSError **) error;
 
++ (AQXMLDocument *) parseXMLData: (NSData *) data options: (AQXMLReaderOptions) options error: (NSError **) error;
++ (AQXMLDocument *) parseXML: (const char *) xml length: (NSUInteger) length
+                     options: (AQXMLReaderOptions) options error: (NSError **) error;
+
+// Parses each input (NSURL or NSData) concurrently on up to maxConcurrency worker threads,
+// or one per active CPU if zero. Returns an AQXMLDocument or NSError for each input, in input order.
++ (NSArray *) parseXMLBatch: (NSArray *) inputs maxConcurrency: (NSUInteger) maxConcurrency;
+
 @end
@@ -38,11 +38,197 @@
 #import "AQXMLDocument.h"
 #import "AQXMLUtilities.h"
 #import "AQXML_Private.h"
+#import "xml_arena.h"
+#import <stdatomic.h>
+#import <pthread.h>
+
+static pthread_key_t    __parserContextKey;
+static pthread_once_t   __parserContextOnce = PTHREAD_ONCE_INIT;
+
+static void _FreeThreadParserContext( void * ctx )
+{
+    xmlFreeParserCtxt((xmlParserCtxtPtr)ctx);
+}
+
+static void _CreateParserContextKey( void )
+{
+    pthread_key_create(&__parserContextKey, _FreeThreadParserContext);
+}
+
+// each thread keeps one parser context, reset between documents and freed when the thread exits
+static xmlParserCtxtPtr _ThreadParserContext( void )
+{
+    pthread_once(&__parserContextOnce, _CreateParserContextKey);
+    
+    xmlParserCtxtPtr ctx = pthread_getspecific(__parserContextKey);
+    if ( ctx == NULL )
+    {
+        ctx = xmlNewParserCtxt();
+        if ( ctx != NULL )
+            pthread_setspecific(__parserContextKey, ctx);
+    }
+    
+    return ( ctx );
+}
+
+static AQXMLDocument * _DocumentFromParse( xmlParserCtxtPtr ctx, xmlDocPtr doc, NSError ** error )
+{
+    if ( doc == NULL )
+    {
+        if ( error != NULL )
+        {
+            xmlError *err = xmlCtxtGetLastError(ctx);
+            *error = [NSError errorWithXMLError: err];
+        }
+        
+        return ( nil );
+    }
+    
+    if ( xmlDocGetRootElement(doc) == NULL )
+    {
+        xmlFreeDoc(doc);
+        return ( nil );
+    }
+    
+    return ( [AQXMLDocument documentWithXMLDocument: doc] );
+}
+
+static AQXMLDocument * _ParseXMLWithContext( xmlParserCtxtPtr ctx, const char * xml, NSUInteger length, NSError ** error )
+{
+    // xmlCtxtReadMemory() resets the context first, so contexts can be reused between documents
+    xmlDocPtr doc = xmlCtxtReadMemory(ctx, xml, (int)length, NULL, NULL, XML_PARSE_DTDATTR|XML_PARSE_NOENT);
+    return ( _DocumentFromParse(ctx, doc, error) );
+}
+
+static AQXMLDocument * _ParseXMLOnThreadContext( const char * xml, NSUInteger length, NSError ** error )
+{
+    xmlParserCtxtPtr ctx = _ThreadParserContext();
+    if ( ctx == NULL )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"Unable to allocate XML parser context"];
+        return ( nil );
+    }
+    
+    // resetting the context keeps its dictionary, and every document parsed with it adds its names;
+    // each document holds its own reference, so giving the context a new one stops it growing unbounded
+    xmlDictPtr dict = xmlDictCreate();
+    if ( dict == NULL )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"Unable to allocate XML dictionary"];
+        return ( nil );
+    }
+    
+    xmlDictFree(ctx->dict);
+    ctx->dict = dict;
+    
+    // the context caches these from its dictionary
+    ctx->str_xml = xmlDictLookup(dict, BAD_CAST "xml", 3);
+    ctx->str_xmlns = xmlDictLookup(dict, BAD_CAST "xmlns", 5);
+    ctx->str_xml_ns = xmlDictLookup(dict, XML_XML_NAMESPACE, 36);
+    
+    AQXMLDocument * result = _ParseXMLWithContext(ctx, xml, length, error);
+    
+    // drop the input buffers & error state now, rather than holding them until the next parse
+    xmlCtxtReset(ctx);
+    return ( result );
+}
+
+#if AQXML_USE_ARENA_ALLOCATOR
+static AQXMLDocument * _ParseXMLInArena( const char * xml, NSUInteger length, NSError ** error )
+{
+    // the context, its input buffers & its dictionary are set up before entering the arena, so
+    // they're released as usual (the dictionary along with the document); only what the parse
+    // itself allocates, the tree above all, comes from the arena
+    xmlParserCtxtPtr ctx = xmlCreateMemoryParserCtxt(xml, (int)length);
+    if ( ctx == NULL )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"Unable to allocate XML parser context"];
+        return ( nil );
+    }
+    
+    xmlCtxtUseOptions(ctx, XML_PARSE_DTDATTR|XML_PARSE_NOENT);
+    
+    AQXMLArena * arena = AQXMLArenaCreate();
+    if ( arena == NULL )
+    {
+        xmlFreeParserCtxt(ctx);
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"Unable to allocate XML arena"];
+        return ( nil );
+    }
+    
+    AQXMLArenaEnter(arena);
+    xmlParseDocument(ctx);
+    AQXMLArenaLeave(arena);
+    
+    xmlDocPtr doc = ctx->myDoc;
+    ctx->myDoc = NULL;
+    if ( doc != NULL && ctx->wellFormed == 0 )
+    {
+        xmlFreeDoc(doc);
+        doc = NULL;
+    }
+    
+    if ( doc != NULL )
+        AQXMLArenaSetDocument(arena, doc);
+    
+    AQXMLDocument * result = _DocumentFromParse(ctx, doc, error);
+    
+    // the context may still point into the arena (its error state, grown tables), so it goes first
+    xmlFreeParserCtxt(ctx);
+    
+    // on success the document's wrapper owns the arena
+    if ( result == nil )
+        AQXMLArenaDestroy(arena);
+    return ( result );
+}
+#endif
+
+static id _ParseBatchItem( id input )
+{
+    NSError * error = nil;
+    NSData * data = input;
+    if ( [input isKindOfClass: [NSURL class]] )
+    {
+        NSDataReadingOptions options = ([input isFileURL] ? NSDataReadingMappedIfSafe : 0);
+        data = [NSData dataWithContentsOfURL: input options: options error: &error];
+        if ( data == nil )
+            return ( error );
+    }
+    else if ( [input isKindOfClass: [NSData class]] == NO )
+    {
+        return ( [NSError xmlGenericErrorWithDescription: [NSString stringWithFormat: @"Cannot parse XML from %@", input]] );
+    }
+    
+    if ( [data length] > INT_MAX )
+        return ( [NSError xmlGenericErrorWithDescription: @"XML input is too large to parse in memory"] );
+    
+    AQXMLDocument * doc = _ParseXMLOnThreadContext((const char *)[data bytes], [data length], &error);
+    if ( doc != nil )
+        return ( doc );
+    
+    if ( error == nil )
+        error = [NSError xmlGenericErrorWithDescription: @"XML document has no root element"];
+    return ( error );
+}
 
 @implementation AQXMLReader
 
 + (AQXMLDocument *) parseXMLFileAtURL: (NSURL *) url error: (NSError **) error
 {
+    if ( [url isFileURL] )
+    {
+        // map the file and let libxml read it in place, detecting the encoding itself
+        NSData * data = [NSData dataWithContentsOfURL: url options: NSDataReadingMappedIfSafe error: error];
+        if ( data == nil )
+            return ( nil );
+        
+        return ( [self parseXMLData: data error: error] );
+    }
+    
     NSStringEncoding enc = NSUTF8StringEncoding;
     NSString * str = [NSString stringWithContentsOfURL: url usedEncoding: &enc error: error];
     if ( str == nil )
@@ -57,38 +243,90 @@
     return ( [self parseXML: [string UTF8String] length: strlen(xml) error: error] );
 }
 
++ (AQXMLDocument *) parseXMLData: (NSData *) data error: (NSError **) error
+{
+    if ( [data length] > INT_MAX )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"XML input is too large to parse in memory"];
+        return ( nil );
+    }
+    
+    return ( [self parseXML: (const char *)[data bytes] length: [data length] error: error] );
+}
+
++ (AQXMLDocument *) parseXMLData: (NSData *) data options: (AQXMLReaderOptions) options error: (NSError **) error
+{
+    if ( [data length] > INT_MAX )
+    {
+        if ( error != NULL )
+            *error = [NSError xmlGenericErrorWithDescription: @"XML input is too large to parse in memory"];
+        return ( nil );
+    }
+    
+    return ( [self parseXML: (const char *)[data bytes] length: [data length] options: options error: error] );
+}
+
 + (AQXMLDocument *) parseXML: (const char *) xml length: (NSUInteger) length error: (NSError **) error
 {
     if ( xml == NULL )
         return ( nil );
     
-    AQXMLDocument * result = nil;
-    @synchronized(self)
-    {
-        xmlParserCtxtPtr ctx = xmlNewParserCtxt();
-        xmlDocPtr doc = xmlCtxtReadMemory(ctx, xml, (int)length, NULL, NULL, XML_PARSE_DTDATTR|XML_PARSE_NOENT|XML_PARSE_DTDATTR);
-        if ( doc == NULL )
+    return ( _ParseXMLOnThreadContext(xml, length, error) );
+}
+
++ (AQXMLDocument *) parseXML: (const char *) xml length: (NSUInteger) length
+                     options: (AQXMLReaderOptions) options error: (NSError **) error
+{
+    if ( xml == NULL )
+        return ( nil );
+    
+#if AQXML_USE_ARENA_ALLOCATOR
+    if ( (options & AQXMLReaderUseArenaAllocator) != 0 )
+        return ( _ParseXMLInArena(xml, length, error) );
+#endif
+    
+    return ( _ParseXMLOnThreadContext(xml, length, error) );
+}
+
++ (NSArray *) parseXMLBatch: (NSArray *) inputs maxConcurrency: (NSUInteger) maxConcurrency
+{
+    NSUInteger count = [inputs count];
+    if ( count == 0 )
+        return ( @[] );
+    
+    if ( maxConcurrency == 0 )
+        maxConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSUInteger numWorkers = MIN(count, maxConcurrency);
+    
+    // results are parked here (retained) by index, so workers never share a collection
+    void ** slots = calloc(count, sizeof(void *));
+    if ( slots == NULL )
+        return ( nil );
+    
+    // each worker pulls the next unparsed input until none remain, reusing its thread's parser context
+    // dispatch_apply() doesn't return until every worker has, so the counter can live on this stack
+    atomic_size_t nextIndex = ATOMIC_VAR_INIT(0);
+    atomic_size_t * next = &nextIndex;
+    dispatch_apply(numWorkers, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t worker) {
+        NSUInteger i;
+        while ( (i = atomic_fetch_add(next, 1)) < count )
         {
-            if ( error != NULL )
+            @autoreleasepool
             {
-                xmlError *err = xmlCtxtGetLastError(ctx);
-                *error = [NSError errorWithXMLError: err];
+                slots[i] = (void *)CFBridgingRetain(_ParseBatchItem(inputs[i]));
             }
         }
-        else if ( xmlDocGetRootElement(doc) == NULL )
-        {
-            xmlFreeDoc(doc);
-        }
-        else
-        {
-            result = [AQXMLDocument documentWithXMLDocument: doc];
-        }
-        
-        xmlClearParserCtxt(ctx);
-        xmlFreeParserCtxt(ctx);
+    });
+    
+    NSMutableArray * results = [[NSMutableArray alloc] initWithCapacity: count];
+    for ( NSUInteger i = 0; i < count; i++ )
+    {
+        [results addObject: CFBridgingRelease(slots[i])];
     }
     
-    return ( result );
+    free(slots);
+    return ( results );
 }
 
 @end
@@ -129,7 +129,7 @@ static void _XPathBlockFunctionWrapper(xmlXPathParserContextPtr ctx, int nargs)
 {
     if ( _ctx == NULL || _ctx->doc == NULL )
         return ( nil );
-    return ( (__bridge AQXMLDocument *)_ctx->doc->_private );
+    return ( AQXMLWrapperForNode((xmlNodePtr)_ctx->doc) );
 }
 
 - (NSString *) description
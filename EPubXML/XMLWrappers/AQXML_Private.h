@@ -65,6 +65,8 @@
 + (AQXMLNodeSet *) nodeSetWithXMLNodeSet: (xmlNodeSetPtr) nodeSet;
 - (id) initWithXMLNodeSet: (xmlNodeSetPtr) nodeSet;
 @property (nonatomic, readonly) xmlNodeSetPtr xmlObj;
+// hashed membership of the set's nodes, for AQXMLNodeSetIsVisibleCallback()
+@property (nonatomic, readonly) CFSetRef visibilityIndex;
 @end
 
 @interface AQXMLElement ()
@@ -85,5 +87,27 @@
 @interface AQXMLNamespace ()
 + (AQXMLNamespace *) namespaceWithXMLNamespace: (xmlNsPtr) ns;
 - (id) initWithXMLNamespace: (xmlNsPtr) ns;
+// wraps a private copy of a namespace entry from an xmlNodeSet, without publishing it
++ (AQXMLNamespace *) namespaceWithNodeSetEntry: (xmlNsPtr) ns;
+- (id) initWithNodeSetEntry: (xmlNsPtr) ns;
 @property (nonatomic, readonly) xmlNsPtr xmlObj;
+// keeps an arena-backed document alive while this namespace is
+@property (nonatomic, strong) AQXMLDocument * arenaDocument;
 @end
+
+__BEGIN_DECLS
+
+// returns the wrapper for a libxml node or namespace, creating it on first use
+extern id AQXMLWrapperForNode(xmlNodePtr node);
+extern id AQXMLWrapperForNamespace(xmlNsPtr ns, xmlDocPtr doc);
+
+// wrapper initializers publish themselves in a node's _private slot with these;
+// weakCell is non-NULL afterwards if the node lives in an arena
+extern id AQXMLPublishWrapper(void ** slot, id wrapper, void ** weakCell);
+extern id AQXMLPublishedWrapper(void * const * slot);
+extern void AQXMLRetireWrapperCell(void * weakCell);
+
+// an xmlC14NIsVisibleCallback; user_data is a node set's visibilityIndex
+extern int AQXMLNodeSetIsVisibleCallback(void * index, xmlNodePtr node, xmlNodePtr parent);
+
+__END_DECLS
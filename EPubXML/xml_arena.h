@@ -0,0 +1,73 @@
+//
+//  xml_arena.h
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-16.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+#import <libxml/tree.h>
+
+// A bump allocator for libxml trees. While an arena is entered on a thread, every
+// xmlMalloc() on that thread is served from the arena's chunks and xmlFree() of
+// arena memory does nothing; the whole tree is released by AQXMLArenaDestroy().
+typedef struct _AQXMLArena AQXMLArena;
+
+// Set to 0 to build without the arena allocator: libxml's memory functions are then left
+// alone, and documents asking for an arena are parsed onto the heap instead.
+#ifndef AQXML_USE_ARENA_ALLOCATOR
+# define AQXML_USE_ARENA_ALLOCATOR 1
+#endif
+
+__BEGIN_DECLS
+
+// replaces libxml's memory functions with the arena-aware ones; this has to happen once, as
+// the library loads and before libxml allocates anything. Until it has, no arena can be created.
+extern void AQXMLArenaInstallHooks(void);
+
+extern AQXMLArena * AQXMLArenaCreate(void);
+extern void AQXMLArenaDestroy(AQXMLArena * arena);
+
+extern void AQXMLArenaEnter(AQXMLArena * arena);
+extern void AQXMLArenaLeave(AQXMLArena * arena);
+
+// returns the arena which owns the given memory, or NULL if it came from the heap
+extern AQXMLArena * AQXMLArenaForPointer(const void * ptr);
+
+// the document the arena was built for, once it's been parsed
+extern void AQXMLArenaSetDocument(AQXMLArena * arena, xmlDocPtr doc);
+extern xmlDocPtr AQXMLArenaGetDocument(AQXMLArena * arena);
+
+// returns zeroed memory from the arena; may be called from any thread
+extern void * AQXMLArenaAlloc(AQXMLArena * arena, size_t size);
+
+__END_DECLS
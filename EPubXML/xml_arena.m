@@ -0,0 +1,388 @@
+//
+//  xml_arena.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-16.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "xml_arena.h"
+#import <libxml/parser.h>
+#import <libxml/xmlmemory.h>
+#import <libxml/xmlerror.h>
+#import <libxml/catalog.h>
+#import <stdatomic.h>
+#import <pthread.h>
+
+#define kArenaChunkShift        20
+#define kArenaChunkSize         ((size_t)1 << kArenaChunkShift)
+#define kArenaChunkMask         (~((uintptr_t)kArenaChunkSize - 1))
+#define kArenaAlignment         16
+#define kArenaHeaderSize        16      // holds each block's capacity, for realloc
+#define kArenaRegistrySize      16384   // power of two, tracks up to 16GB of live chunks
+#define kArenaTombstone         ((uintptr_t)1)
+
+struct _AQXMLArena
+{
+    pthread_mutex_t lock;
+    uint8_t *       cursor;
+    uint8_t *       limit;
+    
+    void **         runs;               // chunk runs, each a multiple of kArenaChunkSize
+    size_t *        runSizes;
+    NSUInteger      runCount;
+    NSUInteger      runCapacity;
+    
+    xmlDocPtr       document;           // set once the parse has produced one
+};
+
+// Arena memory is recognized by address: every chunk is aligned on kArenaChunkSize, and
+// its base is recorded here with its owner. Lookups don't lock, and anything not found
+// here goes back to the heap, including blocks allocated before the hooks were installed.
+static _Atomic(uintptr_t)       __chunkBases[kArenaRegistrySize];
+static _Atomic(AQXMLArena *)    __chunkOwners[kArenaRegistrySize];
+static atomic_int               __liveChunks = ATOMIC_VAR_INIT(0);
+static pthread_mutex_t          __registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t            __currentArenaKey;
+static BOOL                     __arenaHooksInstalled = NO;
+
+static xmlFreeFunc              __heapFree = NULL;
+static xmlMallocFunc            __heapMalloc = NULL;
+static xmlReallocFunc           __heapRealloc = NULL;
+static xmlStrdupFunc            __heapStrdup = NULL;
+
+static BOOL _RegisterRun( AQXMLArena * arena, void * run, size_t size )
+{
+    BOOL result = YES;
+    pthread_mutex_lock(&__registryLock);
+    
+    for ( uintptr_t base = (uintptr_t)run; base < (uintptr_t)run + size; base += kArenaChunkSize )
+    {
+        NSUInteger slot = (base >> kArenaChunkShift) & (kArenaRegistrySize - 1), probe = 0;
+        while ( probe < kArenaRegistrySize && atomic_load_explicit(&__chunkBases[slot], memory_order_relaxed) > kArenaTombstone )
+        {
+            slot = (slot + 1) & (kArenaRegistrySize - 1);
+            probe++;
+        }
+        
+        if ( probe == kArenaRegistrySize )
+        {
+            result = NO;
+            break;
+        }
+        
+        // the owner must be visible before the base is
+        atomic_store_explicit(&__chunkOwners[slot], arena, memory_order_relaxed);
+        atomic_store_explicit(&__chunkBases[slot], base, memory_order_release);
+        atomic_fetch_add(&__liveChunks, 1);
+    }
+    
+    pthread_mutex_unlock(&__registryLock);
+    return ( result );
+}
+
+static void _UnregisterRun( void * run, size_t size )
+{
+    pthread_mutex_lock(&__registryLock);
+    
+    for ( uintptr_t base = (uintptr_t)run; base < (uintptr_t)run + size; base += kArenaChunkSize )
+    {
+        NSUInteger slot = (base >> kArenaChunkShift) & (kArenaRegistrySize - 1);
+        for ( NSUInteger probe = 0; probe < kArenaRegistrySize; probe++ )
+        {
+            uintptr_t entry = atomic_load_explicit(&__chunkBases[slot], memory_order_relaxed);
+            if ( entry == 0 )
+                break;
+            
+            if ( entry == base )
+            {
+                atomic_store_explicit(&__chunkBases[slot], kArenaTombstone, memory_order_release);
+                atomic_fetch_sub(&__liveChunks, 1);
+                break;
+            }
+            
+            slot = (slot + 1) & (kArenaRegistrySize - 1);
+        }
+    }
+    
+    pthread_mutex_unlock(&__registryLock);
+}
+
+AQXMLArena * AQXMLArenaForPointer( const void * ptr )
+{
+    if ( ptr == NULL || atomic_load_explicit(&__liveChunks, memory_order_relaxed) == 0 )
+        return ( NULL );
+    
+    uintptr_t base = (uintptr_t)ptr & kArenaChunkMask;
+    NSUInteger slot = (base >> kArenaChunkShift) & (kArenaRegistrySize - 1);
+    for ( NSUInteger probe = 0; probe < kArenaRegistrySize; probe++ )
+    {
+        uintptr_t entry = atomic_load_explicit(&__chunkBases[slot], memory_order_acquire);
+        if ( entry == 0 )
+            break;
+        
+        // the acquire pairs with the release in _RegisterRun, so the owner is visible
+        if ( entry == base )
+            return ( atomic_load_explicit(&__chunkOwners[slot], memory_order_relaxed) );
+        
+        slot = (slot + 1) & (kArenaRegistrySize - 1);
+    }
+    
+    return ( NULL );
+}
+
+// allocates a run of chunks big enough for 'need' bytes; called with the arena locked
+static void * _AddRun( AQXMLArena * arena, size_t need, size_t * runSize )
+{
+    size_t size = (need + kArenaChunkSize - 1) & kArenaChunkMask;
+    if ( size < need )
+        return ( NULL );
+    
+    if ( arena->runCount == arena->runCapacity )
+    {
+        NSUInteger capacity = MAX(arena->runCapacity * 2, 16);
+        void ** runs = realloc(arena->runs, capacity * sizeof(void *));
+        if ( runs == NULL )
+            return ( NULL );
+        arena->runs = runs;
+        
+        size_t * sizes = realloc(arena->runSizes, capacity * sizeof(size_t));
+        if ( sizes == NULL )
+            return ( NULL );
+        arena->runSizes = sizes;
+        arena->runCapacity = capacity;
+    }
+    
+    void * run = NULL;
+    if ( posix_memalign(&run, kArenaChunkSize, size) != 0 )
+        return ( NULL );
+    
+    if ( _RegisterRun(arena, run, size) == NO )
+    {
+        _UnregisterRun(run, size);
+        free(run);
+        return ( NULL );
+    }
+    
+    arena->runs[arena->runCount] = run;
+    arena->runSizes[arena->runCount] = size;
+    arena->runCount++;
+    
+    *runSize = size;
+    return ( run );
+}
+
+static void * _ArenaBump( AQXMLArena * arena, size_t size )
+{
+    if ( size > SIZE_MAX / 2 )
+        return ( NULL );
+    
+    size_t capacity = (size + kArenaAlignment - 1) & ~((size_t)kArenaAlignment - 1);
+    size_t need = kArenaHeaderSize + capacity;
+    uint8_t * block = NULL;
+    
+    pthread_mutex_lock(&arena->lock);
+    
+    if ( arena->cursor + need <= arena->limit )
+    {
+        block = arena->cursor;
+        arena->cursor += need;
+    }
+    else
+    {
+        size_t runSize = 0;
+        uint8_t * run = _AddRun(arena, need, &runSize);
+        if ( run != NULL )
+        {
+            block = run;
+            
+            // big blocks get a run of their own; otherwise carry on from the new chunk
+            if ( need <= kArenaChunkSize / 2 )
+            {
+                arena->cursor = run + need;
+                arena->limit = run + runSize;
+            }
+        }
+    }
+    
+    pthread_mutex_unlock(&arena->lock);
+    
+    if ( block == NULL )
+        return ( NULL );
+    
+    *(size_t *)block = capacity;
+    return ( block + kArenaHeaderSize );
+}
+
+#pragma mark - libxml Memory Hooks
+
+static void * _ArenaMalloc( size_t size )
+{
+    AQXMLArena * arena = pthread_getspecific(__currentArenaKey);
+    if ( arena == NULL )
+        return ( __heapMalloc(size) );
+    return ( _ArenaBump(arena, size) );
+}
+
+static void _ArenaFree( void * ptr )
+{
+    // arena blocks are only released with the whole arena
+    if ( ptr == NULL || AQXMLArenaForPointer(ptr) != NULL )
+        return;
+    __heapFree(ptr);
+}
+
+static void * _ArenaRealloc( void * ptr, size_t size )
+{
+    if ( ptr == NULL )
+        return ( _ArenaMalloc(size) );
+    
+    AQXMLArena * arena = AQXMLArenaForPointer(ptr);
+    if ( arena == NULL )
+        return ( __heapRealloc(ptr, size) );
+    
+    size_t * capacity = (size_t *)((uint8_t *)ptr - kArenaHeaderSize);
+    if ( size <= *capacity )
+        return ( ptr );
+    
+    // growing the most recent block (typically a parser buffer) can happen in place
+    size_t grown = (size + kArenaAlignment - 1) & ~((size_t)kArenaAlignment - 1);
+    BOOL extended = NO;
+    pthread_mutex_lock(&arena->lock);
+    if ( (uint8_t *)ptr + *capacity == arena->cursor && (uint8_t *)ptr + grown <= arena->limit )
+    {
+        arena->cursor = (uint8_t *)ptr + grown;
+        *capacity = grown;
+        extended = YES;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    
+    if ( extended )
+        return ( ptr );
+    
+    void * result = _ArenaMalloc(size);
+    if ( result != NULL )
+        memcpy(result, ptr, *capacity);
+    return ( result );
+}
+
+static char * _ArenaStrdup( const char * str )
+{
+    size_t len = strlen(str) + 1;
+    char * result = _ArenaMalloc(len);
+    if ( result != NULL )
+        memcpy(result, str, len);
+    return ( result );
+}
+
+#pragma mark - Public API
+
+void AQXMLArenaInstallHooks( void )
+{
+    if ( __arenaHooksInstalled )
+        return;
+    
+    if ( pthread_key_create(&__currentArenaKey, NULL) != 0 )
+        return;
+    
+    xmlMemGet(&__heapFree, &__heapMalloc, &__heapRealloc, &__heapStrdup);
+    xmlMemSetup(_ArenaFree, _ArenaMalloc, _ArenaRealloc, _ArenaStrdup);
+    
+    // set up libxml's lazily-created globals now, so none of them land in an arena
+    xmlInitParser();
+#ifdef LIBXML_CATALOG_ENABLED
+    xmlInitializeCatalog();
+#endif
+    
+    __arenaHooksInstalled = YES;
+}
+
+AQXMLArena * AQXMLArenaCreate( void )
+{
+    if ( __arenaHooksInstalled == NO )
+        return ( NULL );
+    
+    AQXMLArena * arena = calloc(1, sizeof(AQXMLArena));
+    if ( arena != NULL && pthread_mutex_init(&arena->lock, NULL) != 0 )
+    {
+        free(arena);
+        arena = NULL;
+    }
+    return ( arena );
+}
+
+void AQXMLArenaDestroy( AQXMLArena * arena )
+{
+    if ( arena == NULL )
+        return;
+    
+    for ( NSUInteger i = 0; i < arena->runCount; i++ )
+    {
+        _UnregisterRun(arena->runs[i], arena->runSizes[i]);
+        free(arena->runs[i]);
+    }
+    
+    free(arena->runs);
+    free(arena->runSizes);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+void AQXMLArenaEnter( AQXMLArena * arena )
+{
+    pthread_setspecific(__currentArenaKey, arena);
+}
+
+void AQXMLArenaLeave( AQXMLArena * arena )
+{
+    // anything libxml stashed in its per-thread error state came from the arena
+    xmlResetLastError();
+    pthread_setspecific(__currentArenaKey, NULL);
+}
+
+void AQXMLArenaSetDocument( AQXMLArena * arena, xmlDocPtr doc )
+{
+    arena->document = doc;
+}
+
+xmlDocPtr AQXMLArenaGetDocument( AQXMLArena * arena )
+{
+    return ( arena->document );
+}
+
+void * AQXMLArenaAlloc( AQXMLArena * arena, size_t size )
+{
+    void * result = _ArenaBump(arena, size);
+    if ( result != NULL )
+        bzero(result, size);
+    return ( result );
+}
@@ -35,60 +35,215 @@
 //
 
 #import "AQXML_Private.h"
+#import "xml_arena.h"
 #import <libxml/globals.h>
+#import <stdatomic.h>
+#import <pthread.h>
 
-static xmlRegisterNodeFunc defNodeRegister = NULL;
-static xmlRegisterNodeFunc defThrNodeRegister = NULL;
 static xmlDeregisterNodeFunc defNodeDeregister = NULL;
 static xmlDeregisterNodeFunc defThrNodeDeregister = NULL;
 
-static void __registerNode(xmlNodePtr aNode)
+#define WEAK_WRAPPER_TAG    ((uintptr_t)1)
+
+static pthread_mutex_t __weakCellLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Nodes normally keep their wrapper alive with a retain, which the deregistration hook
+// gives back. Nodes in an arena are never freed one at a time, so they hold a zeroing weak
+// reference instead (a tagged pointer to a weak cell allocated in the arena), and their
+// wrappers keep the document, and with it the arena, alive.
+static id _WrapperFromSlotValue(void * value)
+{
+    if ( ((uintptr_t)value & WEAK_WRAPPER_TAG) == 0 )
+        return ( (__bridge id)value );
+    
+    __weak id * cell = (__weak id *)(void *)((uintptr_t)value & ~WEAK_WRAPPER_TAG);
+    return ( *cell );
+}
+
+static BOOL _SwapSlotValue(void ** slot, void * expected, void * desired)
+{
+    return ( atomic_compare_exchange_strong((_Atomic(void *) *)slot, &expected, desired) );
+}
+
+id AQXMLPublishedWrapper(void * const * slot)
+{
+    void * value = *slot;
+    if ( value == NULL )
+        return ( nil );
+    return ( _WrapperFromSlotValue(value) );
+}
+
+id AQXMLPublishWrapper(void ** slot, id wrapper, void ** weakCell)
+{
+    *weakCell = NULL;
+    
+    AQXMLArena * arena = AQXMLArenaForPointer(slot);
+    if ( arena == NULL )
+    {
+        void * retained = (void *)CFBridgingRetain(wrapper);
+        if ( _SwapSlotValue(slot, NULL, retained) )
+            return ( wrapper );
+        
+        CFRelease(retained);
+        return ( AQXMLPublishedWrapper(slot) );
+    }
+    
+    // a slot's weak cell is reused by each wrapper published there, so cells are only allocated
+    // once per node; the lock orders those stores against a dying wrapper retiring the same cell
+    id result = wrapper;
+    pthread_mutex_lock(&__weakCellLock);
+    
+    void * current = *slot;
+    if ( current == NULL )
+    {
+        __weak id * cell = (__weak id *)AQXMLArenaAlloc(arena, sizeof(id));
+        if ( cell != NULL )
+        {
+            *cell = wrapper;
+            *slot = (void *)((uintptr_t)cell | WEAK_WRAPPER_TAG);
+            *weakCell = (void *)cell;
+        }
+        else
+        {
+            result = nil;
+        }
+    }
+    else
+    {
+        id existing = _WrapperFromSlotValue(current);
+        if ( existing != nil )
+        {
+            result = existing;
+        }
+        else
+        {
+            // its wrapper has gone away
+            __weak id * cell = (__weak id *)(void *)((uintptr_t)current & ~WEAK_WRAPPER_TAG);
+            *cell = wrapper;
+            *weakCell = (void *)cell;
+        }
+    }
+    
+    pthread_mutex_unlock(&__weakCellLock);
+    return ( result );
+}
+
+void AQXMLRetireWrapperCell(void * weakCell)
 {
-    id obj = nil;
+    if ( weakCell == NULL )
+        return;
+    
+    // weak cells must be cleared before the arena holding them is destroyed, unless
+    // the cell has already been handed on to a live replacement
+    __weak id * cell = (__weak id *)weakCell;
+    
+    // held until after the unlock: a replacement released under the lock could reenter it from -dealloc
+    __attribute__((objc_precise_lifetime)) id occupant = nil;
+    pthread_mutex_lock(&__weakCellLock);
+    occupant = *cell;
+    if ( occupant == nil )
+        *cell = nil;
+    pthread_mutex_unlock(&__weakCellLock);
+}
+
+// Wrappers are no longer built for every node libxml creates; they're materialized
+// here the first time something asks for one. The wrapper's initializer publishes
+// itself in _private, and hands back any wrapper which beat it there.
+id AQXMLWrapperForNode(xmlNodePtr aNode)
+{
+    if ( aNode == NULL )
+        return ( nil );
+    
+    // namespaces are laid out differently; only the type field lines up
+    if ( aNode->type == XML_NAMESPACE_DECL )
+    {
+        // node sets hold copies of namespaces (with the owning element in 'next') which they free
+        // without deregistering, so those get a wrapper of their own that's never published in them
+        xmlNsPtr ns = (xmlNsPtr)aNode;
+        if ( ns->next != NULL && ns->next->type != XML_NAMESPACE_DECL )
+            return ( [AQXMLNamespace namespaceWithNodeSetEntry: ns] );
+        
+        return ( AQXMLWrapperForNamespace(ns, NULL) );
+    }
+    
+    id wrapper = AQXMLPublishedWrapper(&aNode->_private);
+    if ( wrapper != nil )
+        return ( wrapper );
+    
     switch ( aNode->type )
     {
         case XML_DOCUMENT_NODE:
         case XML_DOCUMENT_FRAG_NODE:
         case XML_HTML_DOCUMENT_NODE:
         case XML_DOCB_DOCUMENT_NODE:
-            obj = [AQXMLDocument documentWithXMLDocument: (xmlDocPtr)aNode];
-            break;
+            return ( [AQXMLDocument documentWithXMLDocument: (xmlDocPtr)aNode] );
             
         case XML_DTD_NODE:
-            obj = [AQXMLDTDNode DTDNodeWithXMLDTD: (xmlDtdPtr)aNode];
-            break;
-            
-        case XML_NAMESPACE_DECL:
-            obj = [AQXMLNamespace namespaceWithXMLNamespace: (xmlNsPtr)aNode];
-            break;
+            return ( [AQXMLDTDNode DTDNodeWithXMLDTD: (xmlDtdPtr)aNode] );
             
         case XML_ATTRIBUTE_NODE:
-            obj = [AQXMLAttribute attributeWithXMLNode: (xmlAttrPtr)aNode];
-            break;
+            return ( [AQXMLAttribute attributeWithXMLNode: (xmlAttrPtr)aNode] );
             
         default:
-            obj = [AQXMLNode nodeWithXMLNode: aNode];
             break;
     }
     
-    aNode->_private = (void *)CFBridgingRetain(obj);
+    return ( [AQXMLNode nodeWithXMLNode: aNode] );
+}
+
+id AQXMLWrapperForNamespace(xmlNsPtr ns, xmlDocPtr doc)
+{
+    if ( ns == NULL )
+        return ( nil );
+    
+    // a namespace in an arena has to keep its document alive, as its weak cell lives in the
+    // arena too; callers which only have the namespace get the document the arena was built for
+    AQXMLArena * arena = AQXMLArenaForPointer(ns);
+    if ( arena != NULL )
+    {
+        if ( doc == NULL )
+            doc = AQXMLArenaGetDocument(arena);
+        if ( doc == NULL )
+            return ( nil );
+    }
+    
+    AQXMLNamespace * wrapper = AQXMLPublishedWrapper(&ns->_private);
+    if ( wrapper == nil )
+        wrapper = [AQXMLNamespace namespaceWithXMLNamespace: ns];
+    
+    if ( arena != NULL && wrapper.arenaDocument == nil )
+        wrapper.arenaDocument = AQXMLWrapperForNode((xmlNodePtr)doc);
+    
+    return ( wrapper );
 }
 
 static void __deregisterNode(xmlNodePtr aNode)
 {
-    if ( aNode->_private == NULL )
+    void * value = aNode->_private;
+    if ( value == NULL )
+        return;
+    
+    if ( (uintptr_t)value & WEAK_WRAPPER_TAG )
+    {
+        // the wrapper isn't ours to release
+        aNode->_private = NULL;
+        [_WrapperFromSlotValue(value) invalidate];
         return;
+    }
     
-    AQXMLObject * obj = CFBridgingRelease(aNode->_private);
+    AQXMLObject * obj = CFBridgingRelease(value);
     [obj invalidate];
 }
 
 __attribute__((constructor))
 static void __setupLibXML(void)
 {
+#if AQXML_USE_ARENA_ALLOCATOR
+    // libxml's memory functions are process-wide, so they're replaced before anything uses them
+    AQXMLArenaInstallHooks();
+#endif
+    
     xmlInitGlobals();
-    defNodeRegister = xmlRegisterNodeDefault(&__registerNode);
-    defThrNodeRegister = xmlThrDefRegisterNodeDefault(&__registerNode);
     defNodeDeregister = xmlDeregisterNodeDefault(&__deregisterNode);
     defThrNodeDeregister = xmlThrDefDeregisterNodeDefault(&__deregisterNode);
     
@@ -99,8 +254,6 @@ static void __setupLibXML(void)
 __attribute__((destructor))
 static void __resetLibXMLOverrides(void)
 {
-    xmlRegisterNodeDefault(defNodeRegister);
-    xmlThrDefRegisterNodeDefault(defThrNodeRegister);
     xmlDeregisterNodeDefault(defNodeDeregister);
     xmlThrDefDeregisterNodeDefault(defThrNodeDeregister);
 }
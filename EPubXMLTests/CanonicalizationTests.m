@@ -269,4 +269,268 @@
     [self runCaseCoreForName: @"NsContent"];
 }
 #endif
+
++ (NSArray *) libxmlMethods
+{
+    NSMutableArray * methods = [NSMutableArray new];
+    for ( NSNumber * method in @[@(AQXMLCanonicalizationMethod_1_0), @(AQXMLCanonicalizationMethod_exclusive_1_0), @(AQXMLCanonicalizationMethod_1_1)] )
+    {
+        [methods addObject: method];
+        [methods addObject: @([method unsignedCharValue] | AQXMLCanonicalizationMethod_with_comments)];
+    }
+    
+    return ( methods );
+}
+
+- (void) testConcurrentCanonicalizationMatchesSerial
+{
+    NSMutableString * xml = [NSMutableString stringWithString: @"<?pi before?><!-- before --><a:root xmlns:a=\"urn:a\" xmlns=\"urn:d\" xml:lang=\"en\">"];
+    for ( NSUInteger i = 0; i < 64; i++ )
+    {
+        switch ( i % 4 )
+        {
+            case 0: [xml appendFormat: @"<a:item n=\"%lu\" xmlns:b=\"urn:b\"><b:x>%lu</b:x></a:item>", (unsigned long)i, (unsigned long)i]; break;
+            case 1: [xml appendFormat: @"text %lu &amp; more ", (unsigned long)i]; break;
+            case 2: [xml appendFormat: @"<!-- comment %lu -->", (unsigned long)i]; break;
+            case 3: [xml appendFormat: @"<item xml:space=\"preserve\" a:n=\"%lu\"/>", (unsigned long)i]; break;
+        }
+    }
+    [xml appendString: @"</a:root><!-- after -->"];
+    
+    NSMutableArray * documents = [NSMutableArray new];
+    [documents addObject: [AQXMLDocument documentWithXMLString: xml error: NULL]];
+    for ( NSString * name in @[@"C14N3", @"NsPushdown", @"NsDefault", @"NsSort", @"NsRedecl", @"NsSuperfluous", @"NsXml"] )
+    {
+        NSError * error = nil;
+        AQXMLDocument * doc = [AQXMLDocument documentWithXMLData: [[self class] inputForTestNamed: name] error: &error];
+        STAssertNotNil(doc, @"Failed to load %@: %@", name, error);
+        if ( doc != nil )
+            [documents addObject: doc];
+    }
+    
+    for ( AQXMLDocument * doc in documents )
+    {
+        for ( NSNumber * method in [[self class] libxmlMethods] )
+        {
+            AQXMLCanonicalizationMethod m = [method unsignedCharValue];
+            NSData * serial = [AQXMLCanonicalizer canonicalizeDocument: doc usingMethod: m visibilityFilter: nil];
+            NSData * concurrent = [AQXMLCanonicalizer canonicalizeDocumentConcurrently: doc usingMethod: m];
+            STAssertNotNil(serial, @"Method %u failed", m);
+            STAssertEqualObjects(concurrent, serial, @"Method %u output differs for %@", m, doc.rootElement.name);
+        }
+    }
+}
+
+- (void) testElementCanonicalizationMatchesDocumentSubset
+{
+    // expected outputs are those of the whole document, with only the element's subtree visible
+    NSString * xml = @"<a:root xmlns:a=\"urn:a\" xmlns=\"urn:d\" xml:lang=\"en\"><!-- note --><b attr=\"1\" a:q=\"2\"><c>text</c><!-- in b --><a:d/></b><e/></a:root>";
+    NSString * inclusive = @"<b xmlns=\"urn:d\" xmlns:a=\"urn:a\" attr=\"1\" xml:lang=\"en\" a:q=\"2\">%@%@<a:d></a:d></b>";
+    NSString * exclusive = @"<b xmlns=\"urn:d\" xmlns:a=\"urn:a\" attr=\"1\" a:q=\"2\">%@%@<a:d></a:d></b>";
+    
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLString: xml error: NULL];
+    AQXMLElement * element = [doc.rootElement firstChildNamed: @"b"];
+    STAssertNotNil(element, @"Failed to find the test element");
+    
+    // the filter is handed the document's own nodes, so it can pick them out by identity;
+    // hiding an element leaves its content visible
+    AQXMLElement * cElement = [element firstChildNamed: @"c"];
+    NSArray * rootNamespaces = [doc.rootElement namespacesInScope];
+    NSMutableArray * foreignNodes = [NSMutableArray new];
+    BOOL (^hideC)(AQXMLNode *) = ^BOOL(AQXMLNode * node) {
+        if ( [node isKindOfClass: [AQXMLNamespace class]] )
+        {
+            if ( [rootNamespaces indexOfObjectIdenticalTo: node] == NSNotFound )
+                [foreignNodes addObject: node];
+        }
+        else if ( node.document != doc )
+        {
+            [foreignNodes addObject: node];
+        }
+        
+        return ( node != cElement );
+    };
+    
+    for ( NSNumber * method in [[self class] libxmlMethods] )
+    {
+        AQXMLCanonicalizationMethod m = [method unsignedCharValue];
+        NSString * format = ((m & 0x7f) == AQXMLCanonicalizationMethod_exclusive_1_0 ? exclusive : inclusive);
+        NSString * comment = ((m & AQXMLCanonicalizationMethod_with_comments) ? @"<!-- in b -->" : @"");
+        
+        NSString * expected = [NSString stringWithFormat: format, @"<c>text</c>", comment];
+        NSData * output = [AQXMLCanonicalizer canonicalizeElement: element usingMethod: m visibilityFilter: nil];
+        STAssertEqualObjects([[NSString alloc] initWithData: output encoding: NSUTF8StringEncoding], expected, @"Method %u output is wrong", m);
+        
+        expected = [NSString stringWithFormat: format, @"text", comment];
+        output = [AQXMLCanonicalizer canonicalizeElement: element usingMethod: m visibilityFilter: hideC];
+        STAssertEqualObjects([[NSString alloc] initWithData: output encoding: NSUTF8StringEncoding], expected, @"Method %u filtered output is wrong", m);
+        STAssertTrue([foreignNodes count] == 0, @"Method %u filter was handed nodes from outside the document: %@", m, foreignNodes);
+    }
+    
+    // the source document is untouched
+    STAssertEqualObjects(element.parent, doc.rootElement, @"Element moved by canonicalization");
+    STAssertEquals([[element children] count], (NSUInteger)3, @"Element's children changed by canonicalization");
+}
+
+- (void) testPipelinedStreamOutputMatchesData
+{
+    // several times the pipeline's high-water mark, so it has to pause for the reader
+    NSMutableString * xml = [NSMutableString stringWithString: @"<root xmlns=\"urn:r\">"];
+    for ( NSUInteger i = 0; i < 20000; i++ )
+        [xml appendFormat: @"<item n=\"%lu\" b=\"x\" a=\"y\">text %lu &amp; more</item>", (unsigned long)i, (unsigned long)i];
+    [xml appendString: @"</root>"];
+    NSData * input = [xml dataUsingEncoding: NSUTF8StringEncoding];
+    
+    NSMutableData * expected = [NSMutableData new];
+    NSError * error = nil;
+    STAssertTrue([[[AQXMLCanonicalizer alloc] initWithData: input] canonicalizeToData: expected error: &error], @"Canonicalization failed: %@", error);
+    
+    CFReadStreamRef readStream = NULL;
+    CFWriteStreamRef writeStream = NULL;
+    CFStreamCreateBoundPair(kCFAllocatorDefault, &readStream, &writeStream, 4096);
+    NSInputStream * reader = CFBridgingRelease(readStream);
+    NSOutputStream * writer = CFBridgingRelease(writeStream);
+    [reader open];
+    
+    dispatch_queue_t queue = dispatch_queue_create("CanonicalizationTests.pipeline", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    __block NSUInteger completionCount = 0;
+    __block NSError * completionError = nil;
+    
+    AQXMLCanonicalizer * canon = [[AQXMLCanonicalizer alloc] initWithData: input];
+    [canon canonicalizeToStream: writer parseQueue: queue completionHandler: ^(NSError * outError) {
+        completionCount++;
+        completionError = outError;
+        dispatch_semaphore_signal(done);
+    }];
+    
+    // nothing is read yet, so it can't have finished
+    STAssertTrue(dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 200 * NSEC_PER_MSEC)) != 0, @"Completed without its output being read");
+    
+    NSMutableData * output = [NSMutableData new];
+    uint8_t buf[1024];
+    BOOL finished = NO;
+    NSDate * deadline = [NSDate dateWithTimeIntervalSinceNow: 30.0];
+    while ( [deadline timeIntervalSinceNow] > 0.0 )
+    {
+        if ( [reader hasBytesAvailable] )
+        {
+            NSInteger len = [reader read: buf maxLength: sizeof(buf)];
+            if ( len <= 0 )
+                break;
+            [output appendBytes: buf length: len];
+        }
+        else if ( finished )
+        {
+            break;      // all written before the completion handler was called
+        }
+        else
+        {
+            finished = (dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_MSEC)) == 0);
+        }
+    }
+    
+    STAssertTrue(finished, @"Pipelined canonicalization never completed");
+    STAssertNil(completionError, @"Pipelined canonicalization failed: %@", completionError);
+    STAssertEqualObjects(output, expected, @"Pipelined output differs from -canonicalizeToData:");
+    
+    // a late second call would be queued behind the first
+    dispatch_sync(queue, ^{});
+    STAssertEquals(completionCount, (NSUInteger)1, @"Completion handler called %lu times", (unsigned long)completionCount);
+    
+    // the parser has consumed its input now, so a second run has to fail rather than produce nothing
+    NSOutputStream * memory = [NSOutputStream outputStreamToMemory];
+    [canon canonicalizeToStream: memory parseQueue: queue completionHandler: ^(NSError * outError) {
+        completionError = outError;
+        dispatch_semaphore_signal(done);
+    }];
+    STAssertTrue(dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)) == 0, @"Second run never completed");
+    STAssertNotNil(completionError, @"A second run over consumed input reported success");
+    
+    [reader close];
+    [writer close];
+}
+
+- (void) testNodeSetCanonicalizationMatchesContainmentFilter
+{
+    NSString * xml = @"<r xmlns=\"urn:d\" xmlns:a=\"urn:a\"><!-- c0 --><a:b x=\"1\"><c a:y=\"2\">t</c></a:b><d xmlns:e=\"urn:e\" z=\"3\"><e:f/>u</d><g/></r>";
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLString: xml error: NULL];
+    
+    // everything, namespace nodes included, but one subtree
+    for ( NSString * excluded in @[@"b", @"d"] )
+    {
+        NSString * query = [NSString stringWithFormat: @"(//. | //namespace::* | //@*)[not(ancestor-or-self::*[local-name()='%@'])]", excluded];
+        NSError * error = nil;
+        AQXMLNodeSet * nodeSet = [doc.rootElement evaluateXPath: query error: &error];
+        STAssertTrue([nodeSet isKindOfClass: [AQXMLNodeSet class]], @"Query %@ failed: %@", query, error);
+        
+        BOOL (^inSet)(AQXMLNode *) = ^BOOL(AQXMLNode * node) {
+            return ( [nodeSet containsNode: node] );
+        };
+        
+        for ( NSNumber * method in [[self class] libxmlMethods] )
+        {
+            AQXMLCanonicalizationMethod m = [method unsignedCharValue];
+            NSData * indexed = [AQXMLCanonicalizer canonicalizeNodeSet: nodeSet usingMethod: m];
+            NSData * filtered = [AQXMLCanonicalizer canonicalizeDocument: doc usingMethod: m visibilityFilter: inSet];
+            STAssertNotNil(indexed, @"Method %u failed without %@", m, excluded);
+            STAssertEqualObjects(indexed, filtered, @"Method %u node set output differs from the filter's without %@", m, excluded);
+        }
+        
+        // the namespace nodes were found at all
+        NSString * output = [[NSString alloc] initWithData: [AQXMLCanonicalizer canonicalizeNodeSet: nodeSet usingMethod: AQXMLCanonicalizationMethod_1_0] encoding: NSUTF8StringEncoding];
+        STAssertTrue([output hasPrefix: @"<r xmlns=\"urn:d\" xmlns:a=\"urn:a\">"], @"Namespaces missing without %@: %@", excluded, output);
+    }
+}
+
+- (void) testSelectionMatchesElementCanonicalization
+{
+    NSData * data = [@"<r xmlns:a=\"urn:a\"><a:b id=\"1\">t<c><a:b>in</a:b></c></a:b><d><a:b x=\"2\"/><e><c/></e></d><c>z</c></r>" dataUsingEncoding: NSUTF8StringEncoding];
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLData: data error: NULL];
+    AQXMLElement * idElement = [doc.rootElement firstChildNamed: @"a:b"];
+    AQXMLElement * dElement = [doc.rootElement firstChildNamed: @"d"];
+    NSDictionary * namespaces = @{ @"a" : @"urn:a" };
+    
+    NSMutableArray * methods = [[[self class] libxmlMethods] mutableCopy];
+    [methods addObject: @(AQXMLCanonicalizationMethod_2_0)];
+    
+    for ( NSNumber * method in methods )
+    {
+        AQXMLCanonicalizationMethod m = [method unsignedCharValue];
+        NSMutableData * output = [NSMutableData new];
+        BOOL (^handler)(const void *, NSUInteger, NSError **) = ^BOOL(const void * bytes, NSUInteger length, NSError ** outError) {
+            [output appendBytes: bytes length: length];
+            return ( YES );
+        };
+        
+        NSError * error = nil;
+        STAssertTrue([AQXMLCanonicalizer canonicalizeData: data usingMethod: m selectingElementWithID: @"1" outputHandler: handler error: &error], @"Method %u ID selection failed: %@", m, error);
+        STAssertEqualObjects(output, [AQXMLCanonicalizer canonicalizeElement: idElement usingMethod: m visibilityFilter: nil], @"Method %u ID selection differs from the element's canonical form", m);
+        
+        [output setLength: 0];
+        STAssertTrue([AQXMLCanonicalizer canonicalizeData: data usingMethod: m selectingPattern: @"/r/d" namespaces: namespaces outputHandler: handler error: &error], @"Method %u pattern selection failed: %@", m, error);
+        STAssertEqualObjects(output, [AQXMLCanonicalizer canonicalizeElement: dElement usingMethod: m visibilityFilter: nil], @"Method %u pattern selection differs from the element's canonical form", m);
+        
+        // a pattern may select nothing
+        [output setLength: 0];
+        STAssertTrue([AQXMLCanonicalizer canonicalizeData: data usingMethod: m selectingPattern: @"//a:missing" namespaces: namespaces outputHandler: handler error: &error], @"Method %u empty selection failed: %@", m, error);
+        STAssertEquals([output length], (NSUInteger)0, @"Method %u output something for an empty selection", m);
+        
+        // but an ID names an element which must exist
+        error = nil;
+        STAssertFalse([AQXMLCanonicalizer canonicalizeData: data usingMethod: m selectingElementWithID: @"missing" outputHandler: handler error: &error], @"Method %u selected a missing ID", m);
+        STAssertNotNil(error, @"Method %u gave no error for a missing ID", m);
+    }
+    
+    // several selected subtrees, each with its inherited namespaces, nested matches output once
+    NSMutableData * output = [NSMutableData new];
+    NSError * error = nil;
+    BOOL ok = [AQXMLCanonicalizer canonicalizeData: data usingMethod: AQXMLCanonicalizationMethod_1_0 selectingPattern: @"//a:b" namespaces: namespaces outputHandler: ^BOOL(const void * bytes, NSUInteger length, NSError ** outError) {
+        [output appendBytes: bytes length: length];
+        return ( YES );
+    } error: &error];
+    STAssertTrue(ok, @"Pattern selection failed: %@", error);
+    STAssertEqualObjects([[NSString alloc] initWithData: output encoding: NSUTF8StringEncoding], @"<a:b xmlns:a=\"urn:a\" id=\"1\">t<c><a:b>in</a:b></c></a:b><a:b xmlns:a=\"urn:a\" x=\"2\"></a:b>", @"Wrong output for several selected elements");
+}
+
 @end
@@ -0,0 +1,240 @@
+//
+//  ParserTests.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-24.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "ParserTests.h"
+#import "AQXMLParser.h"
+#import "AQXMLParserInputFilter.h"
+#import <fcntl.h>
+
+static NSString * const kTestDocument = @"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    @"<root xmlns=\"urn:test\" xmlns:a=\"urn:a\"><a:item id=\"1\">one</a:item>"
+    @"<a:item id=\"2\">two &amp; three</a:item><empty/></root>";
+
+@interface ParserTests () <AQXMLParserDelegate, AQXMLParserTokenDelegate>
+@end
+
+@implementation ParserTests
+{
+    NSMutableArray *    _events;
+    NSMutableString *   _characters;
+    
+    AQXMLNameToken      _itemToken;
+    AQXMLNameToken      _idToken;
+    AQXMLNameToken      _prefixToken;
+    AQXMLNameToken      _namespaceToken;
+    NSMutableArray *    _itemIDs;
+    NSMutableData *     _characterBytes;
+    NSUInteger          _mismatchedTokens;
+}
+
+- (void) setUp
+{
+    _events = [NSMutableArray new];
+    _characters = [NSMutableString new];
+    _itemIDs = [NSMutableArray new];
+    _characterBytes = [NSMutableData new];
+    _mismatchedTokens = 0;
+}
+
+- (void) parser: (AQXMLParser *) parser didStartElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI qualifiedName: (NSString *) qName attributes: (NSDictionary *) attributeDict
+{
+    [_events addObject: [NSString stringWithFormat: @"<%@>", elementName]];
+}
+
+- (void) parser: (AQXMLParser *) parser didEndElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI qualifiedName: (NSString *) qName
+{
+    [_events addObject: [NSString stringWithFormat: @"</%@>", elementName]];
+}
+
+- (void) parser: (AQXMLParser *) parser foundCharacters: (NSString *) string
+{
+    [_characters appendString: string];
+}
+
+- (void) parser: (AQXMLParser *) parser didStartElement: (AQXMLNameToken) localName
+         prefix: (AQXMLNameToken) prefix namespaceURI: (AQXMLNameToken) namespaceURI
+     attributes: (const AQXMLTokenAttribute *) attributes count: (NSUInteger) count
+{
+    // names are compared by pointer only
+    if ( localName != _itemToken )
+        return;
+    
+    if ( prefix != _prefixToken || namespaceURI != _namespaceToken || count != 1 || attributes[0].localName != _idToken )
+    {
+        _mismatchedTokens++;
+        return;
+    }
+    
+    [_itemIDs addObject: [[NSString alloc] initWithBytes: attributes[0].value.bytes length: attributes[0].value.length encoding: NSUTF8StringEncoding]];
+}
+
+- (void) parser: (AQXMLParser *) parser foundCharacterBytes: (AQXMLByteSlice) characters
+{
+    [_characterBytes appendBytes: characters.bytes length: characters.length];
+}
+
+- (NSArray *) expectedEvents
+{
+    return ( @[@"<root>", @"<item>", @"</item>", @"<item>", @"</item>", @"<empty>", @"</empty>", @"</root>"] );
+}
+
+- (AQXMLParser *) namespaceParserWithData: (NSData *) data
+{
+    AQXMLParser * parser = [[AQXMLParser alloc] initWithData: data];
+    parser.shouldProcessNamespaces = YES;
+    parser.delegate = self;
+    return ( parser );
+}
+
+- (void) testPullParseFromData
+{
+    AQXMLParser * parser = [self namespaceParserWithData: [kTestDocument dataUsingEncoding: NSUTF8StringEncoding]];
+    STAssertTrue([parser parseSynchronously], @"Pull parse failed: %@", parser.parserError);
+    STAssertEqualObjects(_events, [self expectedEvents], @"Wrong element events");
+    STAssertEqualObjects(_characters, @"onetwo & three", @"Wrong character content");
+    
+    // the input has been consumed
+    STAssertFalse([parser parseSynchronously], @"A finished parser parsed again");
+    STAssertFalse([parser parseNextChunk], @"A finished parser parsed again");
+}
+
+- (void) testPullParseFromFileDescriptor
+{
+    NSString * path = [NSTemporaryDirectory() stringByAppendingPathComponent: [[NSProcessInfo processInfo] globallyUniqueString]];
+    STAssertTrue([[kTestDocument dataUsingEncoding: NSUTF8StringEncoding] writeToFile: path atomically: NO], @"Couldn't write test input");
+    
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    STAssertTrue(fd >= 0, @"Couldn't open test input");
+    
+    AQXMLParser * parser = [[AQXMLParser alloc] initWithFileDescriptor: fd];
+    parser.shouldProcessNamespaces = YES;
+    parser.delegate = self;
+    
+    STAssertTrue([parser parseSynchronously], @"Pull parse failed: %@", parser.parserError);
+    STAssertEqualObjects(_events, [self expectedEvents], @"Wrong element events");
+    STAssertFalse([parser parseSynchronously], @"A finished parser parsed again");
+    
+    // the parser leaves the descriptor open
+    STAssertTrue(fcntl(fd, F_GETFD) != -1, @"The parser closed its file descriptor");
+    close(fd);
+    unlink([path fileSystemRepresentation]);
+}
+
+- (void) testTokenDelegateReportsInternedNames
+{
+    AQXMLParser * parser = [[AQXMLParser alloc] initWithData: [kTestDocument dataUsingEncoding: NSUTF8StringEncoding]];
+    parser.shouldProcessNamespaces = YES;
+    parser.shouldReportNamespacePrefixes = YES;
+    parser.tokenDelegate = self;
+    
+    // tokens are looked up before any input has been seen
+    _itemToken = [parser tokenForName: @"item"];
+    _idToken = [parser tokenForName: @"id"];
+    _prefixToken = [parser tokenForName: @"a"];
+    _namespaceToken = [parser tokenForName: @"urn:a"];
+    STAssertTrue(_itemToken == [parser tokenForName: @"item"], @"Equal names gave different tokens");
+    
+    STAssertTrue([parser parseSynchronously], @"Parse failed: %@", parser.parserError);
+    STAssertEquals(_mismatchedTokens, (NSUInteger)0, @"Reported tokens differ from those given by -tokenForName:");
+    STAssertEqualObjects(_itemIDs, (@[@"1", @"2"]), @"Wrong elements or attribute values reported");
+    STAssertEqualObjects(_characterBytes, [@"onetwo & three" dataUsingEncoding: NSUTF8StringEncoding], @"Wrong character bytes");
+}
+
+// feeds the input to the filter in pieces the way the parser does, holding back what it asks
+- (NSData *) filterInput: (NSData *) input withFilter: (id<AQXMLParserInputFilter>) filter splitAt: (NSArray *) splits
+{
+    NSMutableData * output = [NSMutableData new];
+    NSMutableData * held = [NSMutableData new];
+    NSUInteger offset = 0;
+    
+    for ( NSNumber * split in [splits arrayByAddingObject: @([input length])] )
+    {
+        NSUInteger next = [split unsignedIntegerValue];
+        [held appendBytes: (const uint8_t *)[input bytes] + offset length: next - offset];
+        offset = next;
+        
+        BOOL isFinal = (offset == [input length]);
+        NSUInteger keep = [filter filterBytes: [held mutableBytes] length: [held length] final: isFinal];
+        if ( isFinal && keep != 0 )
+            return ( nil );
+        
+        [output appendBytes: [held bytes] length: [held length] - keep];
+        [held replaceBytesInRange: NSMakeRange(0, [held length] - keep) withBytes: NULL length: 0];
+    }
+    
+    return ( output );
+}
+
+- (void) testByteFilterAcrossChunkBoundaries
+{
+    // the replacement ends with the start of the pattern, so must never be held back and rescanned
+    AQXMLByteReplacementFilter * filter = [[AQXMLByteReplacementFilter alloc] initWithPattern: [@"abc" dataUsingEncoding: NSUTF8StringEncoding] replacement: [@"xab" dataUsingEncoding: NSUTF8StringEncoding]];
+    NSData * input = [@"abcabc ab abcc aabcab cabcbc abab" dataUsingEncoding: NSUTF8StringEncoding];
+    
+    NSData * expected = [self filterInput: input withFilter: filter splitAt: @[]];
+    STAssertEqualObjects(expected, [@"xabxab ab xabc axabab cxabbc abab" dataUsingEncoding: NSUTF8StringEncoding], @"Wrong replacement of whole input");
+    
+    for ( NSUInteger i = 0; i <= [input length]; i++ )
+    {
+        NSData * output = [self filterInput: input withFilter: filter splitAt: @[@(i)]];
+        STAssertEqualObjects(output, expected, @"Wrong output with input split at %lu", (unsigned long)i);
+    }
+    
+    NSMutableArray * bytewise = [NSMutableArray new];
+    for ( NSUInteger i = 1; i < [input length]; i++ )
+        [bytewise addObject: @(i)];
+    STAssertEqualObjects([self filterInput: input withFilter: filter splitAt: bytewise], expected, @"Wrong output with input fed a byte at a time");
+}
+
+- (void) testParserAppliesInputFilter
+{
+    // U+0013 isn't a legal XML character, so this only parses once filtered
+    NSData * data = [@"<root>a&#x13;b</root>" dataUsingEncoding: NSUTF8StringEncoding];
+    AQXMLParser * parser = [self namespaceParserWithData: data];
+    parser.inputFilter = [[AQXMLByteReplacementFilter alloc] initWithPattern: [@"&#x13;" dataUsingEncoding: NSUTF8StringEncoding] replacement: [@"&#x20;" dataUsingEncoding: NSUTF8StringEncoding]];
+    
+    STAssertTrue([parser parseSynchronously], @"Filtered parse failed: %@", parser.parserError);
+    STAssertEqualObjects(_characters, @"a b", @"Input filter not applied");
+}
+
+- (void) testPullParseReportsMalformedInput
+{
+    AQXMLParser * parser = [self namespaceParserWithData: [@"<root><open></root>" dataUsingEncoding: NSUTF8StringEncoding]];
+    STAssertFalse([parser parseSynchronously], @"Malformed input parsed successfully");
+    STAssertNotNil(parser.parserError, @"No error reported for malformed input");
+}
+
+@end
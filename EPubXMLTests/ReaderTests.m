@@ -0,0 +1,152 @@
+//
+//  ReaderTests.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-24.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "ReaderTests.h"
+#import <EPubXML/EPubXML.h>
+
+@implementation ReaderTests
+
++ (NSData *) documentNumbered: (NSUInteger) number
+{
+    NSMutableString * xml = [NSMutableString stringWithFormat: @"<doc xmlns=\"urn:doc\" xmlns:n=\"urn:n%lu\" n:number=\"%lu\">", (unsigned long)number, (unsigned long)number];
+    for ( NSUInteger i = 0; i <= number % 7; i++ )
+        [xml appendFormat: @"<n:item n:index=\"%lu\">item %lu of document %lu</n:item>", (unsigned long)i, (unsigned long)i, (unsigned long)number];
+    [xml appendString: @"</doc>"];
+    return ( [xml dataUsingEncoding: NSUTF8StringEncoding] );
+}
+
+- (void) testBatchParseMatchesSerialParse
+{
+    NSMutableArray * inputs = [NSMutableArray new];
+    for ( NSUInteger i = 0; i < 32; i++ )
+        [inputs addObject: [[self class] documentNumbered: i]];
+    
+    NSURL * url = [NSURL fileURLWithPath: [NSTemporaryDirectory() stringByAppendingPathComponent: [[NSProcessInfo processInfo] globallyUniqueString]]];
+    STAssertTrue([[[self class] documentNumbered: 99] writeToURL: url atomically: NO], @"Couldn't write test input");
+    [inputs addObject: url];
+    
+    NSUInteger malformedIndex = [inputs count];
+    [inputs addObject: [@"<doc><unclosed></doc>" dataUsingEncoding: NSUTF8StringEncoding]];
+    
+    NSArray * results = [AQXMLReader parseXMLBatch: inputs maxConcurrency: 4];
+    STAssertEquals([results count], [inputs count], @"Wrong number of results");
+    
+    [inputs enumerateObjectsUsingBlock: ^(id input, NSUInteger idx, BOOL *stop) {
+        id result = results[idx];
+        if ( idx == malformedIndex )
+        {
+            STAssertTrue([result isKindOfClass: [NSError class]], @"Malformed input %lu gave %@", (unsigned long)idx, result);
+            return;
+        }
+        
+        NSError * error = nil;
+        AQXMLDocument * serial = nil;
+        if ( [input isKindOfClass: [NSURL class]] )
+            serial = [AQXMLReader parseXMLFileAtURL: input error: &error];
+        else
+            serial = [AQXMLReader parseXMLData: input error: &error];
+        STAssertNotNil(serial, @"Serial parse of input %lu failed: %@", (unsigned long)idx, error);
+        
+        STAssertTrue([result isKindOfClass: [AQXMLDocument class]], @"Input %lu gave %@", (unsigned long)idx, result);
+        STAssertEqualObjects([result XMLString], serial.XMLString, @"Batch and serial parses of input %lu differ", (unsigned long)idx);
+    }];
+    
+    [[NSFileManager defaultManager] removeItemAtURL: url error: NULL];
+}
+
+- (void) testRepeatedParsesOnOneThread
+{
+    // each document has its own names, and all of them are kept until the end, so
+    // any sharing of the thread's parser state between them would show up here
+    NSMutableArray * documents = [NSMutableArray new];
+    for ( NSUInteger i = 0; i < 200; i++ )
+    {
+        NSString * xml = [NSString stringWithFormat: @"<root%lu xmlns:p%lu=\"urn:%lu\"><p%lu:child%lu attr%lu=\"%lu\"/></root%lu>", (unsigned long)i, (unsigned long)i, (unsigned long)i, (unsigned long)i, (unsigned long)i, (unsigned long)i, (unsigned long)i, (unsigned long)i];
+        NSError * error = nil;
+        AQXMLDocument * doc = [AQXMLReader parseXMLString: xml error: &error];
+        STAssertNotNil(doc, @"Parse %lu failed: %@", (unsigned long)i, error);
+        if ( doc != nil )
+            [documents addObject: doc];
+        
+        // a failure mustn't leave the context unusable for the next document
+        if ( i % 50 == 0 )
+            STAssertNil([AQXMLReader parseXMLString: @"<broken>" error: NULL], @"Malformed input parsed");
+    }
+    
+    [documents enumerateObjectsUsingBlock: ^(AQXMLDocument * doc, NSUInteger idx, BOOL *stop) {
+        AQXMLElement * root = doc.rootElement;
+        STAssertEqualObjects(root.name, ([NSString stringWithFormat: @"root%lu", (unsigned long)idx]), @"Document %lu has the wrong root", (unsigned long)idx);
+        
+        AQXMLElement * child = (AQXMLElement *)root.firstChild;
+        STAssertEqualObjects(child.name, ([NSString stringWithFormat: @"child%lu", (unsigned long)idx]), @"Document %lu has the wrong child", (unsigned long)idx);
+        STAssertEqualObjects(child.namespacePrefix, ([NSString stringWithFormat: @"p%lu", (unsigned long)idx]), @"Document %lu has the wrong prefix", (unsigned long)idx);
+        STAssertEqualObjects([child.ns.uri absoluteString], ([NSString stringWithFormat: @"urn:%lu", (unsigned long)idx]), @"Document %lu has the wrong namespace", (unsigned long)idx);
+    }];
+}
+
+- (void) testArenaDocumentsMatchOrdinaryDocuments
+{
+    for ( NSUInteger i = 0; i < 20; i++ )
+    {
+        NSData * data = [[self class] documentNumbered: i];
+        
+        NSError * error = nil;
+        AQXMLDocument * plain = [AQXMLReader parseXMLData: data error: &error];
+        STAssertNotNil(plain, @"Parse %lu failed: %@", (unsigned long)i, error);
+        
+        @autoreleasepool
+        {
+            AQXMLDocument * arena = [AQXMLReader parseXMLData: data options: AQXMLReaderUseArenaAllocator error: &error];
+            STAssertNotNil(arena, @"Arena parse %lu failed: %@", (unsigned long)i, error);
+            
+            STAssertEqualObjects(arena.XMLString, plain.XMLString, @"Arena document %lu differs", (unsigned long)i);
+            STAssertEqualObjects([arena canonicalizedStringUsingMethod: AQXMLCanonicalizationMethod_exclusive_1_0], [plain canonicalizedStringUsingMethod: AQXMLCanonicalizationMethod_exclusive_1_0], @"Arena document %lu canonicalizes differently", (unsigned long)i);
+            
+            // wrappers come and go while the document lives
+            NSUInteger count = [[arena.rootElement children] count];
+            for ( NSUInteger j = 0; j < 3; j++ )
+            {
+                @autoreleasepool
+                {
+                    STAssertEquals([[arena.rootElement children] count], count, @"Arena document %lu lost children", (unsigned long)i);
+                    STAssertEqualObjects([arena.rootElement.firstChild stringValue], ([NSString stringWithFormat: @"item 0 of document %lu", (unsigned long)i]), @"Arena document %lu has the wrong content", (unsigned long)i);
+                }
+            }
+        }
+    }
+}
+
+@end
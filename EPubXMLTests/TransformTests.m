@@ -0,0 +1,396 @@
+//
+//  TransformTests.m
+//  EPubXML
+//
+//  Created by Jim Dovey on 2013-01-24.
+//  Copyright (c) 2012-2013 Kobo, Inc.
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//  
+//  - Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  - Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in
+//    the documentation and/or other materials provided with the
+//    distribution.
+//  - Neither the name of Kobo, Inc. nor the names of its contributors
+//    may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//  
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+//  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+//  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+//  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "TransformTests.h"
+#import <EPubXML/EPubXML.h>
+#import "AQXMLMultiDigest.h"
+#import "AQXMLParser.h"
+
+// gathers whatever a streaming stage passes downstream
+@interface _TransformTestSink : NSObject <AQXMLStreamingTransform>
+@property (nonatomic, readonly) NSMutableData * data;
+@property (nonatomic, readonly) NSUInteger finishCount;
+@end
+
+@implementation _TransformTestSink
+
+- (id) init
+{
+    self = [super init];
+    if ( self == nil )
+        return ( nil );
+    
+    _data = [NSMutableData new];
+    
+    return ( self );
+}
+
+- (BOOL) consumeBytes: (const void *) bytes length: (NSUInteger) length
+{
+    [_data appendBytes: bytes length: length];
+    return ( YES );
+}
+
+- (BOOL) finish
+{
+    _finishCount++;
+    return ( YES );
+}
+
+@end
+
+@interface TransformTests () <AQXMLParserDelegate>
+@end
+
+@implementation TransformTests
+{
+    Base64Decoder *     _decoder;
+    NSUInteger          _characterRuns;
+}
+
+- (void) parser: (AQXMLParser *) parser foundCharacters: (NSString *) string
+{
+    _characterRuns++;
+    [_decoder consumeCharacters: string];
+}
+
++ (NSData *) testDocument
+{
+    NSMutableString * xml = [NSMutableString stringWithString: @"<doc xmlns=\"urn:doc\" xmlns:unused=\"urn:unused\"><!-- comment -->"];
+    for ( NSUInteger i = 0; i < 500; i++ )
+        [xml appendFormat: @"<item b=\"%lu\" a=\"x\">value &amp; %lu</item>\n", (unsigned long)i, (unsigned long)i];
+    [xml appendString: @"</doc>"];
+    return ( [xml dataUsingEncoding: NSUTF8StringEncoding] );
+}
+
++ (NSData *) bytesOfLength: (NSUInteger) length seed: (uint8_t) seed
+{
+    NSMutableData * data = [NSMutableData dataWithLength: length];
+    uint8_t * p = [data mutableBytes];
+    for ( NSUInteger i = 0; i < length; i++ )
+        p[i] = (uint8_t)((i * 131) + seed + (i >> 3));
+    return ( data );
+}
+
++ (NSData *) dataWithHexString: (NSString *) hex
+{
+    NSMutableData * data = [NSMutableData dataWithCapacity: [hex length] / 2];
+    for ( NSUInteger i = 0; i + 1 < [hex length]; i += 2 )
+    {
+        uint8_t byte = (uint8_t)strtoul([[hex substringWithRange: NSMakeRange(i, 2)] UTF8String], NULL, 16);
+        [data appendBytes: &byte length: 1];
+    }
+    
+    return ( data );
+}
+
+// line breaks and spaces of the kind found in signature documents, every so often
++ (NSData *) addWhitespaceNoise: (NSData *) encoded
+{
+    NSMutableData * noisy = [NSMutableData new];
+    const uint8_t * p = [encoded bytes];
+    for ( NSUInteger i = 0; i < [encoded length]; i++ )
+    {
+        if ( i % 19 == 5 )
+            [noisy appendBytes: "\r\n" length: 2];
+        else if ( i % 7 == 3 )
+            [noisy appendBytes: " \t" length: 2];
+        [noisy appendBytes: p + i length: 1];
+    }
+    [noisy appendBytes: "\n" length: 1];
+    
+    return ( noisy );
+}
+
++ (AQXMLTransform *) chainWithURIs: (NSArray *) uris
+{
+    AQXMLTransform * head = nil, * tail = nil;
+    for ( NSString * uri in uris )
+    {
+        AQXMLTransform * tx = [AQXMLTransform transformForURI: uri];
+        if ( head == nil )
+            head = tx;
+        else
+            tail.next = tx;
+        tail = tx;
+    }
+    
+    return ( head );
+}
+
+- (void) testFusedChainMatchesStagedChain
+{
+    NSArray * uris = @[AQXMLAlgorithmC14N10, AQXMLAlgorithmBase64, AQXMLAlgorithmSHA256];
+    NSData * input = [[self class] testDocument];
+    
+    AQXMLTransform * staged = [[self class] chainWithURIs: uris];
+    staged.input = input;
+    NSData * stagedOutput = [staged process];
+    STAssertNotNil(stagedOutput, @"Staged chain failed");
+    
+    AQXMLTransform * fused = [AQXMLFusedTransform transformByFusingChain: [[self class] chainWithURIs: uris]];
+    STAssertTrue([fused isKindOfClass: [AQXMLFusedTransform class]], @"Streaming stages weren't fused");
+    STAssertNil(fused.next, @"Streaming stages weren't all fused");
+    STAssertEquals([[(AQXMLFusedTransform *)fused stages] count], [uris count], @"Wrong number of fused stages");
+    
+    fused.input = input;
+    STAssertEqualObjects([fused process], stagedOutput, @"Fused and staged chains differ");
+    
+    // and both match doing each step by hand
+    NSData * canonical = [AQXMLCanonicalizer canonicalizeData: input usingMethod: AQXMLCanonicalizationMethod_1_0 visibilityFilter: nil];
+    NSData * encoded = [[Base64Transform encode: canonical] dataUsingEncoding: NSUTF8StringEncoding];
+    STAssertEqualObjects(stagedOutput, [[AQXMLDigest digestsOfMessages: @[encoded] withAlgorithm: AQXMLAlgorithmSHA256] lastObject], @"Chain output is wrong");
+}
+
+- (void) testStreamingBase64EncodeAcrossPieces
+{
+    for ( NSUInteger length = 0; length < 40; length++ )
+    {
+        NSData * input = [[self class] bytesOfLength: length seed: (uint8_t)length];
+        NSData * expected = [[Base64Transform encode: input] dataUsingEncoding: NSUTF8StringEncoding];
+        
+        for ( NSUInteger split = 0; split <= length; split++ )
+        {
+            Base64Transform * tx = [Base64Transform new];
+            _TransformTestSink * sink = [_TransformTestSink new];
+            tx.downstream = sink;
+            
+            const uint8_t * bytes = [input bytes];
+            STAssertTrue([tx consumeBytes: bytes length: split], @"Streaming encode failed");
+            for ( NSUInteger i = split; i < length; i++ )
+                STAssertTrue([tx consumeBytes: bytes + i length: 1], @"Streaming encode failed");
+            STAssertTrue([tx finish], @"Streaming encode failed");
+            
+            STAssertEqualObjects(sink.data, expected, @"Length %lu split at %lu encoded wrongly", (unsigned long)length, (unsigned long)split);
+            STAssertEquals(sink.finishCount, (NSUInteger)1, @"Downstream stage not finished exactly once");
+        }
+    }
+}
+
+- (void) testIncrementalDigestsMatchOneShot
+{
+    NSData * key = [[self class] bytesOfLength: 20 seed: 0x0b];
+    NSData * message = [[self class] bytesOfLength: 5000 seed: 7];
+    NSArray * algorithms = @[AQXMLAlgorithmSHA1, AQXMLAlgorithmSHA256, AQXMLAlgorithmSHA384, AQXMLAlgorithmSHA512,
+                             AQXMLAlgorithmHMACSHA1, AQXMLAlgorithmHMACSHA256, AQXMLAlgorithmHMACSHA384, AQXMLAlgorithmHMACSHA512];
+    
+    for ( NSString * algorithm in algorithms )
+    {
+        AQXMLDigest * oneShot = [AQXMLDigest digestWithAlgorithm: algorithm key: key];
+        STAssertNotNil(oneShot, @"No digest for %@", algorithm);
+        [oneShot updateWithData: message];
+        NSData * expected = [oneShot finalDigest];
+        
+        // pieces of awkward sizes, crossing every block boundary
+        AQXMLDigest * incremental = [AQXMLDigest digestWithAlgorithm: algorithm key: key];
+        const uint8_t * bytes = [message bytes];
+        NSUInteger offset = 0, piece = 1;
+        while ( offset < [message length] )
+        {
+            NSUInteger length = MIN(piece, [message length] - offset);
+            [incremental updateWithBytes: bytes + offset length: length];
+            offset += length;
+            piece = (piece * 3) % 257 + 1;
+        }
+        STAssertEqualObjects([incremental finalDigest], expected, @"Incremental %@ differs", algorithm);
+        
+        // finishing starts the context afresh
+        [incremental updateWithData: message];
+        STAssertEqualObjects([incremental finalDigest], expected, @"Reused %@ context differs", algorithm);
+    }
+    
+    // published test vectors: FIPS 180-2 and RFC 4231 case 2
+    AQXMLDigest * sha256 = [AQXMLDigest digestWithAlgorithm: AQXMLAlgorithmSHA256];
+    [sha256 updateWithBytes: "ab" length: 2];
+    [sha256 updateWithBytes: "c" length: 1];
+    STAssertEqualObjects([sha256 finalDigest], [[self class] dataWithHexString: @"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"], @"Wrong SHA-256 of 'abc'");
+    
+    AQXMLDigest * hmac = [AQXMLDigest digestWithAlgorithm: AQXMLAlgorithmHMACSHA256 key: [@"Jefe" dataUsingEncoding: NSUTF8StringEncoding]];
+    [hmac updateWithBytes: "what do ya want " length: 16];
+    [hmac updateWithBytes: "for nothing?" length: 12];
+    STAssertEqualObjects([hmac finalDigest], [[self class] dataWithHexString: @"5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843"], @"Wrong HMAC-SHA256");
+}
+
+- (void) testDigestTransformFedByCanonicalizer
+{
+    NSData * input = [[self class] testDocument];
+    NSData * canonical = [AQXMLCanonicalizer canonicalizeData: input usingMethod: AQXMLCanonicalizationMethod_exclusive_1_0 visibilityFilter: nil];
+    
+    AQXMLDigestTransform * tx = [AQXMLTransform transformForURI: AQXMLAlgorithmSHA256];
+    NSError * error = nil;
+    STAssertTrue([AQXMLCanonicalizer canonicalizeData: input usingMethod: AQXMLCanonicalizationMethod_exclusive_1_0 visibilityFilter: nil outputHandler: tx.outputHandler error: &error], @"Canonicalization failed: %@", error);
+    NSData * streamed = [tx finalizeDigest];
+    
+    tx.input = canonical;
+    STAssertEqualObjects(streamed, [tx process], @"Digest fed by the canonicalizer differs from digesting the canonical form");
+    
+    // an HMAC has no context until it has a key
+    AQXMLHMACTransform * hmac = [AQXMLTransform transformForURI: AQXMLAlgorithmHMACSHA256];
+    STAssertFalse([hmac update: canonical], @"Keyless HMAC accepted input");
+    hmac.keyData = [@"key" dataUsingEncoding: NSUTF8StringEncoding];
+    STAssertTrue([hmac updateWithStream: [NSInputStream inputStreamWithData: canonical]], @"HMAC failed to read a stream");
+    
+    AQXMLDigest * expected = [AQXMLDigest digestWithAlgorithm: AQXMLAlgorithmHMACSHA256 key: hmac.keyData];
+    [expected updateWithData: canonical];
+    STAssertEqualObjects([hmac finalizeDigest], [expected finalDigest], @"HMAC of a stream differs");
+}
+
+- (void) testMultiBufferSHA256MatchesDigest
+{
+    // every length from empty through just over two blocks, so each padding case is hit,
+    // in one batch so lanes finish at different times and pick up the next message
+    NSMutableArray * messages = [NSMutableArray new];
+    for ( NSUInteger length = 0; length <= 129; length++ )
+        [messages addObject: [[self class] bytesOfLength: length seed: (uint8_t)(length * 7)]];
+    [messages addObject: [[self class] bytesOfLength: 10000 seed: 3]];
+    
+    size_t count = [messages count];
+    const uint8_t ** bytes = malloc(count * sizeof(const uint8_t *));
+    size_t * lengths = malloc(count * sizeof(size_t));
+    uint8_t * digests = malloc(count * AQXML_SHA256_DIGEST_LENGTH);
+    for ( size_t i = 0; i < count; i++ )
+    {
+        bytes[i] = [messages[i] bytes];
+        lengths[i] = [messages[i] length];
+    }
+    
+    AQXMLSHA256MultiBuffer(bytes, lengths, count, digests);
+    
+    NSArray * batch = [AQXMLDigest digestsOfMessages: messages withAlgorithm: AQXMLAlgorithmSHA256];
+    STAssertEquals([batch count], (NSUInteger)count, @"Wrong number of batch digests");
+    
+    for ( size_t i = 0; i < count; i++ )
+    {
+        AQXMLDigest * digest = [AQXMLDigest digestWithAlgorithm: AQXMLAlgorithmSHA256];
+        [digest updateWithData: messages[i]];
+        NSData * expected = [digest finalDigest];
+        
+        NSData * multi = [NSData dataWithBytes: digests + (i * AQXML_SHA256_DIGEST_LENGTH) length: AQXML_SHA256_DIGEST_LENGTH];
+        STAssertEqualObjects(multi, expected, @"Multi-buffer digest of %lu bytes is wrong", (unsigned long)lengths[i]);
+        STAssertEqualObjects(batch[i], expected, @"Batch digest of %lu bytes is wrong", (unsigned long)lengths[i]);
+    }
+    
+    free(bytes);
+    free(lengths);
+    free(digests);
+    
+    // fewer messages than lanes
+    NSArray * pair = @[[@"abc" dataUsingEncoding: NSUTF8StringEncoding], [NSData data]];
+    NSArray * pairDigests = [AQXMLDigest digestsOfMessages: pair withAlgorithm: AQXMLAlgorithmSHA256];
+    STAssertEqualObjects(pairDigests[0], [[self class] dataWithHexString: @"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"], @"Wrong SHA-256 of 'abc'");
+    STAssertEqualObjects(pairDigests[1], [[self class] dataWithHexString: @"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"], @"Wrong SHA-256 of nothing");
+}
+
+- (void) testBase64RoundTrip
+{
+    // RFC 4648 test vectors
+    NSDictionary * vectors = @{ @"" : @"", @"f" : @"Zg==", @"fo" : @"Zm8=", @"foo" : @"Zm9v",
+                                @"foob" : @"Zm9vYg==", @"fooba" : @"Zm9vYmE=", @"foobar" : @"Zm9vYmFy" };
+    [vectors enumerateKeysAndObjectsUsingBlock: ^(NSString * plain, NSString * encoded, BOOL *stop) {
+        NSData * data = [plain dataUsingEncoding: NSUTF8StringEncoding];
+        STAssertEqualObjects([Base64Transform encode: data], encoded, @"Wrong encoding of '%@'", plain);
+        STAssertEqualObjects([Base64Transform decode: [encoded dataUsingEncoding: NSUTF8StringEncoding]], data, @"Wrong decoding of '%@'", encoded);
+    }];
+    
+    // long enough for the vector paths, with every possible tail
+    for ( NSUInteger length = 0; length < 200; length++ )
+    {
+        NSData * data = [[self class] bytesOfLength: length seed: (uint8_t)(length + 1)];
+        NSData * encoded = [[Base64Transform encode: data] dataUsingEncoding: NSUTF8StringEncoding];
+        STAssertEquals([encoded length], ((length + 2) / 3) * 4, @"Wrong encoded length for %lu bytes", (unsigned long)length);
+        
+        STAssertEqualObjects([Base64Transform decode: encoded], data, @"Round trip of %lu bytes failed", (unsigned long)length);
+        STAssertEqualObjects([Base64Transform decode: [[self class] addWhitespaceNoise: encoded]], data, @"Round trip of %lu bytes with whitespace failed", (unsigned long)length);
+    }
+}
+
+- (void) testBase64DecoderAcrossPieces
+{
+    NSData * data = [[self class] bytesOfLength: 100 seed: 9];
+    NSData * noisy = [[self class] addWhitespaceNoise: [[Base64Transform encode: data] dataUsingEncoding: NSUTF8StringEncoding]];
+    NSString * text = [[NSString alloc] initWithData: noisy encoding: NSUTF8StringEncoding];
+    
+    // two pieces, split everywhere, including mid-quad and mid-padding
+    for ( NSUInteger split = 0; split <= [text length]; split++ )
+    {
+        Base64Decoder * decoder = [Base64Decoder new];
+        STAssertTrue([decoder consumeCharacters: [text substringToIndex: split]], @"Decoding failed");
+        STAssertTrue([decoder consumeCharacters: [text substringFromIndex: split]], @"Decoding failed");
+        STAssertTrue([decoder finish], @"Decoding failed");
+        STAssertEqualObjects(decoder.decodedData, data, @"Wrong output with input split at %lu", (unsigned long)split);
+    }
+    
+    // a byte at a time, straight into a digest
+    AQXMLDigestTransform * digest = [AQXMLTransform transformForURI: AQXMLAlgorithmSHA256];
+    _TransformTestSink * sink = [_TransformTestSink new];
+    digest.downstream = sink;
+    
+    Base64Decoder * decoder = [Base64Decoder new];
+    decoder.downstream = digest;
+    const uint8_t * bytes = [noisy bytes];
+    for ( NSUInteger i = 0; i < [noisy length]; i++ )
+        STAssertTrue([decoder consumeBytes: bytes + i length: 1], @"Decoding failed");
+    STAssertTrue([decoder finish], @"Decoding failed");
+    
+    digest.input = data;
+    STAssertEqualObjects(sink.data, [digest process], @"Digest of streamed decoding is wrong");
+    STAssertEquals(sink.finishCount, (NSUInteger)1, @"Downstream stage not finished exactly once");
+}
+
+- (void) testBase64DecoderFromTextNodesAndParserEvents
+{
+    // the value is spread over text and CDATA nodes, with a comment in between
+    AQXMLDocument * doc = [AQXMLDocument documentWithXMLString: @"<v>\n  Zm9v<!-- c -->YmE<![CDATA[=\n]]></v>" error: NULL];
+    STAssertEqualObjects([Base64Decoder decodeTextOfElement: doc.rootElement], [@"fooba" dataUsingEncoding: NSUTF8StringEncoding], @"Wrong decoding of text nodes");
+    
+    NSData * data = [[self class] bytesOfLength: 3000 seed: 4];
+    NSData * encoded = [[self class] addWhitespaceNoise: [[Base64Transform encode: data] dataUsingEncoding: NSUTF8StringEncoding]];
+    NSMutableData * xml = [[@"<v>" dataUsingEncoding: NSUTF8StringEncoding] mutableCopy];
+    [xml appendData: encoded];
+    [xml appendData: [@"</v>" dataUsingEncoding: NSUTF8StringEncoding]];
+    
+    _decoder = [Base64Decoder new];
+    _characterRuns = 0;
+    AQXMLParser * parser = [[AQXMLParser alloc] initWithData: xml];
+    parser.delegate = self;
+    STAssertTrue([parser parseSynchronously], @"Parse failed: %@", parser.parserError);
+    STAssertTrue([_decoder finish], @"Decoding failed");
+    
+    STAssertTrue(_characterRuns > 1, @"Characters arrived in one run, so pieces weren't tested");
+    STAssertEqualObjects(_decoder.decodedData, data, @"Wrong decoding of parser character events");
+}
+
+@end